@@ -6,6 +6,7 @@ import numpy as np
 import subprocess
 import socket
 import serial
+import struct
 import time
 
 from PyQt5.QtWidgets import QApplication, QLabel, QWidget, QLineEdit, QPushButton, QVBoxLayout, QHBoxLayout, QSizePolicy, QShortcut
@@ -191,6 +192,13 @@ class MainWindow(QWidget):
     def __init__(self):
         super().__init__()
         self.socket = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+        # one compile server for the whole session instead of a conv and an
+        # assembler process per request
+        self.compiler = subprocess.Popen(
+            ["../compiler/bin/conv", "--server"],
+            stdin = subprocess.PIPE,
+            stdout = subprocess.PIPE,
+        )
         if len(sys.argv) > 1:
             self.addr = sys.argv[1]
         else:
@@ -369,52 +377,33 @@ class MainWindow(QWidget):
         z_rotation = f"{thetaz} "
         old_scale_factor = current_scale_factor
         self.total_scale_value.setText(f'Total Scale Value : {current_scale_factor:.5f}')
-        process = subprocess.Popen(
-            ["../compiler/bin/conv"],
-            stdin = subprocess.PIPE, # connect stdin over pipe
-            stdout = subprocess.PIPE, # connect stdout over pipe
-            stderr = subprocess.PIPE,
-            text = True
-        )
         if(mode_compiler):
             send_str = ".plotxy " + x_rotation + y_rotation + z_rotation + Received
         else:
             send_str = ".simple_plotxy " + z_minimum + ' ' + z_maximum + ' ' + Received #TODO add lims
-        vals, err = process.communicate(input=send_str)
-        process.terminate()
-        if err:
-            #print(err)
-            #print(send_str)
-            pass
-        if process.returncode != 0:
-            print(f"Error: {process.returncode}")
-            self.timer.label.setText(f'Error: Invalid Function')
-            self.setWindowTitle("Error Detected, Deleting Source Code...")
-            return
-        for program in vals.split('<'):
-            if (len(program.splitlines()) > 256):
+        status, vals = self.compile(send_str)
+        if status != 0:
+            print(f"Error: {vals.decode('utf-8', 'replace')}")
+            if b"instructions" in vals:
                 self.timer.label.setText(f'Error: Function too complex')
                 return
-        
-        process = subprocess.Popen(
-            ["../assembler/bin/assembler", "-f", "bin"],
-            stdin = subprocess.PIPE, # connect stdin over pipe
-            stdout = subprocess.PIPE, # connect stdout over pipe
-            stderr = subprocess.PIPE,
-        )
-        vals, err = process.communicate(input=vals.encode('utf-8'))
-        process.terminate()
-        if err:
-            #print(err)
-            pass
-        if process.returncode != 0:
-            print(f"Error: {process.returncode}")
-            self.timer.label.setText(f'Assembler Error CODE: {process.returncode}')
+            self.timer.label.setText(f'Error: Invalid Function')
+            self.setWindowTitle("Error Detected, Deleting Source Code...")
             return
         else:
             self.socket.sendto(vals, (self.addr, SEND_PORT))
         #print(".plotxy " + x_rotation + y_rotation + z_rotation + Received) # for testing purposes
 
+    def compile(self, source):
+        # request: 'S', uint32 length, source
+        # response: uint8 status, uint32 length, binary or error message
+        src = source.encode('utf-8')
+        self.compiler.stdin.write(b'S' + struct.pack('<I', len(src)) + src)
+        self.compiler.stdin.flush()
+        status = self.compiler.stdout.read(1)[0]
+        length = struct.unpack('<I', self.compiler.stdout.read(4))[0]
+        return status, self.compiler.stdout.read(length)
+
     def on_rotate_clicked(self, direction_axis):
         direction, axis = direction_axis
         global rotation_direction
@@ -0,0 +1,113 @@
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <chrono>
+#include <regex>
+#include <vector>
+#include <utility>
+#include <cstdlib>
+
+#include "lex.hpp"
+
+// Lexer microbenchmark: lexes a generated multi-megabyte .m file (a large
+// weight matrix literal like the ones in test/nnforward) with lex::Lex and
+// compares the throughput against the old regex based lexer, which is only
+// run on a prefix of the input because it is several orders of magnitude
+// slower.
+
+/// old lexer: compiles every token regex for every character read
+static lex::Token RegexLex(std::istream &inStream)
+{
+    static const std::vector<std::pair<std::string, lex::Token>> tokMap = {
+        {"\\$[a-zA-Z][a-zA-Z0-9_]*", lex::Token::VARNAME},
+        {"x", lex::Token::X}, {"y", lex::Token::Y},
+        {"\\.plot", lex::Token::PLOT}, {"\\.plotxy", lex::Token::PLOTXY},
+        {"\\.simple_plotxy", lex::Token::PLOTXY_SIMPLE},
+        {"\\.plotx", lex::Token::PLOTX}, {"\\+", lex::Token::PLUS},
+        {"-", lex::Token::MINUS}, {"\\*", lex::Token::MULT},
+        {"/", lex::Token::DIV}, {"dot", lex::Token::DOT},
+        {"\\^", lex::Token::POW}, {"\\.T", lex::Token::TRANSPOSE},
+        {"exp", lex::Token::EXP}, {"sin", lex::Token::SIN},
+        {"cos", lex::Token::COS}, {"sqrt", lex::Token::SQRT},
+        {"relu", lex::Token::RELU}, {"\\(", lex::Token::LROUND_BRACK},
+        {"\\)", lex::Token::RROUND_BRACK}, {"\\[", lex::Token::LSQUARE_BRACK},
+        {"\\]", lex::Token::RSQUARE_BRACK},
+        {"[0-9]+\\.([0-9]*)?", lex::Token::REAL}, {"[0-9]+", lex::Token::INT},
+        {",", lex::Token::COMMA}, {"=", lex::Token::EQUAL},
+        {"\\|", lex::Token::VERT_LINE},
+    };
+    while (std::isspace(inStream.peek())) {
+        inStream.get();
+    }
+    if (inStream.peek() == EOF) {
+        return lex::Token::_EOF_;
+    }
+    std::string token = "";
+    lex::Token res = lex::Token::ILLEGAL;
+    for (char out = inStream.get(); out != EOF; out = inStream.get()) {
+        token += out;
+        bool matched = false;
+        for (auto &[key, tok] : tokMap) {
+            std::regex rx {key};
+            if (std::regex_match(token, rx)) {
+                matched = true;
+                res = tok;
+            }
+        }
+        if (!matched && res != lex::Token::ILLEGAL) {
+            inStream.unget();
+            return res;
+        }
+    }
+    return res;
+}
+
+static std::string GenerateSource(std::size_t bytes)
+{
+    std::string src = "";
+    int rows = 0;
+    std::string body = "";
+    while (body.size() < bytes) {
+        body += "0.19746959, -0.16325366, 0.29853667, 0.07039442,\n";
+        rows++;
+    }
+    src += "$W = |" + std::to_string(rows) + ",4|[\n" + body + "]\n";
+    src += "$out = relu($W dot $in)\n.plot $out 0.0 1.0\n";
+    return src;
+}
+
+template <typename F>
+static std::pair<double, long> TimeLexer(const std::string &src, F lexFn)
+{
+    std::istringstream in {src};
+    long tokens = 0;
+    auto begin = std::chrono::steady_clock::now();
+    while (lexFn(in) != lex::Token::_EOF_) {
+        tokens++;
+    }
+    auto end = std::chrono::steady_clock::now();
+    return {std::chrono::duration<double>(end - begin).count(), tokens};
+}
+
+int main(int argc, char *argv[])
+{
+    std::size_t megabytes = argc > 1 ? std::atoi(argv[1]) : 4;
+    std::size_t regexBytes = argc > 2 ? std::atoi(argv[2]) : 16 * 1024;
+
+    std::string src = GenerateSource(megabytes * 1024 * 1024);
+    std::string prefix = GenerateSource(regexBytes);
+
+    auto [dfaTime, dfaTokens] = TimeLexer(src, [](std::istream &in) {
+        static int lineNo = 1;
+        return std::get<0>(lex::Lex(in, lineNo));
+    });
+    auto [regexTime, regexTokens] = TimeLexer(prefix, RegexLex);
+
+    double dfaRate = src.size() / dfaTime / (1024 * 1024);
+    double regexRate = prefix.size() / regexTime / (1024 * 1024);
+    std::cout << "dfa lexer:   " << src.size() << " bytes, " << dfaTokens
+              << " tokens in " << dfaTime << " s (" << dfaRate << " MiB/s)\n";
+    std::cout << "regex lexer: " << prefix.size() << " bytes, " << regexTokens
+              << " tokens in " << regexTime << " s (" << regexRate << " MiB/s)\n";
+    std::cout << "speedup:     " << dfaRate / regexRate << "x" << std::endl;
+}
@@ -5,155 +5,159 @@
 #include <string>
 #include <cmath>
 #include <cstdint>
+#include <vector>
+#include <span>
+#include <unordered_set>
 
 #include "codegen.hpp"
+#include "hash.hpp"
 #include "constants.hpp"
 #include "ast_visitor.hpp"
 
-
-class ASTNode
-{
-public:
-    virtual void Accept(ASTVisitor *visitor) const = 0;
-    virtual ~ASTNode() {}
+using NodeId = std::uint32_t;
+
+enum class NodeKind : std::uint8_t {
+    LIST,
+    ASSIGNMENT,
+    PLOT,
+    PLOTXY,
+    PLOTXY_SIMPLE,
+    PLOTX,
+    BIN_EXPR,
+    UNARY_EXPR,
+    POW,
+    VAR,
+    REAL_CONST,
+    ARRAY_LITERAL,
+    LOADED_ARRAY,
 };
 
-class ASTNodeList : public ASTNode
-{
-public:
-    ASTNodeList(std::shared_ptr<ASTNode> first) : nodeList_ {{first}} {}
-
-    void Accept(ASTVisitor *visitor) const override;
-
-    void Append(std::shared_ptr<ASTNode> node);
-private:
-    std::list<std::shared_ptr<ASTNode>> nodeList_;
+/// Compact node record. Children are indices into the owning AST and so are
+/// names, scalars and array data which live in the AST's side pools.
+///
+/// Meaning of a, b, c by kind:
+/// - LIST: statement, next list cell, last list cell (only kept up to date
+///   in the first cell)
+/// - ASSIGNMENT: variable name, rhs
+/// - PLOT: variable name, reals index of min (max follows)
+/// - PLOTXY: xyExpr, reals index of angleX (angleY, angleZ follow)
+/// - PLOTXY_SIMPLE: xyExpr, reals index of min (max follows)
+/// - PLOTX: xExpr
+/// - BIN_EXPR: op1, op2 with the operator in op
+/// - UNARY_EXPR: operand with the operator in op
+/// - POW: base, integer exponent (at least 2)
+/// - VAR: variable name
+/// - REAL_CONST: reals index of the value
+/// - ARRAY_LITERAL: ints index of the shape, shape dims, reals index of the
+///   elements (element count stored after the shape in ints)
+/// - LOADED_ARRAY: ints index of the shape, shape dims, words index of the
+///   padded TF18 data (name index of the file path stored after the shape in
+///   ints)
+struct ASTNodeRec {
+    NodeKind kind;
+    std::uint8_t op;
+    NodeId a;
+    NodeId b;
+    NodeId c;
 };
 
-class Assignment : public ASTNode
-{
-public:
-    Assignment(std::string varName, std::shared_ptr<ASTNode> rhs)
-        : varName_ {varName}, rhs_ {rhs}
-    {}
+class AST;
 
-    void Accept(ASTVisitor *visitor) const override;
-private:
-    std::string varName_;
-    std::shared_ptr<ASTNode> rhs_;
-};
-
-class PlotStatement : public ASTNode
+/// Lightweight handle to a node passed to the visitors in place of the node
+/// itself
+class ASTNodeRef
 {
 public:
-    PlotStatement(std::string varName, double min, double max)
-        : varName_ {varName}, min_ {min}, max_ {max}
-    {}
+    ASTNodeRef(const AST *ast, NodeId id) : ast_ {ast}, id_ {id} {}
 
-    void Accept(ASTVisitor *visitor) const override;
-private:
-    std::string varName_;
-    double min_, max_;
-};
-
-class PlotXYStatement : public ASTNode
-{
-public:
-    PlotXYStatement(double angleX, double angleY, double angleZ,
-            std::shared_ptr<ASTNode> xyExpr)
-        : angleX_ {angleX}, angleY_ {angleY}, angleZ_ {angleZ}, xyExpr_ {xyExpr}
-    {}
+    void Accept(ASTVisitor *visitor) const;
 
-    void Accept(ASTVisitor *visitor) const override;
+    NodeId Id() const { return id_; }
+    const AST &Tree() const { return *ast_; }
 private:
-    double angleX_, angleY_, angleZ_;
-    std::shared_ptr<ASTNode> xyExpr_;
+    const AST *ast_;
+    NodeId id_;
 };
 
-class PlotXYSimpleStatement : public ASTNode
+/// Arena holding every node of a program. Nodes are only ever appended, are
+/// never freed individually and refer to each other by index.
+class AST
 {
 public:
-    PlotXYSimpleStatement(double min, double max, std::shared_ptr<ASTNode> xyExpr)
-        : min_ {min}, max_ {max}, xyExpr_ {xyExpr}
-    {}
-
-    void Accept(ASTVisitor *visitor) const override;
-private:
-    double min_, max_;
-    std::shared_ptr<ASTNode> xyExpr_;
-};
-
-
-class PlotXStatement : public ASTNode
-{
-public:
-    PlotXStatement(std::shared_ptr<ASTNode> xExpr)
-        : xExpr_ {xExpr}
-    {}
-
-    void Accept(ASTVisitor *visitor) const override;
-private:
-    std::shared_ptr<ASTNode> xExpr_;
-};
-
-class BinaryExprNode : public ASTNode
-{
-public:
-    BinaryExprNode(CodeGen::BinaryOp opType,
-            std::shared_ptr<ASTNode> op1,
-            std::shared_ptr<ASTNode> op2)
-        : opType_ {opType}, op1_ {op1}, op2_ {op2}
-    {}
-
-    void Accept(ASTVisitor *visitor) const override;
-private:
-    CodeGen::BinaryOp opType_;
-    
-    std::shared_ptr<ASTNode> op1_;
-    std::shared_ptr<ASTNode> op2_;
-};
-
-class UnaryExprNode : public ASTNode
-{
-public:
-    UnaryExprNode(CodeGen::UnaryOp opType, std::shared_ptr<ASTNode> op)
-        : opType_ {opType}, op_ {op}
-    {}
-    void Accept(ASTVisitor *visitor) const override;
-private:
-    CodeGen::UnaryOp opType_; 
-    std::shared_ptr<ASTNode> op_;
-};
-
-class VarNode : public ASTNode
-{
-public:
-    VarNode(std::string var) : var_ {var} {}
-    void Accept(ASTVisitor *visitor) const override;
-private:
-    std::string var_;
-};
-
-class RealConstNode : public ASTNode
-{
-public:
-    RealConstNode(double val) : val_ {val} {}
-    void Accept(ASTVisitor *visitor) const override;
-private:
-    double val_;
-};
-
-class ArrayLiteralNode : public ASTNode
-{
-public:
-    ArrayLiteralNode(std::vector<int> shape, std::vector<double> elements)
-        : shape_ {std::move(shape)}, elements_ {std::move(elements)}
-    {}
-
-    void Accept(ASTVisitor *visitor) const override;
+    static constexpr NodeId NO_NODE = UINT32_MAX;
+
+    AST() : root {NO_NODE} {}
+
+    NodeId AddList(NodeId first);
+    void Append(NodeId list, NodeId node);
+
+    NodeId AddAssignment(const std::string &varName, NodeId rhs);
+    NodeId AddPlot(const std::string &varName, double min, double max);
+    NodeId AddPlotXY(double angleX, double angleY, double angleZ, NodeId xyExpr);
+    NodeId AddPlotXYSimple(double min, double max, NodeId xyExpr);
+    NodeId AddPlotX(NodeId xExpr);
+    NodeId AddBinExpr(CodeGen::BinaryOp opType, NodeId op1, NodeId op2);
+    NodeId AddUnaryExpr(CodeGen::UnaryOp opType, NodeId op);
+    NodeId AddPow(NodeId base, int exp);
+    NodeId AddVar(const std::string &var);
+    NodeId AddConst(double val);
+    NodeId AddArrayLiteral(const std::vector<int> &shape,
+            const std::vector<double> &elements);
+    NodeId AddLoadedArray(const std::string &path, const std::vector<int> &shape,
+            const std::vector<uint32_t> &words);
+
+    void Accept(NodeId id, ASTVisitor *visitor) const;
+
+    ASTNodeRef Ref(NodeId id) const { return {this, id}; }
+    ASTNodeRef Root() const { return {this, root}; }
+
+    const ASTNodeRec &Node(NodeId id) const { return nodes_[id]; }
+    const std::string &Name(NodeId idx) const { return names_[idx]; }
+    double Real(NodeId idx) const { return reals_[idx]; }
+    std::span<const int> Shape(NodeId id) const;
+    std::span<const double> Elements(NodeId id) const;
+    std::span<const uint32_t> Words(NodeId id) const;
+
+    /// whether the statement at id may allocate or free data memory or bind a
+    /// variable. Statements for which this is false only read variable
+    /// bindings and can be generated independently of each other.
+    bool TouchesMem(NodeId id) const;
+
+    /// Whether each of the statements stmts, in program order, has an effect
+    /// on the output. Plots do and so do assignments to variables which a
+    /// later statement with an effect reads before they are assigned again.
+    std::vector<bool> LiveStatements(std::span<const NodeId> stmts) const;
+
+    /// structural hash of the subtree at id including all names and data
+    std::uint64_t Hash(NodeId id) const;
+
+    /// Rewrites the expressions of all statements. Constant subexpressions
+    /// are folded in TF18 arithmetic and identities like e*1 = e, 0*e = 0 or
+    /// -(-e) = e are applied where e is known to be a scalar.
+    void Simplify();
+
+    std::size_t Size() const { return nodes_.size(); }
+
+    NodeId root;
 private:
-    std::vector<int> shape_;
-    std::vector<double> elements_;
+    NodeId AddNode(NodeKind kind, std::uint8_t op, NodeId a, NodeId b = NO_NODE,
+            NodeId c = NO_NODE);
+    NodeId AddName(const std::string &name);
+    NodeId AddReals(std::initializer_list<double> vals);
+    void HashInto(NodeId id, Fnv1a &hash) const;
+    /// adds the variables read by the subtree at id to vars
+    void ReadVars(NodeId id, std::unordered_set<std::string> &vars) const;
+    NodeId SimplifyExpr(NodeId id);
+    NodeId Negate(NodeId id);
+    bool IsScalar(NodeId id) const;
+    bool IsConst(NodeId id, double val) const;
+    bool IsNegation(NodeId id) const;
+
+    std::vector<ASTNodeRec> nodes_;
+    std::vector<double> reals_;
+    std::vector<int> ints_;
+    std::vector<uint32_t> words_;
+    std::vector<std::string> names_;
 };
 
 #endif
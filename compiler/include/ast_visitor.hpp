@@ -5,39 +5,54 @@
 #include <memory>
 #include <string>
 #include <vector>
+#include <cstdint>
+#include <span>
+#include <functional>
+#include <optional>
+#include <unordered_map>
+#include <unordered_set>
 
 #include "codegen.hpp"
+#include "hash.hpp"
+#include "ir.hpp"
+#include "stmt_cache.hpp"
 
-class ASTNode;
+class ASTNodeRef;
 
 class ASTVisitor
 {
 public:
-    virtual void VisitAssignment(std::string varName,
-            std::shared_ptr<ASTNode> rhs) = 0;
+    virtual void VisitAssignment(const std::string &varName,
+            ASTNodeRef rhs) = 0;
 
-    virtual void VisitPlot(std::string varName, double min, double max) = 0;
+    virtual void VisitPlot(const std::string &varName, double min, double max) = 0;
 
     virtual void VisitPlotXY(double angleX, double angleY, double angleZ,
-            std::shared_ptr<ASTNode> xyExpr) = 0;
+            ASTNodeRef xyExpr) = 0;
 
-    virtual void VisitPlotXYSimple(double min, double max, std::shared_ptr<ASTNode> xyExpr) = 0;
+    virtual void VisitPlotXYSimple(double min, double max, ASTNodeRef xyExpr) = 0;
 
-    virtual void VisitPlotX(std::shared_ptr<ASTNode> xExpr) = 0;
+    virtual void VisitPlotX(ASTNodeRef xExpr) = 0;
 
     virtual void VisitBinExpr(
             CodeGen::BinaryOp opType,
-            std::shared_ptr<ASTNode> op1,
-            std::shared_ptr<ASTNode> op2
+            ASTNodeRef op1,
+            ASTNodeRef op2
         ) = 0;
 
     virtual void VisitUnaryExpr(CodeGen::UnaryOp opType,
-            std::shared_ptr<ASTNode> op) = 0;
-    virtual void VisitVar(std::string var) = 0;
+            ASTNodeRef op) = 0;
+
+    virtual void VisitPow(ASTNodeRef base, int exp) = 0;
+
+    virtual void VisitVar(const std::string &var) = 0;
 
     virtual void VisitConst(double val) = 0;
 
-    virtual void VisitArrayLiteral(std::vector<int> shape, std::vector<double> elements) = 0;
+    virtual void VisitArrayLiteral(std::span<const int> shape, std::span<const double> elements) = 0;
+
+    virtual void VisitLoadedArray(const std::string &path, std::span<const int> shape,
+            std::span<const uint32_t> words) = 0;
     virtual ~ASTVisitor() {}
 };
 
@@ -48,29 +63,34 @@ public:
         : stream_ {outStream}
     {}
 
-    void VisitAssignment(std::string varName,
-        std::shared_ptr<ASTNode> rhs) override;
+    void VisitAssignment(const std::string &varName,
+        ASTNodeRef rhs) override;
 
-    void VisitPlot(std::string varName, double min, double max) override;
+    void VisitPlot(const std::string &varName, double min, double max) override;
 
     void VisitPlotXY(double angleX, double angleY, double angleZ,
-           std::shared_ptr<ASTNode> xyExpr) override;
+           ASTNodeRef xyExpr) override;
 
-    void VisitPlotXYSimple(double min, double max, std::shared_ptr<ASTNode> xyExpr) override;
+    void VisitPlotXYSimple(double min, double max, ASTNodeRef xyExpr) override;
 
-    void VisitPlotX(std::shared_ptr<ASTNode> xExpr) override;
+    void VisitPlotX(ASTNodeRef xExpr) override;
     
 
-    void VisitBinExpr(CodeGen::BinaryOp opType, std::shared_ptr<ASTNode> op1,
-            std::shared_ptr<ASTNode> op2) override;
+    void VisitBinExpr(CodeGen::BinaryOp opType, ASTNodeRef op1,
+            ASTNodeRef op2) override;
 
-    void VisitUnaryExpr(CodeGen::UnaryOp opType, std::shared_ptr<ASTNode> op) override;
+    void VisitUnaryExpr(CodeGen::UnaryOp opType, ASTNodeRef op) override;
 
-    void VisitVar(std::string var) override;
+    void VisitPow(ASTNodeRef base, int exp) override;
+
+    void VisitVar(const std::string &var) override;
 
     void VisitConst(double val) override;
 
-    void VisitArrayLiteral(std::vector<int> shape, std::vector<double> elements) override;
+    void VisitArrayLiteral(std::span<const int> shape, std::span<const double> elements) override;
+
+    void VisitLoadedArray(const std::string &path, std::span<const int> shape,
+            std::span<const uint32_t> words) override;
 private:
     std::ostream &stream_;
 };
@@ -78,35 +98,71 @@ private:
 class ASMGenVisitor : public ASTVisitor
 {
 public:
-    ASMGenVisitor(std::shared_ptr<CodeGen> ctx, std::ostream &outStream = std::cout)
-        : ctx_ {ctx}, stream_ {outStream}
+    ASMGenVisitor(std::shared_ptr<CodeGen> ctx, ir::Module &mod,
+            StmtCache *cache = nullptr)
+        : ctx_ {ctx}, mod_ {mod}, cache_ {cache}
     {}
 
-    void VisitAssignment(std::string varName,
-        std::shared_ptr<ASTNode> rhs) override;
+    void VisitAssignment(const std::string &varName,
+        ASTNodeRef rhs) override;
 
-    void VisitPlot(std::string varName, double min, double max) override;
+    void VisitPlot(const std::string &varName, double min, double max) override;
 
     void VisitPlotXY(double angleX, double angleY, double angleZ,
-           std::shared_ptr<ASTNode> xyExpr) override;
+           ASTNodeRef xyExpr) override;
 
-    void VisitPlotXYSimple(double min, double max, std::shared_ptr<ASTNode> xyExpr) override;
+    void VisitPlotXYSimple(double min, double max, ASTNodeRef xyExpr) override;
 
-    void VisitPlotX(std::shared_ptr<ASTNode> xExpr) override;
+    void VisitPlotX(ASTNodeRef xExpr) override;
 
-    void VisitBinExpr(CodeGen::BinaryOp opType, std::shared_ptr<ASTNode> op1,
-            std::shared_ptr<ASTNode> op2) override;
+    void VisitBinExpr(CodeGen::BinaryOp opType, ASTNodeRef op1,
+            ASTNodeRef op2) override;
 
-    void VisitUnaryExpr(CodeGen::UnaryOp opType, std::shared_ptr<ASTNode> op) override;
+    void VisitUnaryExpr(CodeGen::UnaryOp opType, ASTNodeRef op) override;
 
-    void VisitVar(std::string var) override;
+    void VisitPow(ASTNodeRef base, int exp) override;
+
+    void VisitVar(const std::string &var) override;
 
     void VisitConst(double val) override;
 
-    void VisitArrayLiteral(std::vector<int> shape, std::vector<double> elements) override;
+    void VisitArrayLiteral(std::span<const int> shape, std::span<const double> elements) override;
+
+    void VisitLoadedArray(const std::string &path, std::span<const int> shape,
+            std::span<const uint32_t> words) override;
 private:
+    void EmitArrInit(std::vector<int> &shape, std::span<const uint32_t> words);
+
+    void EmitCached(Fnv1a &stmtHash, const std::string &assignedVar,
+            const std::function<void(ASMGenVisitor &)> &emit);
+
+    void NumberValues(ASTNodeRef expr);
+    void EvalExpr(ASTNodeRef expr);
+    void HoistInvariants(ASTNodeRef expr);
+
+    void FindElementwise(ASTNodeRef expr);
+    bool EmitElementwise(ASTNodeRef expr);
+    void EmitDotEpilogue(ASTNodeRef expr, const std::vector<std::uint32_t> &inputs,
+            const std::vector<std::uint32_t> &parents, const std::vector<CodeGen::ExprOut> &outs,
+            std::size_t dotIdx, const CodeGen::Arr &arr1, const CodeGen::Arr &arr2,
+            const CodeGen::Arr &arrOut);
+    void EmitDot(const CodeGen::Arr &arr1, const CodeGen::Arr &arr2,
+            const CodeGen::Arr &arrOut, const CodeGen::ExprOut *init = nullptr,
+            const std::function<int(int, int)> &epilogue = {});
+    int ElementwiseIntoReg(ASTNodeRef expr,
+            std::unordered_map<std::uint64_t, int> &values);
+    std::optional<std::vector<int>> ArrShape(ASTNodeRef expr) const;
+    bool IsConstant(ASTNodeRef expr) const;
+
     std::shared_ptr<CodeGen> ctx_;
-    std::ostream &stream_;
+    ir::Module &mod_;
+    StmtCache *cache_;
+    /// varMap name of the value of each operation node which is generated
+    /// only once by EvalExpr
+    std::unordered_map<std::uint32_t, std::string> valueNames_;
+    /// roots of the trees of elementwise operations on arrays in the
+    /// assignment being generated which become a program each
+    std::unordered_set<std::uint32_t> elementwiseRoots_;
 };
 
 #endif
@@ -11,12 +11,19 @@
 #include <cmath>
 #include <unordered_map>
 #include <vector>
+#include <span>
 
 
 #include "constants.hpp"
 #include "context.hpp"
+#include "ir.hpp"
 
 #define IDX_VAR_NAME "idx_var"
+#define X_VAR_NAME "x_var"
+#define Y_VAR_NAME "y_var"
+/// prefixes of the varMap names of reused expression values
+#define VALUE_PREFIX "value_"
+#define INVARIANT_PREFIX "invariant_"
 
 
 class CodeGen {
@@ -24,9 +31,11 @@ public:
     CodeGen()
         : exprOut {.t = OutType::reg, .v = -1},
           predMode {false},
+          log {&std::cerr},
           usedMem {{}},
-          freeMem {{{0, MEM_SIZE}}},
-          freeRegs_ {{11, 10, 9, 8, 7, 6, 5, 4}},
+          freeMem {{{0, DISCARD_ADDR}}},
+          memInUse_ {0},
+          nextReg_ {ir::VREG_BASE},
           usedRegs_ {}
     {}
     ~CodeGen() {}
@@ -68,6 +77,22 @@ public:
         std::variant<Arr, int, double> v;
     };
 
+    /// resource usage of the generated code
+    struct Counters {
+        int peakRegs = 0;
+        /// in memory elements
+        int peakMem = 0;
+        int peakFreeList = 0;
+        /// values AllocReg gave up to generate them again later
+        int spills = 0;
+        /// programs saved by generating elementwise operations on arrays
+        /// together
+        int fusedPrograms = 0;
+
+        /// combines the counters of code generated from separate contexts
+        void Merge(const Counters &other);
+    };
+
     int AllocReg();
 
     /// frees most recently used register
@@ -77,63 +102,51 @@ public:
     /// frees all given registers
     void FreeReg(std::initializer_list<int> regs);
 
-    void ASMOp(std::string op, int target, int src, std::ostream &stream);
+    /// Keeps AllocReg from taking back the register of a varMap entry while
+    /// it is an operand of an instruction still to be emitted. Holds nest and
+    /// have no effect on registers not in varMap.
+    void HoldReg(int reg);
+    void HoldReg(const ExprOut &out);
+    void ReleaseReg(int reg);
+    void ReleaseReg(const ExprOut &out);
 
-    void ASMOp
-    (
-        std::string op, int valReg, std::string addrReg, std::ostream &stream
-    );
+    /// Drops all values bound in varMap other than x, y, the thread index and
+    /// the ones named with INVARIANT_PREFIX. Their registers are freed except
+    /// for the ones in keep, which are then owned by the caller.
+    void ForgetValues(std::initializer_list<int> keep = {});
 
-    void ASMOp
-    (
-        std::string op, int target, int srcA, int srcB, std::ostream &stream
-    );
-    void ASMOp
-    (
-        std::string op, int target, std::string srcA, std::string srcB, std::ostream &stream
-    );
-    void ASMOp
-    (
-        std::string op, int target, int srcA, std::string srcB, std::ostream &stream
-    );
+    /// reg itself or a copy of it if it is bound in varMap, for values that
+    /// are about to be changed in place
+    int ToOwnedReg(int reg, ir::Module &mod);
 
+    /// appends instr to the current program, predicated if in predicate mode
+    void Emit(ir::Instr instr, ir::Module &mod);
 
-	void ASMImmOp
-	(
-		std::string op, int src, int x, std::ostream &stream
-	);
+    void ASMOp(ir::Op op, int target, int src, ir::Module &mod);
+    void ASMOp(ir::Op op, int target, int srcA, int srcB, ir::Module &mod);
 
-    void ASMImmOp
-    (
-        std::string op, int target, int src, int x, std::ostream &stream
-    );
-    void ASMImmOp
-    (
-        std::string op, int target, std::string src, int x, std::ostream &stream
-    );
-    void ASMImmOp
-    (
-        std::string op, int target, int src, double x, std::ostream &stream
-    );
+    void ASMImmOp(ir::Op op, int src, int x, ir::Module &mod);
+    void ASMImmOp(ir::Op op, int target, int src, int x, ir::Module &mod);
+    void ASMImmOp(ir::Op op, int target, int src, double x, ir::Module &mod);
 
 
     void ChangeRegScale
     (
         int reg, double oldMin, double oldMax, double newMin, double newMax,
-        std::ostream &stream
+        ir::Module &mod
     );
 
 
-    int IndexIntoReg(std::ostream &stream, int multiplier = 1);
+    int IndexIntoReg(ir::Module &mod, int multiplier = 1);
 	int XIntoReg(
-			std::ostream &stream,
+			ir::Module &mod,
 			double min =
 				std::ceil(0.5 * (1.0 - 1.0/std::sqrt(2)) * static_cast<double>(PLOT_WIDTH)),
 			double max =
 				PLOT_WIDTH - std::ceil(0.5 * (1.0 - 1.0/std::sqrt(2)) * static_cast<double>(PLOT_WIDTH))
 	);
 	int YIntoReg(
-			std::ostream &stream,
+			ir::Module &mod,
 			double min =
 				std::ceil(0.5 * (1.0 - 1.0/std::sqrt(2)) * static_cast<double>(PLOT_HEIGHT)),
 			double max =
@@ -144,69 +157,101 @@ public:
     std::tuple<int, int, int> RotateRegs(
             int xReg, int yReg, int zReg,
             double angleX, double angleY, double angleZ,
-            std::ostream &stream
+            ir::Module &mod
     );
 
     void SetAxes
     (
             int xReg, int yReg, int zReg,
             double angleX, double angleY, double angleZ,
-            std::ostream &stream
+            ir::Module &mod
     );
 
 
-    void Interpolate(int valReg, int addrReg, std::ostream &stream);
+    void Interpolate(int valReg, int addrReg, ir::Module &mod);
 
-    void Interpolate_new(int valReg, int addrReg, std::ostream &stream);
+    void Interpolate_new(int valReg, int addrReg, ir::Module &mod);
 
-    void FloatCoordsToAddrReg(int addrReg, int xReg, int yReg, std::ostream &stream,
+    void FloatCoordsToAddrReg(int addrReg, int xReg, int yReg, ir::Module &mod,
             double min = std::ceil(0.5 * (1.0 - 1.0/std::sqrt(2)) * static_cast<double>(PLOT_WIDTH)),
             double max = PLOT_WIDTH - std::ceil(0.5 * (1.0 - 1.0/std::sqrt(2)) * static_cast<double>(PLOT_WIDTH)));
 
-    std::string FormatOp(std::string op);
-
-    void PredicateBackup(std::ostream &stream);
-    void PredicateRestore(std::ostream &stream);
+    void PredicateBackup(ir::Module &mod);
+    void PredicateRestore(ir::Module &mod);
 
     void Reset();
 
-    static void ProgHeader(int noBlocks, std::ostream &stream);
+    static void ProgHeader(int noBlocks, ir::Module &mod);
+
+    void ConstIntoReg(int reg, uint32_t val, ir::Module &mod);
+    void DoubleIntoReg(int reg, double val, ir::Module &mod);
+    void TF18IntoReg(int reg, uint32_t val, ir::Module &mod);
 
-    void ConstIntoReg(int reg, uint32_t val, std::ostream &stream);
-    void DoubleIntoReg(int reg, double val, std::ostream &stream);
+    void StoreColour(int valReg, int addrReg, ir::Module &mod);
 
-    void StoreColour(int valReg, int addrReg, std::ostream &stream);
+    void ResetMem(ir::Module &mod);
 
-    void ResetMem(std::ostream &stream);
+    void DisplayMem(ir::Module &mod);
 
-    void DisplayMem(std::ostream &stream);
+    void TopBottomWhiteMargin(ir::Module &mod);
 
-    void TopBottomWhiteMargin(std::ostream &stream);
+    void StoreReg(int valReg, int addrReg, ir::Module &mod);
+    void LoadReg(int valReg, int addrReg, ir::Module &mod);
 
-    void StoreReg(int valReg, int addrReg, std::ostream &stream);
-    void LoadReg(int valReg, int addrReg, std::ostream &stream);
+    int StoreArrWords(int addr, std::vector<int> &shape,
+            std::span<const uint32_t> words, int first, ir::Module &mod);
 
     int AllocMem(int size);
     void FreeMem(int addr);
+    /// words of data memory currently allocated
+    int MemInUse() const { return memInUse_; }
+
+    /// text form of the data memory allocator state which can be restored
+    /// with MemStateFromStr
+    std::string MemStateToStr() const;
+    void MemStateFromStr(const std::string &state);
 
     void EmitBinExpr(CodeGen::BinaryOp opType, int targetReg,
-            int val1Reg, int val2Reg, std::ostream &stream);
+            int val1Reg, int val2Reg, ir::Module &mod);
 
     void EmitUnaryExpr(CodeGen::UnaryOp opType, int targetReg,
-            int srcReg, std::ostream &stream);
+            int srcReg, ir::Module &mod);
+
+    /// targetReg = baseReg^exp for exp >= 2 by square-and-multiply, i.e. with
+    /// one fmul per bit of exp after the leading one and one more per further
+    /// set bit. targetReg must differ from baseReg which is left unchanged.
+    void EmitPow(int targetReg, int baseReg, int exp, ir::Module &mod);
 
-    int ToRegCast(ExprOut out, std::ostream &stream);
-    CodeGen::Arr ToArrCast(ExprOut out, std::ostream &stream);
+    int ToRegCast(ExprOut out, ir::Module &mod);
+    CodeGen::Arr ToArrCast(ExprOut out, ir::Module &mod);
 
     bool IsArrAVariable(Arr a);
+    /// Removes the binding of var for a value that is never read again. The
+    /// memory of its array is freed unless another variable refers to it.
+    void Unbind(const std::string &var);
     static uint32_t DoubleToTF18Int(double x);
+    static uint32_t FloatToTF18Int(float x);
+    static double TF18IntToDouble(uint32_t x);
+    /// nearest value the device can hold in a register
+    static double RoundTF18(double x);
+    /// val^exp rounded after every multiplication like EmitPow computes it,
+    /// or the first product that is not finite
+    static double PowTF18(double val, int exp);
+    static std::vector<uint32_t> PackTF18(std::vector<int> &shape,
+            const std::function<double(int)> &element);
     static std::tuple<std::vector<int>, int> PaddedArrSize(std::vector<int> &shape);
 
     static std::string ShapeToStr(std::vector<int> &shape);
+    /// lossless text form of an expression output which can be restored with
+    /// ExprOutFromStr
+    static std::string ExprOutToStr(const ExprOut &out);
+    static ExprOut ExprOutFromStr(const std::string &str);
     static std::string UnaryOpToStr(UnaryOp op);
 
     static std::function<int(int,int)> BinaryOpToIntFn(BinaryOp op);
     static std::function<double(double, double)> BinaryOpToDoubleFn(BinaryOp op);
+    static std::function<double(double)> UnaryOpToDoubleFn(UnaryOp op);
+    static ir::Op BinaryOpToFloatOp(BinaryOp op);
     static std::string BinaryOpToStr(BinaryOp op);
 
     /// public member variables
@@ -220,11 +265,16 @@ public:
     bool predModeBackup;
     int predBackupReg;
     bool singleOut;
+    /// diagnostics about register and memory allocation
+    std::ostream *log;
+    Counters counters;
 private:
     std::unordered_map<int, int> usedMem;
     std::vector<std::pair<int, int>> freeMem;
-    std::list<int> freeRegs_;
+    int memInUse_;
+    int nextReg_;
     std::list<int> usedRegs_;
+    std::vector<int> heldRegs_;
 };
 
 #endif
@@ -11,6 +11,13 @@ constexpr int BLOCK_DIM = 8;
 constexpr int MAX_INSTR = 256;
 constexpr int NUM_THREADS = 16;
 constexpr int MEM_SIZE = 512*512;
+/// data memory at the top which is left to the register allocator for
+/// spilled registers, see opt::AllocateRegisters
+constexpr int SCRATCH_SIZE = MEM_SIZE / 8;
+constexpr int SCRATCH_ADDR = MEM_SIZE - SCRATCH_SIZE;
+/// data memory word below the scratch memory which is never read, for
+/// stores which have to be made but not take effect, see opt::MergePrograms
+constexpr int DISCARD_ADDR = SCRATCH_ADDR - 1;
 
 constexpr int NUM_BLOCKS = PLOT_WIDTH / BLOCK_DIM; // one program per pixel row
 constexpr double EQUALITY_ERROR_MARGIN = 0.035;
@@ -0,0 +1,68 @@
+#ifndef DRIVER_HPP
+#define DRIVER_HPP
+
+#include <istream>
+#include <ostream>
+#include <string>
+
+#include "ir.hpp"
+#include "stats.hpp"
+#include "stmt_cache.hpp"
+
+namespace driver {
+
+struct Options {
+    bool singleOut = false;
+    /// echo the AST to std::cerr
+    bool printAST = false;
+    /// reuse the code of statements from here if not null
+    StmtCache *cache = nullptr;
+    /// threads generating statements which don't touch data memory
+    int jobs = 1;
+    /// statistics of the compilation are added here if not null
+    CompileStats *stats = nullptr;
+    /// rewrites of the whole module run before emission if not null. Code
+    /// generation uses virtual registers so these have to include
+    /// opt::AllocateRegisters for the module to be emitted.
+    const ir::PassManager *passes = nullptr;
+    /// output format of Compile
+    ir::Format format = ir::Format::TEXT;
+};
+
+/// Parses the source in inStream, generates its IR and runs opts.passes on it.
+///
+/// Statements that touch data memory are generated in order on the calling
+/// thread. All others only read variable bindings, so they are generated
+/// from a snapshot of the code generator on up to opts.jobs threads into
+/// separate modules. The modules are joined in program order so the result
+/// does not depend on the number of jobs.
+ir::Module Generate(std::istream &inStream, const Options &opts);
+
+/// Generate followed by writing the module to outStream in opts.format
+void Compile(std::istream &inStream, std::ostream &outStream, const Options &opts);
+
+/// Runs conv as a persistent compile server until the client hangs up.
+///
+/// With an empty socketPath requests are read from stdin and responses are
+/// written to stdout, otherwise clients are accepted one after the other on
+/// a Unix domain socket at socketPath.
+///
+/// All integers are little-endian. A request is either
+/// - 'S', uint32 length, source: compile the given source
+/// - 'D', uint32 offset, uint32 erase length, uint32 length, text: replace
+///   erase length bytes at offset of the previous source with text and
+///   compile the result
+///
+/// and is answered with a uint8 status (0 on success, 1 on error) followed by
+/// a uint32 length and either the assembled program binary or the error
+/// message.
+///
+/// Every request is compiled from scratch in a forked child. Only the code
+/// of statements found in opts.cache is reused, so a diff is parsed and run
+/// through opts.passes as a whole but only the statements it changed are
+/// generated again.
+int Serve(const std::string &socketPath, const Options &opts);
+
+} // namespace driver
+
+#endif
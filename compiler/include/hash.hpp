@@ -0,0 +1,46 @@
+#ifndef HASH_HPP
+#define HASH_HPP
+
+#include <cstdint>
+#include <cstddef>
+#include <string_view>
+#include <type_traits>
+
+/// 64-bit FNV-1a hash that is built up incrementally
+class Fnv1a
+{
+public:
+    Fnv1a() : hash_ {OFFSET_BASIS} {}
+
+    Fnv1a &Add(const void *data, std::size_t n)
+    {
+        const unsigned char *bytes = static_cast<const unsigned char *>(data);
+        for (std::size_t i = 0; i < n; i++) {
+            hash_ = (hash_ ^ bytes[i]) * PRIME;
+        }
+        return *this;
+    }
+
+    /// strings are length prefixed so that concatenations can't collide
+    Fnv1a &Add(std::string_view s)
+    {
+        Add(s.size());
+        return Add(s.data(), s.size());
+    }
+
+    template<typename T>
+        requires std::is_arithmetic_v<T> || std::is_enum_v<T>
+    Fnv1a &Add(T val)
+    {
+        return Add(&val, sizeof(val));
+    }
+
+    std::uint64_t Value() const { return hash_; }
+private:
+    static constexpr std::uint64_t OFFSET_BASIS = 0xcbf29ce484222325;
+    static constexpr std::uint64_t PRIME = 0x100000001b3;
+
+    std::uint64_t hash_;
+};
+
+#endif
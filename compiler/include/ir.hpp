@@ -0,0 +1,150 @@
+#ifndef IR_HPP
+#define IR_HPP
+
+#include <array>
+#include <cstdint>
+#include <functional>
+#include <ostream>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+/// In-memory form of generated code between the AST and the assembly text.
+///
+/// A module is a sequence of programs, each launched with a number of thread
+/// blocks as given in its <blocks,BLOCK_DIM> header. A program is made of
+/// basic blocks of instructions which mirror the instructions of the
+/// assembler one to one.
+namespace ir {
+
+using Reg = int;
+
+/// registers with a fixed meaning in the register file
+constexpr Reg ZERO = 0;
+constexpr Reg BLOCK_IDX = 1;
+constexpr Reg BLOCK_DIM_REG = 2;
+constexpr Reg THREAD_IDX = 3;
+constexpr int NUM_PHYS_REGS = 32;
+/// per-thread registers which can be written, see rtl/reg_file.sv. Register
+/// numbers up to NUM_PHYS_REGS can be encoded but the ones above these alias
+/// them.
+constexpr Reg FIRST_GP_REG = 4;
+constexpr int NUM_GP_REGS = 8;
+/// registers from VREG_BASE on are virtual and have to be mapped to
+/// physical registers before emission
+constexpr Reg VREG_BASE = NUM_PHYS_REGS;
+constexpr Reg NO_REG = -1;
+
+enum class Op : std::uint8_t {
+    ADD, SUB, MUL, DIV, REM, AND, OR, XOR, SLL, SRL, SRA, SLT, SEQ,
+    ADDI, SUBI, MULI, DIVI, REMI, ANDI, ORI, XORI, SLLI, SRLI, SRAI, SLTI, SEQI,
+    LUI,
+    FADD, FSUB, FMUL, FDIV, FABS, FRCP, FSQRT, FRSQRT, FSIN, FCOS, FLOG, FEXP,
+    FSLT, FSEQ,
+    CVTIF, CVTFI, CVTFR, CVTFC,
+    LW, SW, SPIX,
+    DISP, EXIT, NOP,
+};
+
+/// operands of an instruction in the order of the text format
+enum class Form : std::uint8_t {
+    RRR,    ///< rd, ra, rb
+    RRI,    ///< rd, ra, imm
+    RR,     ///< rd, ra
+    RI,     ///< rd, imm
+    CMP_RR, ///< ra, rb: sets the predicate
+    CMP_RI, ///< ra, imm: sets the predicate
+    LOAD,   ///< rd, ra: ra holds the address
+    STORE,  ///< ra, rb: value ra to address rb
+    OUT,    ///< ra
+    NONE,
+};
+
+struct OpInfo {
+    const char *name;
+    Form form;
+};
+
+const OpInfo &Info(Op op);
+
+struct Instr {
+    Op op = Op::NOP;
+    /// only executed by threads whose predicate bit is set
+    bool pred = false;
+    /// imm holds a TF18 bit pattern (written in hex) instead of an integer
+    bool tf18 = false;
+    Reg rd = NO_REG;
+    Reg ra = NO_REG;
+    Reg rb = NO_REG;
+    std::int32_t imm = 0;
+
+    /// register written or NO_REG
+    Reg Def() const;
+    /// registers read, unused entries are NO_REG
+    std::array<Reg, 2> Uses() const;
+};
+
+/// instruction with the register operands regs given in text order
+Instr Make(Op op, std::initializer_list<Reg> regs, std::int32_t imm = 0);
+
+struct Block {
+    std::vector<Instr> instrs;
+};
+
+struct Program {
+    /// instructions appended before any program header continue the
+    /// previous program of the module they end up in
+    static constexpr int CONTINUATION = -1;
+
+    int numBlocks;
+    std::vector<Block> blocks;
+
+    int NumInstrs() const;
+};
+
+struct Module {
+    std::vector<Program> programs;
+
+    /// starts a new program with a single empty basic block
+    void BeginProgram(int numBlocks);
+    /// appends instr to the last basic block of the current program
+    void Append(const Instr &instr);
+    /// moves all programs of other behind the ones of this module
+    void Append(Module &&other);
+
+    int NumInstrs() const;
+};
+
+/// Whole-module rewrites which are run in the order they were added
+class PassManager
+{
+public:
+    using Pass = std::function<void(Module &)>;
+
+    void Add(std::string name, Pass pass);
+    void Run(Module &mod) const;
+    bool Empty() const { return passes_.empty(); }
+private:
+    std::vector<std::pair<std::string, Pass>> passes_;
+};
+
+enum class Format {
+    TEXT,
+    BIN,
+    HEX,
+};
+
+std::string RegName(Reg reg);
+
+/// writes mod as assembly text or assembles it into the binary/hex format
+/// of the assembler
+void Emit(const Module &mod, std::ostream &stream, Format format = Format::TEXT);
+
+/// compact binary form for the statement cache
+std::string Serialize(const Module &mod);
+Module Deserialize(std::string_view data);
+
+} // namespace ir
+
+#endif
@@ -6,6 +6,10 @@
 #include <variant>
 #include <string>
 #include <functional>
+#include <deque>
+#include <vector>
+#include <cstddef>
+#include <chrono>
 
 #include "codegen.hpp"
 
@@ -26,6 +30,7 @@ enum class Token {
     PLOTXY,
     PLOTXY_SIMPLE,
     PLOTX,
+    LOAD,
     PLUS,
     MINUS,
     MULT,
@@ -47,11 +52,51 @@ enum class Token {
     COMMA,
     EQUAL,
     VERT_LINE,
+    STRING,
     ILLEGAL,
     _EOF_,
 };
 
-std::tuple<Token, int, LexType> Lex(std::istream &in_stream);
+/// Lex the next token from the stream advancing lineNo past any newlines
+std::tuple<Token, int, LexType> Lex(std::istream &inStream, int &lineNo);
+
+/// Tokens of an input stream with k-token lookahead.
+///
+/// Every byte of the input is read and lexed exactly once: peeked tokens are
+/// buffered until they are consumed with Next() so the parser never has to
+/// seek back in the input. This lets it read from pipes and stdin directly.
+class TokenStream
+{
+public:
+    TokenStream(std::istream &inStream)
+        : inStream_ {inStream}, lineNo_ {1}, lexTime_ {0}
+    {}
+
+    /// returns the k-th token ahead without consuming it
+    const std::tuple<Token, int, LexType> &Peek(std::size_t k = 0);
+
+    /// consumes and returns the next token
+    std::tuple<Token, int, LexType> Next();
+
+    /// Reads the comma separated reals of an array literal body up to and
+    /// including the closing ']' in one go and parses them from that buffer
+    /// with std::from_chars instead of lexing every element as a token.
+    /// Must be called right after consuming '[' (no pending lookahead).
+    ///
+    /// Returns an empty string on success or an error message in which case
+    /// errLine is the line of the offending element
+    std::string ScanRealList(std::vector<double> &out, int &errLine);
+
+    /// total time spent lexing so far
+    std::chrono::nanoseconds LexTime() const { return lexTime_; }
+private:
+    std::tuple<Token, int, LexType> TimedLex();
+
+    std::istream &inStream_;
+    std::deque<std::tuple<Token, int, LexType>> lookahead_;
+    int lineNo_;
+    std::chrono::nanoseconds lexTime_;
+};
 
 } // namespace lex
 
@@ -0,0 +1,33 @@
+#ifndef LOG_HPP
+#define LOG_HPP
+
+/// Log levels in increasing verbosity. Errors that stop compilation are
+/// always reported and don't go through LOG.
+enum class LogLevel {
+    ERROR,
+    WARN,
+    INFO,
+    DEBUG,
+};
+
+/// most verbose level compiled in (0 error, 1 warn, 2 info, 3 debug)
+#ifndef LOG_LEVEL_MAX
+#define LOG_LEVEL_MAX 3
+#endif
+
+/// most verbose level printed at runtime
+inline LogLevel logLevel = LogLevel::WARN;
+
+/// Runs the given statement (usually a stream insertion) only if level is
+/// enabled. Levels above LOG_LEVEL_MAX are removed at compile time including
+/// the evaluation of their arguments.
+#define LOG(level, ...) \
+    do { \
+        if constexpr (static_cast<int>(LogLevel::level) <= LOG_LEVEL_MAX) { \
+            if (LogLevel::level <= logLevel) { \
+                __VA_ARGS__; \
+            } \
+        } \
+    } while (0)
+
+#endif
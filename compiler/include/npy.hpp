@@ -0,0 +1,26 @@
+#ifndef NPY_HPP
+#define NPY_HPP
+
+#include <string>
+#include <vector>
+#include <cstdint>
+
+namespace npy {
+
+/// Memory maps a matrix file and converts it in bulk to the padded TF18
+/// layout of CodeGen::PackTF18 so codegen can store it directly.
+///
+/// Supported formats:
+/// - .npy (version 1-3) with dtype '<f4' or '<f8' in C or Fortran order
+/// - raw: little-endian uint32 number of dimensions, one uint32 per
+///   dimension, then the float32 elements in row-major order
+///
+/// Arrays with fewer than 2 dimensions are padded to 2D with leading 1s.
+///
+/// Returns an empty string on success or an error message otherwise.
+std::string LoadTF18(const std::string &path, std::vector<int> &shape,
+        std::vector<uint32_t> &words);
+
+} // namespace npy
+
+#endif
@@ -0,0 +1,101 @@
+#ifndef OPT_HPP
+#define OPT_HPP
+
+#include "ir.hpp"
+
+/// Passes over the IR which are registered with an ir::PassManager
+namespace opt {
+
+/// largest magnitude of an addi/subi immediate, which is encoded in 13 bits
+constexpr long MAX_IMM = 4095;
+
+/// Propagates constants and integer ranges through every program and folds
+/// what can be computed at compile time:
+/// - float operations on constants are evaluated in TF18 arithmetic
+/// - e + 0, e - 0, e * 1 and e / 1 become copies
+/// - integer-valued constants subtracted right after an integer to float
+///   conversion are subtracted before it when the range of the integer
+///   shows this is exact (the fsub of ChangeRegScale after XIntoReg)
+/// - chains of immediate additions on one register are merged
+///
+/// and removes the instructions which became dead. The number of removed
+/// instructions per program is logged at info level.
+void FoldConstants(ir::Module &mod);
+
+/// Strength reduction of the float arithmetic with constants in every block.
+/// Chains of fadd, fsub, fmul and fdiv by constants on one value, as the ones
+/// of ChangeRegScale and divisions by constants in expressions, are replaced
+/// by the canonical a*x + b with a and b computed at compile time when this
+/// takes fewer instructions and a and b are TF18 values. A division by a
+/// power of two on its own becomes a multiplication by the reciprocal, which
+/// rounds the same. Intermediate values read elsewhere end a chain. The
+/// rewritten divisions and chains and the number of removed instructions per
+/// program are logged at info level.
+void ReduceStrength(ir::Module &mod);
+
+/// Runs consecutive programs which do not depend on each other through data
+/// memory as a single launch while their blocks together fit into the
+/// NUM_THREADS threads of the device, so that small programs do not leave
+/// the others idle until the next launch. Dependences are found from the
+/// ranges of the load and store addresses of each program. Programs which
+/// display pixels keep their own launches. Every block of a merged program
+/// runs each of the programs on the block indices from the start of its
+/// range, and stores from outside the range go to DISCARD_ADDR. The merged
+/// programs are logged at info level.
+void MergePrograms(ir::Module &mod);
+
+/// Window optimisations over the instructions of each program which are
+/// aware of predication:
+/// - constants and moved values are read from the register they were first
+///   loaded into and loads of values a register already holds are dropped
+/// - addi/subi on a register are merged with the next addi/subi on it if
+///   the register is not used in between (address adjustments of stores)
+///
+/// followed by the removal of dead code. The number of removed instructions
+/// per program is logged at info level.
+void Peephole(ir::Module &mod);
+
+/// List scheduling of the instructions of every program against a machine
+/// model of the SIMD lanes with the latency of each unit. The device issues
+/// for NUM_THREADS threads in turn and every unit writes its result back
+/// before the thread it belongs to comes round again, so instructions only
+/// wait for their operands where the model changes. As long as the values
+/// live at once fit into the registers the order is kept; beyond that,
+/// instructions which add live values are put off while others are ready,
+/// which saves spill code. A new order is only kept if the estimated cycles
+/// of the program after register allocation go down. These savings are
+/// logged per program at info level and their sum is returned.
+long Schedule(ir::Module &mod);
+
+/// Maps the virtual registers of every program onto the registers the device
+/// has per thread, FIRST_GP_REG up to NUM_GP_REGS of them, by linear scan over
+/// their live intervals. Where more values are live than there are registers
+/// the ones live longest are spilled, preferring values computed from the
+/// fixed registers and immediates alone. These are computed again before
+/// every read, the others are stored to a slot per thread in the scratch
+/// memory at SCRATCH_ADDR. Moves between registers which were assigned the
+/// same one are removed. Returns the number of spilled registers.
+///
+/// Exits with an error if a program needs more scratch memory than
+/// SCRATCH_SIZE words.
+int AllocateRegisters(ir::Module &mod);
+
+/// AllocateRegisters for a single program, without logging. Returns false
+/// instead of exiting if prog cannot be allocated, which leaves it in an
+/// unspecified state.
+bool TryAllocateRegisters(ir::Program &prog);
+
+/// Constant pool: the constants a program loads with lui more than once are
+/// loaded a single time at its start into registers it does not use
+/// otherwise, most frequently loaded first while there are idle registers,
+/// and read from there. The other loads stay as they are. Programs which
+/// would not get shorter are left unchanged.
+void PoolConstants(ir::Module &mod);
+
+/// Removes instructions without side effects whose results are never read.
+/// Returns the number of removed instructions.
+int RemoveDeadCode(ir::Program &prog);
+
+} // namespace opt
+
+#endif
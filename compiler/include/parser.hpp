@@ -2,36 +2,39 @@
 #define PARSER_HPP
 
 #include <istream>
-#include <memory>
+#include <chrono>
 
 #include "ast.hpp"
+#include "lex.hpp"
 
 namespace parse {
 
 
 
-std::shared_ptr<ASTNode> ParseFac(std::istream &inStream);
+NodeId ParseFac(lex::TokenStream &tokens, AST &ast);
 
-std::shared_ptr<ASTNode> ParsePowRHS(std::istream &inStream,
-                std::shared_ptr<ASTNode> lhs_op);
+NodeId ParsePowRHS(lex::TokenStream &tokens, AST &ast,
+                NodeId lhsOp);
 
-std::shared_ptr<ASTNode> ParsePow(std::istream &inStream);
+NodeId ParsePow(lex::TokenStream &tokens, AST &ast);
 
-std::shared_ptr<ASTNode> ParseTermRHS(std::istream &inStream,
-                std::shared_ptr<ASTNode> lhs_op);
+NodeId ParseTermRHS(lex::TokenStream &tokens, AST &ast,
+                NodeId lhsOp);
 
-std::shared_ptr<ASTNode> ParseTerm(std::istream &inStream);
+NodeId ParseTerm(lex::TokenStream &tokens, AST &ast);
 
-std::shared_ptr<ASTNode> ParseExprRHS(std::istream &inStream,
-                std::shared_ptr<ASTNode> lhs_op);
+NodeId ParseExprRHS(lex::TokenStream &tokens, AST &ast,
+                NodeId lhsOp);
 
-std::shared_ptr<ASTNode> ParseExpr(std::istream &inStream);
+NodeId ParseExpr(lex::TokenStream &tokens, AST &ast);
 
-std::shared_ptr<ASTNode> ParseStatement(std::istream &inStream);
+NodeId ParseStatement(lex::TokenStream &tokens, AST &ast);
 
-std::shared_ptr<ASTNode> ParseStatementList(std::istream &inStream);
+NodeId ParseStatementList(lex::TokenStream &tokens, AST &ast);
 
-std::shared_ptr<ASTNode> Parse(std::istream &inStream);
+/// parses a whole program and adds the time spent lexing to lexTime if it is
+/// not null
+AST Parse(std::istream &inStream, std::chrono::nanoseconds *lexTime = nullptr);
 
 } // namespace parse
 
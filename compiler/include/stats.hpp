@@ -0,0 +1,47 @@
+#ifndef STATS_HPP
+#define STATS_HPP
+
+#include <chrono>
+#include <ostream>
+
+#include "codegen.hpp"
+#include "ir.hpp"
+
+/// Statistics of one compilation which conv prints as JSON with --stats
+struct CompileStats {
+    /// wall-clock time per phase. Lexing happens on demand while parsing so
+    /// parse excludes the time spent in the lexer.
+    std::chrono::nanoseconds lex {0};
+    std::chrono::nanoseconds parse {0};
+    std::chrono::nanoseconds codegen {0};
+    std::chrono::nanoseconds passes {0};
+    std::chrono::nanoseconds emit {0};
+
+    int statements = 0;
+    int programs = 0;
+    int instructions = 0;
+    int minProgramInstrs = 0;
+    int maxProgramInstrs = 0;
+
+    CodeGen::Counters alloc;
+    /// registers the register allocator spilled to data memory
+    int memorySpills = 0;
+    /// assignments no output depends on which were left out, with the
+    /// programs and the words of data memory they would have taken
+    int deadStatements = 0;
+    int deadPrograms = 0;
+    int deadMemWords = 0;
+    /// cycles opt::Schedule estimates its reordering saved
+    long cyclesSaved = 0;
+
+    int cacheHits = 0;
+    int cacheMisses = 0;
+    int cacheEvictions = 0;
+
+    /// counts the programs of the generated code and their instructions
+    void CountPrograms(const ir::Module &mod);
+
+    void WriteJSON(std::ostream &stream) const;
+};
+
+#endif
@@ -0,0 +1,47 @@
+#ifndef STMT_CACHE_HPP
+#define STMT_CACHE_HPP
+
+#include <atomic>
+#include <cstdint>
+#include <filesystem>
+#include <string>
+
+/// Content-addressed on-disk cache of the code generated for single
+/// statements. Every entry is one file named after its key in the cache
+/// directory. The key is derived from the caller's hash of everything the
+/// output depends on together with a salt covering the target constants and
+/// the compiler binary itself so that entries of other builds never match.
+///
+/// Entries are evicted least recently used first by Trim once the directory
+/// grows beyond maxBytes. Lookup and Store may be called from several threads.
+class StmtCache
+{
+public:
+    static constexpr std::uintmax_t DEFAULT_MAX_BYTES = 64 << 20;
+
+    StmtCache(const std::filesystem::path &dir,
+            std::uintmax_t maxBytes = DEFAULT_MAX_BYTES);
+
+    /// final key for a hash of the statement and the state it is compiled in
+    std::uint64_t Key(std::uint64_t stateHash) const;
+
+    /// returns true and fills entry if key is cached
+    bool Lookup(std::uint64_t key, std::string &entry);
+    void Store(std::uint64_t key, const std::string &entry);
+
+    /// evicts least recently used entries until the cache fits into maxBytes
+    void Trim();
+
+    std::atomic<int> hits;
+    std::atomic<int> misses;
+    std::atomic<int> evictions;
+private:
+    std::filesystem::path EntryPath(std::uint64_t key) const;
+
+    std::filesystem::path dir_;
+    std::uintmax_t maxBytes_;
+    std::uint64_t salt_;
+    bool enabled_;
+};
+
+#endif
@@ -8,64 +8,504 @@
 #include "ast.hpp"
 #include "codegen.hpp"
 
-void ASTNodeList::Accept(ASTVisitor *visitor) const
+void ASTNodeRef::Accept(ASTVisitor *visitor) const
 {
-    for (auto node : nodeList_) {
-        node->Accept(visitor);
+    ast_->Accept(id_, visitor);
+}
+
+NodeId AST::AddNode(NodeKind kind, std::uint8_t op, NodeId a, NodeId b, NodeId c)
+{
+    nodes_.push_back({.kind = kind, .op = op, .a = a, .b = b, .c = c});
+    return nodes_.size() - 1;
+}
+
+NodeId AST::AddName(const std::string &name)
+{
+    names_.push_back(name);
+    return names_.size() - 1;
+}
+
+NodeId AST::AddReals(std::initializer_list<double> vals)
+{
+    NodeId idx = reals_.size();
+    reals_.insert(reals_.end(), vals);
+    return idx;
+}
+
+NodeId AST::AddList(NodeId first)
+{
+    NodeId list = AddNode(NodeKind::LIST, 0, first);
+    nodes_[list].c = list;
+    return list;
+}
+
+void AST::Append(NodeId list, NodeId node)
+{
+    NodeId cell = AddNode(NodeKind::LIST, 0, node);
+    nodes_[nodes_[list].c].b = cell;
+    nodes_[list].c = cell;
+}
+
+NodeId AST::AddAssignment(const std::string &varName, NodeId rhs)
+{
+    return AddNode(NodeKind::ASSIGNMENT, 0, AddName(varName), rhs);
+}
+
+NodeId AST::AddPlot(const std::string &varName, double min, double max)
+{
+    return AddNode(NodeKind::PLOT, 0, AddName(varName), AddReals({min, max}));
+}
+
+NodeId AST::AddPlotXY(double angleX, double angleY, double angleZ, NodeId xyExpr)
+{
+    return AddNode(NodeKind::PLOTXY, 0, xyExpr, AddReals({angleX, angleY, angleZ}));
+}
+
+NodeId AST::AddPlotXYSimple(double min, double max, NodeId xyExpr)
+{
+    return AddNode(NodeKind::PLOTXY_SIMPLE, 0, xyExpr, AddReals({min, max}));
+}
+
+NodeId AST::AddPlotX(NodeId xExpr)
+{
+    return AddNode(NodeKind::PLOTX, 0, xExpr);
+}
+
+NodeId AST::AddBinExpr(CodeGen::BinaryOp opType, NodeId op1, NodeId op2)
+{
+    return AddNode(NodeKind::BIN_EXPR, static_cast<std::uint8_t>(opType), op1, op2);
+}
+
+NodeId AST::AddUnaryExpr(CodeGen::UnaryOp opType, NodeId op)
+{
+    return AddNode(NodeKind::UNARY_EXPR, static_cast<std::uint8_t>(opType), op);
+}
+
+NodeId AST::AddPow(NodeId base, int exp)
+{
+    return AddNode(NodeKind::POW, 0, base, exp);
+}
+
+NodeId AST::AddVar(const std::string &var)
+{
+    return AddNode(NodeKind::VAR, 0, AddName(var));
+}
+
+NodeId AST::AddConst(double val)
+{
+    return AddNode(NodeKind::REAL_CONST, 0, AddReals({val}));
+}
+
+NodeId AST::AddArrayLiteral(const std::vector<int> &shape,
+        const std::vector<double> &elements)
+{
+    NodeId shapeIdx = ints_.size();
+    ints_.insert(ints_.end(), shape.begin(), shape.end());
+    ints_.push_back(elements.size());
+    NodeId elementsIdx = reals_.size();
+    reals_.insert(reals_.end(), elements.begin(), elements.end());
+    return AddNode(NodeKind::ARRAY_LITERAL, 0, shapeIdx, shape.size(), elementsIdx);
+}
+
+NodeId AST::AddLoadedArray(const std::string &path, const std::vector<int> &shape,
+        const std::vector<uint32_t> &words)
+{
+    NodeId shapeIdx = ints_.size();
+    ints_.insert(ints_.end(), shape.begin(), shape.end());
+    ints_.push_back(AddName(path));
+    NodeId wordsIdx = words_.size();
+    words_.insert(words_.end(), words.begin(), words.end());
+    return AddNode(NodeKind::LOADED_ARRAY, 0, shapeIdx, shape.size(), wordsIdx);
+}
+
+std::span<const int> AST::Shape(NodeId id) const
+{
+    const ASTNodeRec &n = nodes_[id];
+    return {ints_.data() + n.a, n.b};
+}
+
+std::span<const double> AST::Elements(NodeId id) const
+{
+    const ASTNodeRec &n = nodes_[id];
+    return {reals_.data() + n.c, static_cast<std::size_t>(ints_[n.a + n.b])};
+}
+
+std::span<const uint32_t> AST::Words(NodeId id) const
+{
+    std::vector<int> shape(Shape(id).begin(), Shape(id).end());
+    auto [paddedDims, paddedSize] = CodeGen::PaddedArrSize(shape);
+    return {words_.data() + nodes_[id].c, static_cast<std::size_t>(paddedSize)};
+}
+
+bool AST::TouchesMem(NodeId id) const
+{
+    const ASTNodeRec &n = nodes_[id];
+    switch (n.kind) {
+    case NodeKind::LIST:
+        for (NodeId cell = id; cell != NO_NODE; cell = nodes_[cell].b) {
+            if (TouchesMem(nodes_[cell].a)) {
+                return true;
+            }
+        }
+        return false;
+    case NodeKind::PLOT:
+    case NodeKind::REAL_CONST:
+        return false;
+    case NodeKind::PLOTXY:
+    case NodeKind::PLOTXY_SIMPLE:
+    case NodeKind::PLOTX:
+    case NodeKind::UNARY_EXPR:
+    case NodeKind::POW:
+        return TouchesMem(n.a);
+    case NodeKind::BIN_EXPR:
+        return TouchesMem(n.a) || TouchesMem(n.b);
+    case NodeKind::VAR:
+        // any array operand makes expressions allocate temporaries
+        return names_[n.a] != "x" && names_[n.a] != "y";
+    case NodeKind::ASSIGNMENT:
+    case NodeKind::ARRAY_LITERAL:
+    case NodeKind::LOADED_ARRAY:
+        return true;
     }
+    return true;
 }
 
-void ASTNodeList::Append(std::shared_ptr<ASTNode> node)
+void AST::ReadVars(NodeId id, std::unordered_set<std::string> &vars) const
 {
-    nodeList_.push_back(node);
+    const ASTNodeRec &n = nodes_[id];
+    switch (n.kind) {
+    case NodeKind::PLOT:
+        vars.insert(names_[n.a]);
+        return;
+    case NodeKind::VAR:
+        // coordinates are not looked up in the bound variables
+        if (names_[n.a] != "x" && names_[n.a] != "y" && names_[n.a] != "xytup") {
+            vars.insert(names_[n.a]);
+        }
+        return;
+    case NodeKind::ASSIGNMENT:
+        ReadVars(n.b, vars);
+        return;
+    case NodeKind::PLOTXY:
+    case NodeKind::PLOTXY_SIMPLE:
+    case NodeKind::PLOTX:
+    case NodeKind::UNARY_EXPR:
+    case NodeKind::POW:
+        ReadVars(n.a, vars);
+        return;
+    case NodeKind::BIN_EXPR:
+        ReadVars(n.a, vars);
+        ReadVars(n.b, vars);
+        return;
+    case NodeKind::LIST:
+    case NodeKind::REAL_CONST:
+    case NodeKind::ARRAY_LITERAL:
+    case NodeKind::LOADED_ARRAY:
+        return;
+    }
 }
 
-void Assignment::Accept(ASTVisitor *visitor) const
+std::vector<bool> AST::LiveStatements(std::span<const NodeId> stmts) const
 {
-    visitor->VisitAssignment(varName_, rhs_);
+    std::vector<bool> live(stmts.size(), true);
+    // variables read by a later statement with an effect
+    std::unordered_set<std::string> read;
+    for (std::size_t i = stmts.size(); i-- > 0;) {
+        const ASTNodeRec &n = nodes_[stmts[i]];
+        if (n.kind == NodeKind::ASSIGNMENT && read.erase(names_[n.a]) == 0) {
+            live[i] = false;
+            continue;
+        }
+        ReadVars(stmts[i], read);
+    }
+    return live;
 }
 
-void PlotStatement::Accept(ASTVisitor *visitor) const
+std::uint64_t AST::Hash(NodeId id) const
 {
-    visitor->VisitPlot(varName_, min_, max_);
+    Fnv1a hash;
+    HashInto(id, hash);
+    return hash.Value();
 }
 
-void PlotXYStatement::Accept(ASTVisitor *visitor) const
+void AST::HashInto(NodeId id, Fnv1a &hash) const
 {
-    visitor->VisitPlotXY(angleX_, angleY_, angleZ_, xyExpr_);
+    const ASTNodeRec &n = nodes_[id];
+    hash.Add(n.kind).Add(n.op);
+    switch (n.kind) {
+    case NodeKind::LIST:
+        for (NodeId cell = id; cell != NO_NODE; cell = nodes_[cell].b) {
+            HashInto(nodes_[cell].a, hash);
+        }
+        break;
+    case NodeKind::ASSIGNMENT:
+        hash.Add(names_[n.a]);
+        HashInto(n.b, hash);
+        break;
+    case NodeKind::PLOT:
+        hash.Add(names_[n.a]).Add(reals_[n.b]).Add(reals_[n.b + 1]);
+        break;
+    case NodeKind::PLOTXY:
+        hash.Add(reals_[n.b]).Add(reals_[n.b + 1]).Add(reals_[n.b + 2]);
+        HashInto(n.a, hash);
+        break;
+    case NodeKind::PLOTXY_SIMPLE:
+        hash.Add(reals_[n.b]).Add(reals_[n.b + 1]);
+        HashInto(n.a, hash);
+        break;
+    case NodeKind::PLOTX:
+    case NodeKind::UNARY_EXPR:
+        HashInto(n.a, hash);
+        break;
+    case NodeKind::BIN_EXPR:
+        HashInto(n.a, hash);
+        HashInto(n.b, hash);
+        break;
+    case NodeKind::POW:
+        hash.Add(n.b);
+        HashInto(n.a, hash);
+        break;
+    case NodeKind::VAR:
+        hash.Add(names_[n.a]);
+        break;
+    case NodeKind::REAL_CONST:
+        hash.Add(reals_[n.a]);
+        break;
+    case NodeKind::ARRAY_LITERAL: {
+        std::span<const int> shape = Shape(id);
+        std::span<const double> elements = Elements(id);
+        hash.Add(shape.size()).Add(shape.data(), shape.size_bytes());
+        hash.Add(elements.size()).Add(elements.data(), elements.size_bytes());
+        break;
+    }
+    case NodeKind::LOADED_ARRAY: {
+        // the data is hashed rather than the path so edited files are noticed
+        std::span<const int> shape = Shape(id);
+        std::span<const uint32_t> words = Words(id);
+        hash.Add(shape.size()).Add(shape.data(), shape.size_bytes());
+        hash.Add(words.data(), words.size_bytes());
+        break;
+    }
+    }
 }
 
-void PlotXYSimpleStatement::Accept(ASTVisitor *visitor) const
+void AST::Simplify()
 {
-    visitor->VisitPlotXYSimple(min_, max_, xyExpr_);
+    for (NodeId cell = root; cell != NO_NODE; cell = nodes_[cell].b) {
+        NodeId stmt = nodes_[cell].a;
+        switch (nodes_[stmt].kind) {
+        case NodeKind::ASSIGNMENT: {
+            NodeId rhs = SimplifyExpr(nodes_[stmt].b);
+            nodes_[stmt].b = rhs;
+            break;
+        }
+        case NodeKind::PLOTXY:
+        case NodeKind::PLOTXY_SIMPLE:
+        case NodeKind::PLOTX: {
+            NodeId expr = SimplifyExpr(nodes_[stmt].a);
+            nodes_[stmt].a = expr;
+            break;
+        }
+        default:
+            break;
+        }
+    }
 }
 
-void PlotXStatement::Accept(ASTVisitor *visitor) const
+/// whether the expression at id evaluates to a single value per pixel rather
+/// than an array
+bool AST::IsScalar(NodeId id) const
 {
-    visitor->VisitPlotX(xExpr_);
+    const ASTNodeRec &n = nodes_[id];
+    switch (n.kind) {
+    case NodeKind::REAL_CONST:
+        return true;
+    case NodeKind::VAR:
+        return names_[n.a] == "x" || names_[n.a] == "y";
+    case NodeKind::BIN_EXPR:
+        return static_cast<CodeGen::BinaryOp>(n.op) != CodeGen::BinaryOp::DOT
+            && IsScalar(n.a) && IsScalar(n.b);
+    case NodeKind::UNARY_EXPR:
+        return static_cast<CodeGen::UnaryOp>(n.op) != CodeGen::UnaryOp::TRANSPOSE
+            && IsScalar(n.a);
+    case NodeKind::POW:
+        return IsScalar(n.a);
+    default:
+        return false;
+    }
 }
 
-void BinaryExprNode::Accept(ASTVisitor *visitor) const
+bool AST::IsConst(NodeId id, double val) const
 {
-    visitor->VisitBinExpr(opType_, op1_, op2_);
+    return nodes_[id].kind == NodeKind::REAL_CONST && reals_[nodes_[id].a] == val;
 }
 
-void UnaryExprNode::Accept(ASTVisitor *visitor) const
+bool AST::IsNegation(NodeId id) const
 {
-    visitor->VisitUnaryExpr(opType_, op_);
+    return nodes_[id].kind == NodeKind::UNARY_EXPR
+        && static_cast<CodeGen::UnaryOp>(nodes_[id].op) == CodeGen::UnaryOp::MINUS;
 }
 
-void VarNode::Accept(ASTVisitor *visitor) const
+/// -e for a scalar e without stacking negations
+NodeId AST::Negate(NodeId id)
 {
-    visitor->VisitVar(var_);
+    if (nodes_[id].kind == NodeKind::REAL_CONST) {
+        return AddConst(-reals_[nodes_[id].a]);
+    }
+    if (IsNegation(id)) {
+        return nodes_[id].a;
+    }
+    return AddUnaryExpr(CodeGen::UnaryOp::MINUS, id);
 }
 
-void RealConstNode::Accept(ASTVisitor *visitor) const
+/// simplified copy of the expression at id (id itself if nothing changed)
+NodeId AST::SimplifyExpr(NodeId id)
 {
-    visitor->VisitConst(val_);
+    using BinaryOp = CodeGen::BinaryOp;
+    using UnaryOp = CodeGen::UnaryOp;
+
+    ASTNodeRec n = nodes_[id];
+    if (n.kind == NodeKind::UNARY_EXPR) {
+        UnaryOp op = static_cast<UnaryOp>(n.op);
+        NodeId a = SimplifyExpr(n.a);
+        if (nodes_[a].kind == NodeKind::REAL_CONST && op != UnaryOp::TRANSPOSE) {
+            double val = CodeGen::UnaryOpToDoubleFn(op)(
+                    CodeGen::RoundTF18(reals_[nodes_[a].a]));
+            if (std::isfinite(val)) {
+                return AddConst(CodeGen::RoundTF18(val));
+            }
+        }
+        if (op == UnaryOp::MINUS && IsScalar(a)) {
+            return Negate(a);
+        }
+        return a == n.a ? id : AddUnaryExpr(op, a);
+    }
+    if (n.kind == NodeKind::POW) {
+        NodeId a = SimplifyExpr(n.a);
+        if (nodes_[a].kind == NodeKind::REAL_CONST) {
+            double val = CodeGen::PowTF18(reals_[nodes_[a].a], n.b);
+            if (std::isfinite(val)) {
+                return AddConst(val);
+            }
+        }
+        return a == n.a ? id : AddPow(a, n.b);
+    }
+    if (n.kind != NodeKind::BIN_EXPR) {
+        return id;
+    }
+
+    BinaryOp op = static_cast<BinaryOp>(n.op);
+    NodeId a = SimplifyExpr(n.a);
+    NodeId b = SimplifyExpr(n.b);
+    if (nodes_[a].kind == NodeKind::REAL_CONST && nodes_[b].kind == NodeKind::REAL_CONST
+            && op != BinaryOp::DOT) {
+        double val = CodeGen::BinaryOpToDoubleFn(op)(
+                CodeGen::RoundTF18(reals_[nodes_[a].a]),
+                CodeGen::RoundTF18(reals_[nodes_[b].a]));
+        if (std::isfinite(val)) {
+            return AddConst(CodeGen::RoundTF18(val));
+        }
+    }
+
+    // identities only hold if no operand is an array since those change the
+    // shape of the result
+    if (IsScalar(a) && IsScalar(b)) {
+        switch (op) {
+        case BinaryOp::PLUS:
+            if (IsConst(b, 0.0)) {
+                return a;
+            } else if (IsConst(a, 0.0)) {
+                return b;
+            } else if (IsNegation(b)) {
+                return SimplifyExpr(AddBinExpr(BinaryOp::MINUS, a, nodes_[b].a));
+            } else if (IsNegation(a)) {
+                return SimplifyExpr(AddBinExpr(BinaryOp::MINUS, b, nodes_[a].a));
+            }
+            break;
+        case BinaryOp::MINUS:
+            if (IsConst(b, 0.0)) {
+                return a;
+            } else if (IsConst(a, 0.0)) {
+                return Negate(b);
+            } else if (IsNegation(b)) {
+                return SimplifyExpr(AddBinExpr(BinaryOp::PLUS, a, nodes_[b].a));
+            }
+            break;
+        case BinaryOp::MULT:
+            if (IsConst(a, 0.0) || IsConst(b, 0.0)) {
+                return AddConst(0.0);
+            } else if (IsConst(b, 1.0)) {
+                return a;
+            } else if (IsConst(a, 1.0)) {
+                return b;
+            } else if (IsConst(b, -1.0)) {
+                return Negate(a);
+            } else if (IsConst(a, -1.0)) {
+                return Negate(b);
+            } else if (IsNegation(a) && IsNegation(b)) {
+                return SimplifyExpr(AddBinExpr(op, nodes_[a].a, nodes_[b].a));
+            }
+            break;
+        case BinaryOp::DIV:
+            if (IsConst(b, 1.0)) {
+                return a;
+            } else if (IsConst(b, -1.0)) {
+                return Negate(a);
+            } else if (IsNegation(a) && IsNegation(b)) {
+                return SimplifyExpr(AddBinExpr(op, nodes_[a].a, nodes_[b].a));
+            }
+            break;
+        case BinaryOp::DOT:
+            break;
+        }
+    }
+    return a == n.a && b == n.b ? id : AddBinExpr(op, a, b);
 }
 
-void ArrayLiteralNode::Accept(ASTVisitor *visitor) const
+void AST::Accept(NodeId id, ASTVisitor *visitor) const
 {
-    visitor->VisitArrayLiteral(shape_, elements_);
+    const ASTNodeRec &n = nodes_[id];
+    switch (n.kind) {
+    case NodeKind::LIST:
+        for (NodeId cell = id; cell != NO_NODE; cell = nodes_[cell].b) {
+            Accept(nodes_[cell].a, visitor);
+        }
+        break;
+    case NodeKind::ASSIGNMENT:
+        visitor->VisitAssignment(names_[n.a], Ref(n.b));
+        break;
+    case NodeKind::PLOT:
+        visitor->VisitPlot(names_[n.a], reals_[n.b], reals_[n.b + 1]);
+        break;
+    case NodeKind::PLOTXY:
+        visitor->VisitPlotXY(reals_[n.b], reals_[n.b + 1], reals_[n.b + 2], Ref(n.a));
+        break;
+    case NodeKind::PLOTXY_SIMPLE:
+        visitor->VisitPlotXYSimple(reals_[n.b], reals_[n.b + 1], Ref(n.a));
+        break;
+    case NodeKind::PLOTX:
+        visitor->VisitPlotX(Ref(n.a));
+        break;
+    case NodeKind::BIN_EXPR:
+        visitor->VisitBinExpr(static_cast<CodeGen::BinaryOp>(n.op), Ref(n.a), Ref(n.b));
+        break;
+    case NodeKind::UNARY_EXPR:
+        visitor->VisitUnaryExpr(static_cast<CodeGen::UnaryOp>(n.op), Ref(n.a));
+        break;
+    case NodeKind::POW:
+        visitor->VisitPow(Ref(n.a), n.b);
+        break;
+    case NodeKind::VAR:
+        visitor->VisitVar(names_[n.a]);
+        break;
+    case NodeKind::REAL_CONST:
+        visitor->VisitConst(reals_[n.a]);
+        break;
+    case NodeKind::ARRAY_LITERAL:
+        visitor->VisitArrayLiteral(Shape(id), Elements(id));
+        break;
+    case NodeKind::LOADED_ARRAY:
+        visitor->VisitLoadedArray(names_[ints_[n.a + n.b]], Shape(id), Words(id));
+        break;
+    }
 }
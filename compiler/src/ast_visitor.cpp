@@ -1,77 +1,90 @@
+#include <cmath>
 #include <string>
 #include <memory>
 #include <numeric> // for accumulate
 #include <algorithm> // for equal
 #include <variant>
+#include <map>
+#include <string_view>
+#include <unordered_set>
+#include <utility>
 
 #include "ast.hpp"
 #include "ast_visitor.hpp"
 #include "codegen.hpp"
+#include "log.hpp"
 
-void PrintVisitor::VisitAssignment(std::string varName,
-        std::shared_ptr<ASTNode> rhs)
+void PrintVisitor::VisitAssignment(const std::string &varName,
+        ASTNodeRef rhs)
 {
     stream_ << "$" << varName << " = ";
-    rhs->Accept(this);
+    rhs.Accept(this);
     stream_ << std::endl;
 }
 
-void PrintVisitor::VisitPlot(std::string varName, double min, double max)
+void PrintVisitor::VisitPlot(const std::string &varName, double min, double max)
 {
     stream_ << ".plot $" << varName << " " << min << " " << max << "\n";
 }
 
 void PrintVisitor::VisitPlotXY(double angleX, double angleY, double angleZ,
-    std::shared_ptr<ASTNode> xyExpr)
+    ASTNodeRef xyExpr)
 {
     stream_ << ".plotxy " << angleX << " " << angleY << " " << angleZ << " ";
-    xyExpr->Accept(this);
+    xyExpr.Accept(this);
     stream_ << std::endl;
 }
 
-void PrintVisitor::VisitPlotXYSimple(double min, double max, std::shared_ptr<ASTNode> xyExpr)
+void PrintVisitor::VisitPlotXYSimple(double min, double max, ASTNodeRef xyExpr)
 {
     stream_ << ".plotxy_simple " << min << " " << max << " ";
-    xyExpr->Accept(this);
+    xyExpr.Accept(this);
     stream_ << std::endl;
 }
 
 
-void PrintVisitor::VisitPlotX(std::shared_ptr<ASTNode> xExpr)
+void PrintVisitor::VisitPlotX(ASTNodeRef xExpr)
 {
     stream_ << ".plotx ";
-    xExpr->Accept(this);
+    xExpr.Accept(this);
     stream_ << std::endl;
 }
 
 void PrintVisitor::VisitBinExpr
 (
 		CodeGen::BinaryOp opType,
-		std::shared_ptr<ASTNode> op1,
-		std::shared_ptr<ASTNode> op2
+		ASTNodeRef op1,
+		ASTNodeRef op2
 )
 {
     stream_ << "(";
-    op1->Accept(this);
+    op1.Accept(this);
     stream_ << " " << CodeGen::BinaryOpToStr(opType) << " ";
-    op2->Accept(this);
+    op2.Accept(this);
     stream_ << ")";
 }
     
 void PrintVisitor::VisitUnaryExpr
 (
     CodeGen::UnaryOp opType,
-    std::shared_ptr<ASTNode> op
+    ASTNodeRef op
 )
 {
     stream_ << "(" << CodeGen::UnaryOpToStr(opType);
     stream_ << "(";
-    op->Accept(this);
+    op.Accept(this);
     stream_ << ")";
     stream_ << ")";
 }
 
-void PrintVisitor::VisitVar(std::string var)
+void PrintVisitor::VisitPow(ASTNodeRef base, int exp)
+{
+    stream_ << "(";
+    base.Accept(this);
+    stream_ << "^" << exp << ")";
+}
+
+void PrintVisitor::VisitVar(const std::string &var)
 {
     stream_ << var;
 }
@@ -82,8 +95,8 @@ void PrintVisitor::VisitConst(double val)
 }
 
 
-void PrintVisitor::VisitArrayLiteral(std::vector<int> shape,
-        std::vector<double> elements)
+void PrintVisitor::VisitArrayLiteral(std::span<const int> shape,
+        std::span<const double> elements)
 {
     stream_ << "|";
     for (int s : shape) {
@@ -96,10 +109,617 @@ void PrintVisitor::VisitArrayLiteral(std::vector<int> shape,
     stream_ << "]";
 }
 
-void ASMGenVisitor::VisitAssignment(std::string varName,
-        std::shared_ptr<ASTNode> rhs)
+void PrintVisitor::VisitLoadedArray(const std::string &path,
+        std::span<const int> shape, std::span<const uint32_t>)
+{
+    stream_ << "|";
+    for (int s : shape) {
+        stream_ << s << ",";
+    }
+    stream_ << "|load(\"" << path << "\")";
+}
+
+/// Emits a top-level statement through the statement cache if there is one.
+///
+/// Besides the statement itself the generated code depends on the addresses
+/// the memory allocator hands out and on which arrays belong to variables, so
+/// the key covers all variable bindings and the allocator state. An entry
+/// holds the allocator state after the statement, the new binding of
+/// assignedVar (if not empty) and the serialized IR of the code.
+void ASMGenVisitor::EmitCached(Fnv1a &stmtHash, const std::string &assignedVar,
+        const std::function<void(ASMGenVisitor &)> &emit)
+{
+    stmtHash.Add(ctx_->singleOut);
+    std::map<std::string, CodeGen::ExprOut> vars(ctx_->varMemMap.begin(),
+            ctx_->varMemMap.end());
+    for (auto &[name, out] : vars) {
+        stmtHash.Add(name).Add(CodeGen::ExprOutToStr(out));
+    }
+    stmtHash.Add(ctx_->MemStateToStr());
+    uint64_t key = cache_->Key(stmtHash.Value());
+
+    std::string entry;
+    if (cache_->Lookup(key, entry)) {
+        std::size_t memEnd = entry.find('\n');
+        std::size_t bindingEnd = entry.find('\n', memEnd + 1);
+        ctx_->MemStateFromStr(entry.substr(0, memEnd));
+        if (!assignedVar.empty()) {
+            ctx_->varMemMap[assignedVar] = CodeGen::ExprOutFromStr(
+                    entry.substr(memEnd + 1, bindingEnd - memEnd - 1));
+        }
+        mod_.Append(ir::Deserialize(std::string_view {entry}.substr(bindingEnd + 1)));
+        return;
+    }
+
+    ir::Module code;
+    ASMGenVisitor visitor {ctx_, code};
+    emit(visitor);
+
+    entry = ctx_->MemStateToStr() + "\n";
+    if (!assignedVar.empty()) {
+        entry += CodeGen::ExprOutToStr(ctx_->varMemMap[assignedVar]);
+    }
+    entry += "\n";
+    entry += ir::Serialize(code);
+    cache_->Store(key, entry);
+    mod_.Append(std::move(code));
+}
+
+/// operand nodes of the expression at id
+static std::vector<NodeId> Operands(const AST &ast, NodeId id)
+{
+    const ASTNodeRec &n = ast.Node(id);
+    switch (n.kind) {
+    case NodeKind::BIN_EXPR:
+        return {n.a, n.b};
+    case NodeKind::UNARY_EXPR:
+    case NodeKind::POW:
+        return {n.a};
+    default:
+        return {};
+    }
+}
+
+/// Value numbering of the per-pixel expression expr by structural hash.
+///
+/// A value is generated once for each operand slot of the distinct
+/// expressions using it (and once more for expr itself). Operation nodes
+/// whose value is needed more than once are given a name in valueNames_ so
+/// that EvalExpr keeps their register in varMap. Variables and constants are
+/// left out since x and y are kept by XIntoReg and YIntoReg already.
+void ASMGenVisitor::NumberValues(ASTNodeRef expr)
+{
+    const AST &ast = expr.Tree();
+    std::unordered_map<NodeId, std::uint64_t> hashes;
+    // one representative node per distinct subexpression
+    std::unordered_map<std::uint64_t, NodeId> distinct;
+    std::vector<NodeId> stack {expr.Id()};
+    while (!stack.empty()) {
+        NodeId id = stack.back();
+        stack.pop_back();
+        hashes[id] = ast.Hash(id);
+        distinct.emplace(hashes[id], id);
+        for (NodeId child : Operands(ast, id)) {
+            stack.push_back(child);
+        }
+    }
+
+    std::unordered_map<std::uint64_t, int> uses;
+    for (auto [hash, id] : distinct) {
+        for (NodeId child : Operands(ast, id)) {
+            uses[hashes[child]]++;
+        }
+    }
+
+    valueNames_.clear();
+    for (auto [id, hash] : hashes) {
+        if (uses[hash] > 1 && !Operands(ast, id).empty()) {
+            valueNames_[id] = VALUE_PREFIX + std::to_string(hash);
+        }
+    }
+}
+
+/// whether the scalar expression at id has the same value in every column
+static bool IsXInvariant(const AST &ast, NodeId id)
+{
+    const ASTNodeRec &n = ast.Node(id);
+    switch (n.kind) {
+    case NodeKind::REAL_CONST:
+        return true;
+    case NodeKind::VAR:
+        return ast.Name(n.a) == "y";
+    case NodeKind::BIN_EXPR:
+        return static_cast<CodeGen::BinaryOp>(n.op) != CodeGen::BinaryOp::DOT
+            && IsXInvariant(ast, n.a) && IsXInvariant(ast, n.b);
+    case NodeKind::UNARY_EXPR:
+        return static_cast<CodeGen::UnaryOp>(n.op) != CodeGen::UnaryOp::TRANSPOSE
+            && IsXInvariant(ast, n.a);
+    case NodeKind::POW:
+        return IsXInvariant(ast, n.a);
+    default:
+        return false;
+    }
+}
+
+/// Generates the largest operations of expr which do not depend on x ahead of
+/// the column loop of .simple_plotxy. They stay in varMap under
+/// INVARIANT_PREFIX names across columns until AllocReg takes their register,
+/// after which EvalExpr generates them again in the next column that uses
+/// them.
+void ASMGenVisitor::HoistInvariants(ASTNodeRef expr)
+{
+    const AST &ast = expr.Tree();
+    std::vector<NodeId> stack {expr.Id()};
+    while (!stack.empty()) {
+        NodeId id = stack.back();
+        stack.pop_back();
+        std::vector<NodeId> operands = Operands(ast, id);
+        if (operands.empty()) {
+            continue;
+        }
+        if (!IsXInvariant(ast, id)) {
+            // reversed to generate operands from left to right
+            stack.insert(stack.end(), operands.rbegin(), operands.rend());
+            continue;
+        }
+        valueNames_[id] = INVARIANT_PREFIX + std::to_string(ast.Hash(id));
+        EvalExpr(ast.Ref(id));
+    }
+}
+
+/// whether the expression at id applies its operator to every element of
+/// its operands on its own
+static bool IsElementwise(const AST &ast, NodeId id)
+{
+    const ASTNodeRec &n = ast.Node(id);
+    switch (n.kind) {
+    case NodeKind::BIN_EXPR:
+        return static_cast<CodeGen::BinaryOp>(n.op) != CodeGen::BinaryOp::DOT;
+    case NodeKind::UNARY_EXPR:
+        return static_cast<CodeGen::UnaryOp>(n.op) != CodeGen::UnaryOp::TRANSPOSE;
+    case NodeKind::POW:
+        return true;
+    default:
+        return false;
+    }
+}
+
+static bool IsDot(const AST &ast, NodeId id)
+{
+    const ASTNodeRec &n = ast.Node(id);
+    return n.kind == NodeKind::BIN_EXPR
+        && static_cast<CodeGen::BinaryOp>(n.op) == CodeGen::BinaryOp::DOT;
+}
+
+/// whether the expression at id reads the coordinates of a plot
+static bool ReadsCoords(const AST &ast, NodeId id)
+{
+    const ASTNodeRec &n = ast.Node(id);
+    if (n.kind == NodeKind::VAR) {
+        const std::string &name = ast.Name(n.a);
+        return name == "x" || name == "y" || name == "xytup";
+    }
+    for (NodeId child : Operands(ast, id)) {
+        if (ReadsCoords(ast, child)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/// whether expr evaluates to a scalar at compile time
+bool ASMGenVisitor::IsConstant(ASTNodeRef expr) const
+{
+    const AST &ast = expr.Tree();
+    const ASTNodeRec &n = ast.Node(expr.Id());
+    if (n.kind == NodeKind::REAL_CONST) {
+        return true;
+    }
+    if (n.kind == NodeKind::VAR) {
+        auto var = ctx_->varMemMap.find(ast.Name(n.a));
+        return var != ctx_->varMemMap.end() && (var->second.t == CodeGen::OutType::real
+                || var->second.t == CodeGen::OutType::integer);
+    }
+    if (!IsElementwise(ast, expr.Id())) {
+        return false;
+    }
+    for (NodeId child : Operands(ast, expr.Id())) {
+        if (!IsConstant(ast.Ref(child))) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/// Shape of the array expr evaluates to as far as it is known before code is
+/// generated for it. Empty for scalars and for operands of elementwise
+/// operations or dot products whose shapes do not match.
+std::optional<std::vector<int>> ASMGenVisitor::ArrShape(ASTNodeRef expr) const
+{
+    const AST &ast = expr.Tree();
+    const ASTNodeRec &n = ast.Node(expr.Id());
+    switch (n.kind) {
+    case NodeKind::VAR: {
+        auto var = ctx_->varMemMap.find(ast.Name(n.a));
+        if (var == ctx_->varMemMap.end() || var->second.t != CodeGen::OutType::mem) {
+            return {};
+        }
+        return std::get<CodeGen::Arr>(var->second.v).shape;
+    }
+    case NodeKind::ARRAY_LITERAL: {
+        std::span<const int> shape = ast.Shape(expr.Id());
+        if (shape.size() < 2) {
+            return std::vector<int> {1, shape[0]};
+        }
+        return std::vector<int>(shape.begin(), shape.end());
+    }
+    case NodeKind::LOADED_ARRAY: {
+        std::span<const int> shape = ast.Shape(expr.Id());
+        return std::vector<int>(shape.begin(), shape.end());
+    }
+    default:
+        break;
+    }
+
+    if (IsDot(ast, expr.Id())) {
+        auto shape1 = ArrShape(ast.Ref(n.a));
+        auto shape2 = ArrShape(ast.Ref(n.b));
+        if (!shape1 || !shape2 || shape1->size() != 2 || shape2->size() != 2
+                || (*shape1)[1] != (*shape2)[0]) {
+            return {};
+        }
+        return std::vector<int> {(*shape1)[0], (*shape2)[1]};
+    }
+    if (n.kind == NodeKind::UNARY_EXPR
+            && static_cast<CodeGen::UnaryOp>(n.op) == CodeGen::UnaryOp::TRANSPOSE) {
+        auto shape = ArrShape(ast.Ref(n.a));
+        if (!shape || shape->size() != 2) {
+            return {};
+        }
+        return std::vector<int> {(*shape)[1], (*shape)[0]};
+    }
+    if (!IsElementwise(ast, expr.Id())) {
+        return {};
+    }
+    std::optional<std::vector<int>> shape;
+    for (NodeId child : Operands(ast, expr.Id())) {
+        if (IsConstant(ast.Ref(child))) {
+            continue;
+        }
+        auto childShape = ArrShape(ast.Ref(child));
+        if (!childShape || (shape && *shape != *childShape)) {
+            return {};
+        }
+        shape = childShape;
+    }
+    return shape;
+}
+
+/// register holding the value of the elementwise expression expr for the
+/// element of the thread, generated after the ones in values
+int ASMGenVisitor::ElementwiseIntoReg(ASTNodeRef expr,
+        std::unordered_map<std::uint64_t, int> &values)
+{
+    const AST &ast = expr.Tree();
+    std::uint64_t hash = ast.Hash(expr.Id());
+    auto known = values.find(hash);
+    if (known != values.end()) {
+        return known->second;
+    }
+
+    const ASTNodeRec &n = ast.Node(expr.Id());
+    int opReg = ElementwiseIntoReg(ast.Ref(n.a), values);
+    int outReg;
+    switch (n.kind) {
+    case NodeKind::BIN_EXPR: {
+        int op2Reg = ElementwiseIntoReg(ast.Ref(n.b), values);
+        outReg = ctx_->AllocReg();
+        ctx_->EmitBinExpr(static_cast<CodeGen::BinaryOp>(n.op), outReg, opReg, op2Reg, mod_);
+        break;
+    }
+    case NodeKind::UNARY_EXPR:
+        outReg = ctx_->AllocReg();
+        ctx_->EmitUnaryExpr(static_cast<CodeGen::UnaryOp>(n.op), outReg, opReg, mod_);
+        break;
+    default:
+        outReg = ctx_->AllocReg();
+        ctx_->EmitPow(outReg, opReg, n.b, mod_);
+        break;
+    }
+    values[hash] = outReg;
+    return outReg;
+}
+
+/// Collects the roots of the largest trees of elementwise operations on
+/// arrays of one shape in the assignment expression expr. These do not read
+/// the coordinates of a plot, their operands are arrays or scalars known at
+/// compile time and their array operands have the same shape.
+void ASMGenVisitor::FindElementwise(ASTNodeRef expr)
+{
+    const AST &ast = expr.Tree();
+    elementwiseRoots_.clear();
+    std::vector<NodeId> stack {expr.Id()};
+    while (!stack.empty()) {
+        NodeId id = stack.back();
+        stack.pop_back();
+        if (!IsElementwise(ast, id) || ReadsCoords(ast, id) || !ArrShape(ast.Ref(id))) {
+            std::vector<NodeId> operands = Operands(ast, id);
+            stack.insert(stack.end(), operands.begin(), operands.end());
+            continue;
+        }
+        elementwiseRoots_.insert(id);
+        // array operands of the tree may contain trees of their own
+        std::vector<NodeId> tree {id};
+        while (!tree.empty()) {
+            NodeId node = tree.back();
+            tree.pop_back();
+            for (NodeId child : Operands(ast, node)) {
+                if (IsConstant(ast.Ref(child))) {
+                    continue;
+                }
+                (IsElementwise(ast, child) ? tree : stack).push_back(child);
+            }
+        }
+    }
+}
+
+/// Generates a tree of elementwise operations found by FindElementwise as a
+/// single program. Every array it reads is loaded once, intermediate values
+/// stay in registers and only the result is stored. Scalars are applied to
+/// every element. The array operands which are not elementwise operations
+/// themselves are generated first, from left to right.
+///
+/// If one of them is a dot product the tree becomes the epilogue of its
+/// program instead, see EmitDotEpilogue.
+///
+/// Returns false without generating anything if expr is not the root of such
+/// a tree.
+bool ASMGenVisitor::EmitElementwise(ASTNodeRef expr)
+{
+    if (!elementwiseRoots_.contains(expr.Id())) {
+        return false;
+    }
+    const AST &ast = expr.Tree();
+    std::vector<int> shape = *ArrShape(expr);
+
+    std::vector<NodeId> inputs;
+    // elementwise operation each input is an operand of
+    std::vector<NodeId> parents;
+    int ops = 0;
+    std::vector<std::pair<NodeId, NodeId>> stack {{expr.Id(), AST::NO_NODE}};
+    while (!stack.empty()) {
+        auto [id, parent] = stack.back();
+        stack.pop_back();
+        if (!IsElementwise(ast, id) || IsConstant(ast.Ref(id))) {
+            inputs.push_back(id);
+            parents.push_back(parent);
+            continue;
+        }
+        ops++;
+        std::vector<NodeId> operands = Operands(ast, id);
+        // reversed to generate operands from left to right
+        for (auto it = operands.rbegin(); it != operands.rend(); it++) {
+            stack.push_back({*it, id});
+        }
+    }
+    auto dot = std::find_if(inputs.begin(), inputs.end(),
+            [&](NodeId id) { return IsDot(ast, id); });
+    NodeId dotId = dot == inputs.end() ? AST::NO_NODE : *dot;
+
+    std::vector<CodeGen::ExprOut> outs;
+    std::vector<CodeGen::ExprOut> temps;
+    CodeGen::Arr dotArr1;
+    CodeGen::Arr dotArr2;
+    for (NodeId id : inputs) {
+        if (id != dotId) {
+            EvalExpr(ast.Ref(id));
+            outs.push_back(ctx_->exprOut);
+            temps.push_back(ctx_->exprOut);
+            continue;
+        }
+        const ASTNodeRec &n = ast.Node(id);
+        EvalExpr(ast.Ref(n.a));
+        temps.push_back(ctx_->exprOut);
+        dotArr1 = std::get<CodeGen::Arr>(ctx_->exprOut.v);
+        EvalExpr(ast.Ref(n.b));
+        temps.push_back(ctx_->exprOut);
+        dotArr2 = std::get<CodeGen::Arr>(ctx_->exprOut.v);
+        // replaced by the output once it is allocated
+        outs.push_back({});
+    }
+
+    auto [dimSizes, totalSize] = CodeGen::PaddedArrSize(shape);
+    int newAddr = ctx_->AllocMem(totalSize * 2);
+    std::unordered_set<int> freed;
+    for (const CodeGen::ExprOut &out : temps) {
+        if (out.t != CodeGen::OutType::mem) {
+            continue;
+        }
+        CodeGen::Arr arr = std::get<CodeGen::Arr>(out.v);
+        if (!ctx_->IsArrAVariable(arr) && freed.insert(arr.addr).second) {
+            ctx_->FreeMem(arr.addr);
+        }
+    }
+    CodeGen::Arr arrOut = {
+        .size = std::accumulate(shape.begin(), shape.end(), 1, std::multiplies<int>()),
+        .addr = newAddr,
+        .shape = shape,
+    };
+    ctx_->exprOut = {
+        .t = CodeGen::OutType::mem,
+        .v = arrOut,
+    };
+
+    if (dotId != AST::NO_NODE) {
+        std::size_t dotIdx = dot - inputs.begin();
+        outs[dotIdx] = ctx_->exprOut;
+        LOG(DEBUG, *ctx_->log << "fused " << ops << " elementwise operations into the dot"
+                << " product of shape " << CodeGen::ShapeToStr(arrOut.shape) << " @ "
+                << newAddr << std::endl);
+        EmitDotEpilogue(expr, inputs, parents, outs, dotIdx, dotArr1, dotArr2, arrOut);
+        ctx_->counters.fusedPrograms += ops;
+        return true;
+    }
+    LOG(DEBUG, *ctx_->log << "fused " << ops << " elementwise operations of shape "
+            << CodeGen::ShapeToStr(arrOut.shape) << " @ " << newAddr << std::endl);
+
+    CodeGen::ProgHeader(totalSize/BLOCK_DIM, mod_);
+    int idxReg = ctx_->IndexIntoReg(mod_, 2);
+    std::unordered_map<int, int> loaded;
+    std::unordered_map<std::uint64_t, int> values;
+    for (std::size_t i = 0; i < inputs.size(); i++) {
+        std::uint64_t hash = ast.Hash(inputs[i]);
+        if (values.contains(hash)) {
+            continue;
+        }
+        if (outs[i].t != CodeGen::OutType::mem) {
+            values[hash] = ctx_->ToRegCast(outs[i], mod_);
+            continue;
+        }
+        int addr = std::get<CodeGen::Arr>(outs[i].v).addr;
+        if (!loaded.contains(addr)) {
+            int addrReg = ctx_->AllocReg();
+            int valReg = ctx_->AllocReg();
+            ctx_->ASMImmOp(ir::Op::ADDI, addrReg, idxReg, addr, mod_);
+            ctx_->LoadReg(valReg, addrReg, mod_);
+            ctx_->FreeReg(addrReg);
+            loaded[addr] = valReg;
+        }
+        values[hash] = loaded[addr];
+    }
+
+    int valReg = ElementwiseIntoReg(expr, values);
+    int outAddrReg = ctx_->AllocReg();
+    ctx_->ASMImmOp(ir::Op::ADDI, outAddrReg, idxReg, newAddr, mod_);
+    ctx_->StoreReg(valReg, outAddrReg, mod_);
+
+    ctx_->Reset();
+    mod_.Append(ir::Make(ir::Op::EXIT, {}));
+    ctx_->counters.fusedPrograms += ops - 1;
+    return true;
+}
+
+/// Generates the tree of elementwise operations expr on the dot product
+/// inputs[dotIdx] of arr1 and arr2 in the programs of the dot product, which
+/// write arrOut. inputs are the operands of the tree with their elementwise
+/// operations in parents and what they evaluated to in outs.
+///
+/// An array or scalar added to the dot product is its initial value in place
+/// of 0. The rest of the tree is applied to each element of the output by
+/// the blocks which add its last term, with the other array inputs loaded at
+/// the same element.
+void ASMGenVisitor::EmitDotEpilogue(ASTNodeRef expr, const std::vector<NodeId> &inputs,
+        const std::vector<NodeId> &parents, const std::vector<CodeGen::ExprOut> &outs,
+        std::size_t dotIdx, const CodeGen::Arr &arr1, const CodeGen::Arr &arr2,
+        const CodeGen::Arr &arrOut)
+{
+    const AST &ast = expr.Tree();
+    std::uint64_t dotHash = ast.Hash(inputs[dotIdx]);
+    // value of the tree the accumulator holds when the last term was added
+    std::uint64_t accHash = dotHash;
+    std::optional<std::size_t> initIdx;
+
+    NodeId parent = parents[dotIdx];
+    const ASTNodeRec &p = ast.Node(parent);
+    long uses = std::count_if(inputs.begin(), inputs.end(),
+            [&](NodeId id) { return ast.Hash(id) == dotHash; });
+    if (p.kind == NodeKind::BIN_EXPR
+            && static_cast<CodeGen::BinaryOp>(p.op) == CodeGen::BinaryOp::PLUS && uses == 1) {
+        // the other operand of the addition is an input next to the dot product
+        for (std::size_t i : {dotIdx - 1, dotIdx + 1}) {
+            if (i < inputs.size() && parents[i] == parent) {
+                initIdx = i;
+                accHash = ast.Hash(parent);
+            }
+        }
+    }
+
+    std::unordered_map<std::uint64_t, int> scalars;
+    auto epilogue = [&](int accReg, int outAddrReg) {
+        std::unordered_map<std::uint64_t, int> values {{accHash, accReg}};
+        std::unordered_map<int, int> loaded;
+        for (std::size_t i = 0; i < inputs.size(); i++) {
+            std::uint64_t hash = ast.Hash(inputs[i]);
+            if (i == initIdx || hash == dotHash || values.contains(hash)) {
+                continue;
+            }
+            if (outs[i].t != CodeGen::OutType::mem) {
+                if (!scalars.contains(hash)) {
+                    scalars[hash] = ctx_->ToRegCast(outs[i], mod_);
+                }
+                values[hash] = scalars[hash];
+                continue;
+            }
+            int offset = std::get<CodeGen::Arr>(outs[i].v).addr - arrOut.addr;
+            if (!loaded.contains(offset)) {
+                int addrReg = ctx_->AllocReg();
+                int valReg = ctx_->AllocReg();
+                ctx_->ASMImmOp(offset < 0 ? ir::Op::SUBI : ir::Op::ADDI, addrReg, outAddrReg,
+                        std::abs(offset), mod_);
+                ctx_->LoadReg(valReg, addrReg, mod_);
+                ctx_->FreeReg(addrReg);
+                loaded[offset] = valReg;
+            }
+            values[hash] = loaded[offset];
+        }
+        int valReg = ElementwiseIntoReg(expr, values);
+        for (const auto &[hash, reg] : values) {
+            if (reg != valReg && reg != accReg && !scalars.contains(hash)) {
+                ctx_->FreeReg(reg);
+            }
+        }
+        return valReg;
+    };
+
+    const CodeGen::ExprOut *init = initIdx ? &outs[*initIdx] : nullptr;
+    if (accHash == ast.Hash(expr.Id())) {
+        EmitDot(arr1, arr2, arrOut, init);
+    } else {
+        EmitDot(arr1, arr2, arrOut, init, epilogue);
+    }
+}
+
+/// Generates expr or reuses the register of an equal value generated before
+void ASMGenVisitor::EvalExpr(ASTNodeRef expr)
 {
-    rhs->Accept(this);
+    if (EmitElementwise(expr)) {
+        return;
+    }
+    auto name = valueNames_.find(expr.Id());
+    if (name == valueNames_.end()) {
+        expr.Accept(this);
+        return;
+    }
+    auto reg = ctx_->varMap.find(name->second);
+    if (reg != ctx_->varMap.end()) {
+        ctx_->exprOut = {
+            .t = CodeGen::OutType::reg,
+            .v = reg->second,
+        };
+        return;
+    }
+    expr.Accept(this);
+    if (ctx_->exprOut.t == CodeGen::OutType::reg) {
+        ctx_->varMap[name->second] = std::get<int>(ctx_->exprOut.v);
+    }
+}
+
+void ASMGenVisitor::VisitAssignment(const std::string &varName,
+        ASTNodeRef rhs)
+{
+    if (cache_ != nullptr) {
+        Fnv1a hash;
+        hash.Add(std::string_view {"assign"}).Add(varName).Add(rhs.Tree().Hash(rhs.Id()));
+        EmitCached(hash, varName,
+                [&](ASMGenVisitor &v) { v.VisitAssignment(varName, rhs); });
+        return;
+    }
+
+    FindElementwise(rhs);
+    if (!EmitElementwise(rhs)) {
+        rhs.Accept(this);
+    }
+    elementwiseRoots_.clear();
 
     if (ctx_->varMemMap.find(varName) != ctx_->varMemMap.end()) {
 
@@ -113,8 +733,16 @@ void ASMGenVisitor::VisitAssignment(std::string varName,
     ctx_->varMemMap[varName] = ctx_->exprOut;
 }
 
-void ASMGenVisitor::VisitPlot(std::string varName, double min, double max)
+void ASMGenVisitor::VisitPlot(const std::string &varName, double min, double max)
 {
+    if (cache_ != nullptr) {
+        Fnv1a hash;
+        hash.Add(std::string_view {"plot"}).Add(varName).Add(min).Add(max);
+        EmitCached(hash, "",
+                [&](ASMGenVisitor &v) { v.VisitPlot(varName, min, max); });
+        return;
+    }
+
     if (ctx_->varMemMap[varName].t != CodeGen::OutType::mem) {
         std::cerr << ".plot works only for 2d arrays but not integers" << std::endl;
         std::exit(1);
@@ -127,78 +755,146 @@ void ASMGenVisitor::VisitPlot(std::string varName, double min, double max)
         std::exit(1);
     }
 
-    std::cerr << ".plot shape: " + CodeGen::ShapeToStr(var.shape) << std::endl;
+    LOG(DEBUG, *ctx_->log << ".plot shape: " + CodeGen::ShapeToStr(var.shape) << std::endl);
     auto [paddedDims, paddedSize] = CodeGen::PaddedArrSize(var.shape);
-    // program for 1 row of the array
-    for (int i = 0; i < var.shape[0]; i++) {
-        CodeGen::ProgHeader(paddedDims[1]/BLOCK_DIM, stream_);
-        int addrReg = ctx_->IndexIntoReg(stream_);
-        int valReg = ctx_->AllocReg();
-        ctx_->ASMImmOp("addi", addrReg, addrReg,
-                var.addr + i * 2 * paddedDims[1], stream_);
-        ctx_->LoadReg(valReg, addrReg, stream_);
-        
-        ctx_->ChangeRegScale(valReg, min, max, 0.0, 1.0, stream_);
-        ctx_->ASMOp("cvtfc", valReg, valReg, stream_);
-        stream_ << "disp r" << valReg << "\n";
-        ctx_->FreeReg({addrReg, valReg});
-        ctx_->Reset();
-        stream_ << "exit\n";
+    // one program for all rows: NUM_THREADS blocks per row of the screen,
+    // which display BLOCK_DIM pixels each in turn for every disp as in
+    // DisplayMem. The first paddedDims[1] pixels of a row show the row of the
+    // array, the others are the margin.
+    // note that NUM_THREADS has to be a power of 2
+    CodeGen::ProgHeader(var.shape[0] * NUM_THREADS, mod_);
+    int rowReg = ctx_->AllocReg();
+    int colReg = ctx_->AllocReg();
+    int addrReg = ctx_->AllocReg();
 
-        CodeGen::ProgHeader((SCREEN_WIDTH - paddedDims[1])/BLOCK_DIM, stream_);
-        stream_ << "disp zero\n";
-        stream_ << "exit\n";
+    // row = blockIdx / NUM_THREADS
+    // col = (blockIdx % NUM_THREADS) * BLOCK_DIM + threadIdx
+    ctx_->ASMImmOp(ir::Op::SRLI, rowReg, ir::BLOCK_IDX,
+        static_cast<int>(std::log2(static_cast<double>(NUM_THREADS))),
+        mod_);
+    ctx_->ASMImmOp(ir::Op::ANDI, colReg, ir::BLOCK_IDX, NUM_THREADS-1, mod_);
+    ctx_->ASMImmOp(ir::Op::SLLI, colReg, colReg,
+        static_cast<int>(std::log2(static_cast<double>(BLOCK_DIM))),
+        mod_);
+
+    // addr = var.addr + row * 2 * paddedDims[1] + 2 * (col - threadIdx) + threadIdx
+    // as the high halves of every BLOCK_DIM elements follow them; the
+    // integer unit cannot multiply so the row offset is summed from shifts
+    int rowSize = 2 * paddedDims[1];
+    ctx_->ASMImmOp(ir::Op::SLLI, addrReg, colReg, 1, mod_);
+    for (int bit = 0; (rowSize >> bit) != 0; bit++) {
+        if ((rowSize >> bit) & 1) {
+            int tmpReg = ctx_->AllocReg();
+            ctx_->ASMImmOp(ir::Op::SLLI, tmpReg, rowReg, bit, mod_);
+            ctx_->ASMOp(ir::Op::ADD, addrReg, addrReg, tmpReg, mod_);
+            ctx_->FreeReg(tmpReg);
+        }
     }
+    ctx_->FreeReg(rowReg);
+    ctx_->ASMOp(ir::Op::ADD, addrReg, addrReg, ir::THREAD_IDX, mod_);
+    ctx_->ASMImmOp(ir::Op::ADDI, addrReg, addrReg, var.addr, mod_);
+    ctx_->ASMOp(ir::Op::ADD, colReg, colReg, ir::THREAD_IDX, mod_);
+
+    int pixelsPerDisp = NUM_THREADS * BLOCK_DIM;
+    for (int i = 0; i < SCREEN_WIDTH / pixelsPerDisp; i++) {
+        int dataCols = paddedDims[1] - i * pixelsPerDisp;
+        if (dataCols <= 0) {
+            mod_.Append(ir::Make(ir::Op::DISP, {ir::ZERO}));
+            continue;
+        }
+        if (i > 0) {
+            ctx_->ASMImmOp(ir::Op::ADDI, addrReg, addrReg, 2 * pixelsPerDisp, mod_);
+        }
+        int valReg = ctx_->AllocReg();
+        ctx_->LoadReg(valReg, addrReg, mod_);
+        ctx_->ChangeRegScale(valReg, min, max, 0.0, 1.0, mod_);
+        ctx_->ASMOp(ir::Op::CVTFC, valReg, valReg, mod_);
+        if (dataCols >= pixelsPerDisp) {
+            mod_.Append(ir::Make(ir::Op::DISP, {valReg}));
+            ctx_->FreeReg(valReg);
+            continue;
+        }
+        // the margin starts within these pixels
+        int pixelReg = ctx_->AllocReg();
+        ctx_->ASMImmOp(ir::Op::ADDI, pixelReg, ir::ZERO, 0, mod_);
+        mod_.Append(ir::Make(ir::Op::SLTI, {colReg}, dataCols));
+        ctx_->predMode = true;
+        ctx_->ASMImmOp(ir::Op::ADDI, pixelReg, valReg, 0, mod_);
+        ctx_->predMode = false;
+        mod_.Append(ir::Make(ir::Op::DISP, {pixelReg}));
+        ctx_->FreeReg({valReg, pixelReg});
+    }
+    ctx_->FreeReg({addrReg, colReg});
+    ctx_->Reset();
+    mod_.Append(ir::Make(ir::Op::EXIT, {}));
 }
 
 void ASMGenVisitor::VisitPlotXY(double angleX, double angleY, double angleZ,
-	std::shared_ptr<ASTNode> xyExpr)
+	ASTNodeRef xyExpr)
 {
+    if (cache_ != nullptr) {
+        Fnv1a hash;
+        hash.Add(std::string_view {"plotxy"}).Add(angleX).Add(angleY).Add(angleZ)
+            .Add(xyExpr.Tree().Hash(xyExpr.Id()));
+        EmitCached(hash, "", [&](ASMGenVisitor &v) {
+            v.VisitPlotXY(angleX, angleY, angleZ, xyExpr);
+        });
+        return;
+    }
+
 	// PROGRAM to fill with rotated values
-	CodeGen::ProgHeader((PLOT_WIDTH * PLOT_HEIGHT)/BLOCK_DIM, stream_);
+	CodeGen::ProgHeader((PLOT_WIDTH * PLOT_HEIGHT)/BLOCK_DIM, mod_);
 
     // compute result of expression for all pixel values
-	xyExpr->Accept(this);
+    NumberValues(xyExpr);
+	EvalExpr(xyExpr);
 
-    int oldZReg = ctx_->ToRegCast(ctx_->exprOut, stream_);
+    int oldZReg = ctx_->ToRegCast(ctx_->exprOut, mod_);
 	
-	int oldXReg = ctx_->XIntoReg(stream_);
-	int oldYReg = ctx_->YIntoReg(stream_);
+    // x and y are likely still in registers from the expression
+    ctx_->HoldReg(oldZReg);
+	int oldXReg = ctx_->XIntoReg(mod_);
+    ctx_->HoldReg(oldXReg);
+	int oldYReg = ctx_->YIntoReg(mod_);
+    ctx_->ReleaseReg(oldZReg);
+    ctx_->ReleaseReg(oldXReg);
+    ctx_->ForgetValues({oldXReg, oldYReg, oldZReg});
+    valueNames_.clear();
 
 
 	int maxReg = ctx_->AllocReg();
 	int minReg = ctx_->AllocReg();
 
-	ctx_->DoubleIntoReg(maxReg, X_MAX, stream_);
-	ctx_->DoubleIntoReg(minReg, X_MIN, stream_);
-	ctx_->ASMOp("fslt", oldXReg, maxReg, stream_);
+	ctx_->DoubleIntoReg(maxReg, X_MAX, mod_);
+	ctx_->DoubleIntoReg(minReg, X_MIN, mod_);
+	ctx_->ASMOp(ir::Op::FSLT, oldXReg, maxReg, mod_);
 	ctx_->predMode = true; // execute rest only if predicate bit is set
-	ctx_->ASMOp("fslt", minReg, oldXReg, stream_);
+	ctx_->ASMOp(ir::Op::FSLT, minReg, oldXReg, mod_);
 
-	ctx_->ASMOp("fslt", oldYReg, maxReg, stream_);
-	ctx_->ASMOp("fslt", minReg, oldYReg, stream_);
+	ctx_->ASMOp(ir::Op::FSLT, oldYReg, maxReg, mod_);
+	ctx_->ASMOp(ir::Op::FSLT, minReg, oldYReg, mod_);
 
-	ctx_->ASMOp("fslt", oldZReg, maxReg, stream_);
-	ctx_->ASMOp("fslt", minReg, oldZReg, stream_);
+	ctx_->ASMOp(ir::Op::FSLT, oldZReg, maxReg, mod_);
+	ctx_->ASMOp(ir::Op::FSLT, minReg, oldZReg, mod_);
 
 	ctx_->FreeReg({maxReg, minReg});
     auto [newXReg, newYReg, newZReg] = ctx_->RotateRegs(oldXReg, oldYReg, oldZReg,
-            angleX, angleY, angleZ, stream_);
+            angleX, angleY, angleZ, mod_);
 
     ctx_->FreeReg({oldXReg, oldYReg, oldZReg});
 // 	ctx_->SetAxes(oldXReg, oldYReg, oldZReg,
-// 			angleX, angleY, angleZ, stream_);
+// 			angleX, angleY, angleZ, mod_);
 
-	ctx_->ChangeRegScale(newZReg, Z_MIN, Z_MAX, 0.0, 1.0, stream_);
+	ctx_->ChangeRegScale(newZReg, Z_MIN, Z_MAX, 0.0, 1.0, mod_);
     int addrReg = ctx_->AllocReg();
 	// this will also bring newXReg and newYReg in the range
 	// of 0 to PLOT_WIDTH/PLOT_HEIGHT
-	ctx_->FloatCoordsToAddrReg(addrReg, newXReg, newYReg, stream_);
+	ctx_->FloatCoordsToAddrReg(addrReg, newXReg, newYReg, mod_);
 
-	ctx_->StoreColour(newZReg, addrReg, stream_);
+	ctx_->StoreColour(newZReg, addrReg, mod_);
 
 	ctx_->FreeReg({addrReg, newXReg, newYReg, newZReg});
-	stream_ << "exit" << std::endl;
+	mod_.Append(ir::Make(ir::Op::EXIT, {}));
 	ctx_->Reset();
 
     if (ctx_->singleOut) {
@@ -206,33 +902,43 @@ void ASMGenVisitor::VisitPlotXY(double angleX, double angleY, double angleZ,
     }
 
 	// PROGRAM for white margin at top
-    ctx_->TopBottomWhiteMargin(stream_);
+    ctx_->TopBottomWhiteMargin(mod_);
 
 	// PROGRAM for white margin on side with function content in middle
-    ctx_->DisplayMem(stream_);
+    ctx_->DisplayMem(mod_);
 
 	// PROGRAM for white margin at bottom
-    ctx_->TopBottomWhiteMargin(stream_);
+    ctx_->TopBottomWhiteMargin(mod_);
 
 	//int addrReg = ctx_->AllocReg();
 	// this will also bring newXReg and newYReg in the range
 	// of 0 to PLOT_WIDTH/PLOT_HEIGHT
-	//ctx_->FloatCoordsToAddrReg(addrReg, newXReg, newYReg, stream_);
+	//ctx_->FloatCoordsToAddrReg(addrReg, newXReg, newYReg, mod_);
 
-	//ctx_->StoreColour(newZReg, addrReg, stream_);
-	//ctx_->StoreColour(oldZReg, addrReg, stream_);
+	//ctx_->StoreColour(newZReg, addrReg, mod_);
+	//ctx_->StoreColour(oldZReg, addrReg, mod_);
 
 // 	ctx_->FreeReg({addrReg, newXReg, newYReg, newZReg});
 }
 
-void ASMGenVisitor::VisitPlotXYSimple(double min, double max, std::shared_ptr<ASTNode> xyExpr)
+void ASMGenVisitor::VisitPlotXYSimple(double min, double max, ASTNodeRef xyExpr)
 {
+    if (cache_ != nullptr) {
+        Fnv1a hash;
+        hash.Add(std::string_view {"simple_plotxy"}).Add(min).Add(max)
+            .Add(xyExpr.Tree().Hash(xyExpr.Id()));
+        EmitCached(hash, "", [&](ASMGenVisitor &v) {
+            v.VisitPlotXYSimple(min, max, xyExpr);
+        });
+        return;
+    }
+
 	// PROGRAM to fill with rotated values
-	CodeGen::ProgHeader(SCREEN_HEIGHT * NUM_THREADS, stream_);
+	CodeGen::ProgHeader(SCREEN_HEIGHT * NUM_THREADS, mod_);
 	for (int i = 0;
 		i < ((SCREEN_WIDTH - 1024)/2) / (NUM_THREADS * BLOCK_DIM);
 		i++) {
-		stream_ << "disp zero\n";
+		mod_.Append(ir::Make(ir::Op::DISP, {ir::ZERO}));
 	}
 
 	int colReg = ctx_->AllocReg();
@@ -240,108 +946,117 @@ void ASMGenVisitor::VisitPlotXYSimple(double min, double max, std::shared_ptr<AS
 
 	// col = (blockIdx % NUM_THREADS) * BLOCK_DIM + threadIdx + i * NUM_THREADS * BLOCK_DIM
 	// note that NUM_THREADS has to be a power of 2
-	ctx_->ASMImmOp("andi", colReg, "%blockIdx", NUM_THREADS-1, stream_);
-	ctx_->ASMImmOp("slli", colReg, colReg,
+	ctx_->ASMImmOp(ir::Op::ANDI, colReg, ir::BLOCK_IDX, NUM_THREADS-1, mod_);
+	ctx_->ASMImmOp(ir::Op::SLLI, colReg, colReg,
 		static_cast<int>(std::log2(static_cast<double>(BLOCK_DIM))),
-		stream_);
-	ctx_->ASMOp("add", colReg, colReg, "%threadIdx", stream_);
+		mod_);
+	ctx_->ASMOp(ir::Op::ADD, colReg, colReg, ir::THREAD_IDX, mod_);
 
 	// row = blockIdx / NUM_THREADS (integer division)
 	// addr = row * PLOT_WIDTH + col
-	ctx_->ASMImmOp("srli", rowReg, "%blockIdx",
+	ctx_->ASMImmOp(ir::Op::SRLI, rowReg, ir::BLOCK_IDX,
 		static_cast<int>(std::log2(static_cast<double>(NUM_THREADS))),
-		stream_);
-    ctx_->ASMImmOp("subi", rowReg, rowReg, 720, stream_);
-    ctx_->ASMOp("sub", rowReg, 0, rowReg, stream_);
-    ctx_->ASMOp("cvtif", rowReg, rowReg, stream_);
-    ctx_->ChangeRegScale(rowReg, 0.0, 720.0, Y_MIN*720.0/1024.0, Y_MAX*720.0/1024.0, stream_);
-
+		mod_);
+    ctx_->ASMImmOp(ir::Op::SUBI, rowReg, rowReg, 720, mod_);
+    ctx_->ASMOp(ir::Op::SUB, rowReg, ir::ZERO, rowReg, mod_);
+    ctx_->ASMOp(ir::Op::CVTIF, rowReg, rowReg, mod_);
+    ctx_->ChangeRegScale(rowReg, 0.0, 720.0, Y_MIN*720.0/1024.0, Y_MAX*720.0/1024.0, mod_);
+
+    ctx_->varMap["y"] = rowReg;
+    NumberValues(xyExpr);
+    HoistInvariants(xyExpr);
     for (int i = 0; i < 1024 / (NUM_THREADS * BLOCK_DIM); i++) {
         int tmpReg = ctx_->AllocReg();
-        ctx_->ASMImmOp("addi", tmpReg, colReg,
-                i * NUM_THREADS * BLOCK_DIM, stream_);
-        ctx_->ASMOp("cvtif", tmpReg, tmpReg, stream_);
-        ctx_->ChangeRegScale(tmpReg, 0.0, 1024.0, X_MIN, X_MAX, stream_);
-        ctx_->varMap["y"] = rowReg;
+        ctx_->ASMImmOp(ir::Op::ADDI, tmpReg, colReg,
+                i * NUM_THREADS * BLOCK_DIM, mod_);
+        ctx_->ASMOp(ir::Op::CVTIF, tmpReg, tmpReg, mod_);
+        ctx_->ChangeRegScale(tmpReg, 0.0, 1024.0, X_MIN, X_MAX, mod_);
         ctx_->varMap["x"] = tmpReg;
         // compute result of expression for all pixel values
-        xyExpr->Accept(this);
-        int zReg = ctx_->ToRegCast(ctx_->exprOut, stream_);
-        ctx_->ChangeRegScale(zReg, min, max, 0.0, 1.0, stream_);
-        stream_ << "cvtfc r" << zReg << ", r" << zReg << std::endl;
-        stream_ << "disp r" << zReg << std::endl;
+        EvalExpr(xyExpr);
+        int zReg = ctx_->ToRegCast(ctx_->exprOut, mod_);
+        // values depend on x which changes with the next column
+        ctx_->ForgetValues({zReg});
+        // x is bound anew for every column but y and hoisted values are not
+        if (zReg != tmpReg) {
+            zReg = ctx_->ToOwnedReg(zReg, mod_);
+        }
+        ctx_->ChangeRegScale(zReg, min, max, 0.0, 1.0, mod_);
+        ctx_->ASMOp(ir::Op::CVTFC, zReg, zReg, mod_);
+        mod_.Append(ir::Make(ir::Op::DISP, {zReg}));
         ctx_->varMap.erase("x");
         ctx_->FreeReg({zReg, tmpReg});
     }
     ctx_->FreeReg({rowReg, colReg});
+    valueNames_.clear();
 
 	for (int i = 0;
 		i < ((SCREEN_WIDTH - 1024)/2) / (NUM_THREADS * BLOCK_DIM);
 		i++) {
-		stream_ << "disp zero\n";
+		mod_.Append(ir::Make(ir::Op::DISP, {ir::ZERO}));
 	}
 
-    stream_ << "exit\n";
+    mod_.Append(ir::Make(ir::Op::EXIT, {}));
 	ctx_->Reset();
 }
 
-void ASMGenVisitor::VisitPlotX(std::shared_ptr<ASTNode> xExpr)
+void ASMGenVisitor::VisitPlotX(ASTNodeRef xExpr)
 {
     return;
 }
 
-// void ASMGenVisitor::VisitPlotX(std::shared_ptr<ASTNode> xExpr)
+// void ASMGenVisitor::VisitPlotX(ASTNodeRef xExpr)
 // {
 // 	// PROGRAM to fill with rotated values
-// 	CodeGen::ProgHeader((PLOT_WIDTH * PLOT_HEIGHT)/BLOCK_DIM, stream_);
+// 	CodeGen::ProgHeader((PLOT_WIDTH * PLOT_HEIGHT)/BLOCK_DIM, mod_);
 // 
 //     // compute result of expression for all pixel values
-// 	xExpr->Accept(this);
+// 	xExpr.Accept(this);
 // 
 // 	int yValReg = ctx_->exprOutReg; // target output reg
 // 	
 // 
-//     int addrReg = ctx_->IndexIntoReg(stream_);
+//     int addrReg = ctx_->IndexIntoReg(mod_);
 //     int tmpReg = ctx_->AllocReg();	
 //     int errMarginReg = ctx_->AllocReg();
 // 
 //     // y axis: x = 0
-// 	int xReg = ctx_->XIntoReg(stream_);
-// 	ctx_->DoubleIntoReg(errMarginReg, EQUALITY_ERROR_MARGIN, stream_);
-// 	ctx_->ASMOp("fabs", tmpReg, xReg, stream_); 
+// 	int xReg = ctx_->XIntoReg(mod_);
+// 	ctx_->DoubleIntoReg(errMarginReg, EQUALITY_ERROR_MARGIN, mod_);
+// 	ctx_->ASMOp(ir::Op::FABS, tmpReg, xReg, mod_); 
 // 	// use EQUALITY_ERROR_MARGIN because it is not multiplied by anything
-// 	ctx_->ASMOp("fslt", tmpReg, errMarginReg, stream_); 
+// 	ctx_->ASMOp(ir::Op::FSLT, tmpReg, errMarginReg, mod_); 
 // 	ctx_->predMode = true;
 // 
-//     ctx_->ASMImmOp("addi", tmpReg, "zero", 0, stream_);
-// 	ctx_->ASMOp("spix", tmpReg, addrReg, stream_);
+//     ctx_->ASMImmOp(ir::Op::ADDI, tmpReg, ir::ZERO, 0, mod_);
+// 	ctx_->ASMOp(ir::Op::SPIX, tmpReg, addrReg, mod_);
 // 
 //     ctx_->predMode = false;
 //     ctx_->FreeReg(xReg);
 // 
 //     // x axis: y = 0
-//     int yReg = ctx_->YIntoReg(stream_);
-// 	ctx_->ASMOp("fabs", tmpReg, yReg, stream_); 
+//     int yReg = ctx_->YIntoReg(mod_);
+// 	ctx_->ASMOp(ir::Op::FABS, tmpReg, yReg, mod_); 
 // 	// use EQUALITY_ERROR_MARGIN because it is not multiplied by anything
-// 	ctx_->ASMOp("fslt", tmpReg, errMarginReg, stream_); 
+// 	ctx_->ASMOp(ir::Op::FSLT, tmpReg, errMarginReg, mod_); 
 // 	ctx_->predMode = true;
 // 
-//     ctx_->ASMImmOp("addi", tmpReg, "zero", 0, stream_);
-// 	ctx_->ASMOp("spix", tmpReg, addrReg, stream_);
+//     ctx_->ASMImmOp(ir::Op::ADDI, tmpReg, ir::ZERO, 0, mod_);
+// 	ctx_->ASMOp(ir::Op::SPIX, tmpReg, addrReg, mod_);
 // 
 //     ctx_->predMode = false;
 // 
 // 
 //     // set output color if yReg == yValReg
-//     ctx_->ASMOp("fsub", tmpReg, yReg, yValReg, stream_);
-// 	ctx_->ASMOp("fabs", tmpReg, tmpReg, stream_); 
+//     ctx_->ASMOp(ir::Op::FSUB, tmpReg, yReg, yValReg, mod_);
+// 	ctx_->ASMOp(ir::Op::FABS, tmpReg, tmpReg, mod_); 
 // 	// use EQUALITY_ERROR_MARGIN because it is not multiplied by anything
-// 	ctx_->ASMOp("fslt", tmpReg, errMarginReg, stream_); 
+// 	ctx_->ASMOp(ir::Op::FSLT, tmpReg, errMarginReg, mod_); 
 // 	ctx_->predMode = true;
 // 
 //     // choose 200 as arbitrary colour index in middle
-//     ctx_->ASMImmOp("addi", tmpReg, "zero", 200, stream_);
-// 	ctx_->ASMOp("spix", tmpReg, addrReg, stream_);
+//     ctx_->ASMImmOp(ir::Op::ADDI, tmpReg, ir::ZERO, 200, mod_);
+// 	ctx_->ASMOp(ir::Op::SPIX, tmpReg, addrReg, mod_);
 // 
 //     ctx_->predMode = false;
 // 
@@ -351,32 +1066,38 @@ void ASMGenVisitor::VisitPlotX(std::shared_ptr<ASTNode> xExpr)
 // 
 // 
 // 	// PROGRAM for white margin at top
-//     ctx_->TopBottomWhiteMargin(stream_);
+//     ctx_->TopBottomWhiteMargin(mod_);
 // 
 // 	// PROGRAM for white margin on side with function content in middle
-//     ctx_->DisplayMem(stream_);
+//     ctx_->DisplayMem(mod_);
 // 
 // 	// PROGRAM for white margin at bottom
-//     ctx_->TopBottomWhiteMargin(stream_);
+//     ctx_->TopBottomWhiteMargin(mod_);
 // }
 
 void ASMGenVisitor::VisitBinExpr
 (
 	CodeGen::BinaryOp opType,
-	std::shared_ptr<ASTNode> op1,
-	std::shared_ptr<ASTNode> op2
+	ASTNodeRef op1,
+	ASTNodeRef op2
 )
 {
-    op1->Accept(this);
+    EvalExpr(op1);
     CodeGen::ExprOut out1 = ctx_->exprOut;
-    
-    op2->Accept(this);
+    // a reused value has to stay in its register until the operation is
+    // emitted
+    ctx_->HoldReg(out1);
+
+    EvalExpr(op2);
     CodeGen::ExprOut out2 = ctx_->exprOut;
+    ctx_->HoldReg(out2);
 
 
     if (out1.t == CodeGen::OutType::mem || out2.t == CodeGen::OutType::mem) {
-        CodeGen::Arr arr1 = ctx_->ToArrCast(out1, stream_);
-        CodeGen::Arr arr2 = ctx_->ToArrCast(out2, stream_);
+        CodeGen::Arr arr1 = ctx_->ToArrCast(out1, mod_);
+        CodeGen::Arr arr2 = ctx_->ToArrCast(out2, mod_);
+        ctx_->ReleaseReg(out1);
+        ctx_->ReleaseReg(out2);
             
         if (opType == CodeGen::BinaryOp::DOT) {
             if (arr1.shape.size() != 2 || arr2.shape.size() != 2) {
@@ -410,110 +1131,10 @@ void ASMGenVisitor::VisitBinExpr
                 .addr = newAddr,
                 .shape = {arr1.shape[0], arr2.shape[1]},
             };
-            std::cerr << "addr: " << newAddr << " " << arrOut.shape[0] << "x"
-                      << arrOut.shape[1] << std::endl;
-
-            // initialise output with 0s
-            CodeGen::ProgHeader((dimSizes1[0] * dimSizes2[1] * 2) / BLOCK_DIM, stream_);
-
-            int addrReg = ctx_->IndexIntoReg(stream_, 1);
-            ctx_->ASMImmOp("addi", addrReg, addrReg, arrOut.addr, stream_);
-            stream_ << "sw zero, r" << addrReg << "\n";
-            stream_ << "exit\n";
-            ctx_->Reset();
-
-            CodeGen::ProgHeader(totalSize1 * NUM_THREADS, stream_);
-            int addr1Reg = ctx_->AllocReg();
-            int col1Reg = ctx_->AllocReg();
-            int row1Reg = ctx_->AllocReg();
-            // TODO make enum for registers to make this an ASMOp, too
-            //
-            // 8 elements of data are within 16 memory elements
-            // hence every 8 rows add 16
-            // addr = blockIdx + threadIdx + (blockIdx//BLOCK_DIM)*16
-            // TODO OPTIM make different program for every column to avoid data
-            // dependency
-            int tmpBlockIdxReg = ctx_->AllocReg();
-            ctx_->ASMImmOp("srli", tmpBlockIdxReg, "%blockIdx",
-                static_cast<int>(std::log2(static_cast<double>(NUM_THREADS))),
-                stream_);
-            ctx_->ASMImmOp("srli", row1Reg, tmpBlockIdxReg,
-                static_cast<int>(std::log2(static_cast<double>(dimSizes1[1]))),
-                stream_);
-            ctx_->ASMImmOp("slli", addr1Reg, row1Reg,
-                static_cast<int>(std::log2(static_cast<double>(dimSizes1[1]*2))),
-                stream_);
-            
-            // row2 = col1
-            ctx_->ASMImmOp("andi", col1Reg, tmpBlockIdxReg, dimSizes1[1]-1, stream_); 
-            ctx_->FreeReg(tmpBlockIdxReg);
-
-            ctx_->ASMOp("add", addr1Reg, addr1Reg, col1Reg, stream_);
-            ctx_->ASMOp("add", addr1Reg, addr1Reg, "%threadIdx", stream_);
-            ctx_->ASMImmOp("addi", addr1Reg, addr1Reg, arr1.addr, stream_);
-            
+            LOG(DEBUG, *ctx_->log << "addr: " << newAddr << " " << arrOut.shape[0]
+                    << "x" << arrOut.shape[1] << std::endl);
 
-            int outValReg = ctx_->AllocReg();
-            int val1Reg = ctx_->AllocReg();
-            int val2Reg = ctx_->AllocReg();
-
-            stream_ << "# row1Reg: " << row1Reg << "\n";
-            stream_ << "# col1Reg: " << col1Reg << "\n";
-            stream_ << "# outValReg: " << outValReg << "\n";
-            stream_ << "# val1Reg: " << val1Reg << "\n";
-            stream_ << "# val2Reg: " << val2Reg << "\n";
-
-            ctx_->LoadReg(val1Reg, addr1Reg, stream_); // needs tmp register
-
-            // output address = row1 * arr2.shape[1]*2 + col2
-            ctx_->FreeReg(addr1Reg);
-            // TODO check if padded dim or non-padded dim required for loop limit
-            for (int i = 0; i < arr2.shape[1]; i++) {
-                int outAddrReg = ctx_->AllocReg();
-                stream_ << "# outAddrReg: " << outAddrReg << "\n";
-                ctx_->ASMImmOp("slli", outAddrReg, row1Reg,
-                    static_cast<int>(std::log2(static_cast<double>(dimSizes2[1]*2))),
-                    stream_);
-                // col2Reg = i
-                ctx_->ASMImmOp("addi", outAddrReg, outAddrReg, i, stream_);
-                ctx_->ASMOp("add", outAddrReg, outAddrReg, "%threadIdx", stream_);
-                ctx_->ASMImmOp("addi", outAddrReg, outAddrReg, arrOut.addr, stream_);
-
-                ctx_->LoadReg(outValReg, outAddrReg, stream_);
-                
-                int addr2Reg = ctx_->AllocReg();
-                stream_ << "# addr2Reg: " << addr2Reg << "\n";
-                // row2 = col1, col2 = i
-                ctx_->ASMImmOp("slli", addr2Reg, col1Reg,
-                    static_cast<int>(std::log2(static_cast<double>(dimSizes2[1]*2))),
-                    stream_);
-                ctx_->ASMImmOp("addi", addr2Reg, addr2Reg, i, stream_);
-                ctx_->ASMOp("add", addr2Reg, addr2Reg, "%threadIdx", stream_);
-                ctx_->ASMImmOp("addi", addr2Reg, addr2Reg, arr2.addr, stream_);
-                ctx_->LoadReg(val2Reg, addr2Reg, stream_);
-                ctx_->FreeReg(addr2Reg);
-                
-                ctx_->ASMOp("fmul", val1Reg, val1Reg, val2Reg, stream_);
-                ctx_->ASMOp("fadd", outValReg, outValReg, val1Reg, stream_);
-
-
-                // only perform this for 1 lane
-                // threadIdx addition to addr is necessary, though, to make accesses
-                // of lanes contiguous
-                stream_ << "seqi %threadIdx, 0\n";
-
-                ctx_->predMode = true;
-                ctx_->StoreReg(outValReg, outAddrReg, stream_);
-                ctx_->predMode = false;
-                ctx_->FreeReg(outAddrReg);
-            }
-            ctx_->FreeReg(outValReg);
-            ctx_->FreeReg(col1Reg);
-            ctx_->FreeReg({val1Reg, val2Reg});
-            ctx_->FreeReg(row1Reg);
-
-            stream_ << "exit\n";
-            ctx_->Reset();
+            EmitDot(arr1, arr2, arrOut);
 
             ctx_->exprOut = {
                 .t = CodeGen::OutType::mem,
@@ -527,7 +1148,7 @@ void ASMGenVisitor::VisitBinExpr
 
             CodeGen::Arr tmpArr;
             if (arr2.size != arr1.size) {
-                std::cerr << "only supported for same size arrays" << std::endl;
+                LOG(WARN, *ctx_->log << "only supported for same size arrays" << std::endl);
             }
            
             // shapes: (m x n) dot (n x p) => (m x p)
@@ -544,24 +1165,24 @@ void ASMGenVisitor::VisitBinExpr
                 .shape = arr1.shape,
             };
 
-            CodeGen::ProgHeader(totalSize1/BLOCK_DIM, stream_);
-            int addr2Reg = ctx_->IndexIntoReg(stream_, 2);
+            CodeGen::ProgHeader(totalSize1/BLOCK_DIM, mod_);
+            int addr2Reg = ctx_->IndexIntoReg(mod_, 2);
             int addr1Reg = ctx_->AllocReg();
             int outAddrReg = ctx_->AllocReg();
-            ctx_->ASMImmOp("addi", outAddrReg, addr2Reg, arrOut.addr, stream_);
-            ctx_->ASMImmOp("addi", addr1Reg, addr2Reg, arr1.addr, stream_);
-            ctx_->ASMImmOp("addi", addr2Reg, addr2Reg, arr2.addr, stream_);
+            ctx_->ASMImmOp(ir::Op::ADDI, outAddrReg, addr2Reg, arrOut.addr, mod_);
+            ctx_->ASMImmOp(ir::Op::ADDI, addr1Reg, addr2Reg, arr1.addr, mod_);
+            ctx_->ASMImmOp(ir::Op::ADDI, addr2Reg, addr2Reg, arr2.addr, mod_);
             
             int val1Reg = ctx_->AllocReg();
-            ctx_->LoadReg(val1Reg, addr1Reg, stream_);
+            ctx_->LoadReg(val1Reg, addr1Reg, mod_);
             int val2Reg = ctx_->AllocReg();
-            ctx_->LoadReg(val2Reg, addr2Reg, stream_);
+            ctx_->LoadReg(val2Reg, addr2Reg, mod_);
 
-            ctx_->EmitBinExpr(opType, val2Reg, val1Reg, val2Reg, stream_);
-            ctx_->StoreReg(val2Reg, outAddrReg, stream_);
+            ctx_->EmitBinExpr(opType, val2Reg, val1Reg, val2Reg, mod_);
+            ctx_->StoreReg(val2Reg, outAddrReg, mod_);
 
             ctx_->Reset();
-            stream_ << "exit\n";
+            mod_.Append(ir::Make(ir::Op::EXIT, {}));
 
             ctx_->exprOut = {
                 .t = CodeGen::OutType::mem,
@@ -572,27 +1193,28 @@ void ASMGenVisitor::VisitBinExpr
         // none of them is an array
         int op1Reg, op2Reg;
         if (out1.t != CodeGen::OutType::reg) {
-            op1Reg = ctx_->ToRegCast(out1, stream_);
+            op1Reg = ctx_->ToRegCast(out1, mod_);
         } else {
             op1Reg = std::get<int>(out1.v);
         }
 
         if (out2.t != CodeGen::OutType::reg) {
-            op2Reg = ctx_->ToRegCast(out2, stream_);
+            op2Reg = ctx_->ToRegCast(out2, mod_);
         } else {
             op2Reg = std::get<int>(out2.v);
         }
 
+        ctx_->ReleaseReg(out1);
+        ctx_->ReleaseReg(out2);
         ctx_->FreeReg({op1Reg, op2Reg});
 
-
         int outReg = ctx_->AllocReg();
         ctx_->exprOut = {
             .t = CodeGen::OutType::reg,
             .v = outReg,
         };
-        ctx_->EmitBinExpr(opType, outReg, op1Reg, op2Reg, stream_);
-    } else if (out1.t == CodeGen::OutType::real || out1.t == CodeGen::OutType::real) {
+        ctx_->EmitBinExpr(opType, outReg, op1Reg, op2Reg, mod_);
+    } else if (out1.t == CodeGen::OutType::real || out2.t == CodeGen::OutType::real) {
         // no array or register operand but one is a real
         double op1, op2;
         if (out1.t != CodeGen::OutType::real) {
@@ -600,16 +1222,34 @@ void ASMGenVisitor::VisitBinExpr
         } else {
             op1 = std::get<double>(out1.v);
         }
-        if (out1.t != CodeGen::OutType::real) {
+        if (out2.t != CodeGen::OutType::real) {
             op2 = static_cast<double>(std::get<int>(out2.v));
         } else {
             op2 = std::get<double>(out2.v);
         }
 
-        ctx_->exprOut = {
-            .t = CodeGen::OutType::real,
-            .v = CodeGen::BinaryOpToDoubleFn(opType)(op1, op2),
-        };
+        // same result as the device computing it from registers
+        double val = CodeGen::BinaryOpToDoubleFn(opType)(
+                CodeGen::RoundTF18(op1), CodeGen::RoundTF18(op2));
+        if (std::isfinite(val)) {
+            ctx_->exprOut = {
+                .t = CodeGen::OutType::real,
+                .v = CodeGen::RoundTF18(val),
+            };
+        } else { // left to the device which has no infinity or NaN
+            int op1Reg = ctx_->AllocReg();
+            ctx_->DoubleIntoReg(op1Reg, op1, mod_);
+            int op2Reg = ctx_->AllocReg();
+            ctx_->DoubleIntoReg(op2Reg, op2, mod_);
+            ctx_->FreeReg({op1Reg, op2Reg});
+
+            int outReg = ctx_->AllocReg();
+            ctx_->exprOut = {
+                .t = CodeGen::OutType::reg,
+                .v = outReg,
+            };
+            ctx_->EmitBinExpr(opType, outReg, op1Reg, op2Reg, mod_);
+        }
     } else { // integers
         int op1 = std::get<int>(out1.v);
         int op2 = std::get<int>(out2.v);
@@ -620,13 +1260,155 @@ void ASMGenVisitor::VisitBinExpr
     }
 }
 
+/// Emits the programs computing the dot product of the 2D arrays arr1 and
+/// arr2 into arrOut. The output starts at init, an array of the shape of
+/// arrOut or a scalar, instead of 0 if it is given. If epilogue is given it
+/// is called with the register holding an element of the output after the
+/// last term was added and the register with its address, and returns the
+/// register with the value stored instead.
+void ASMGenVisitor::EmitDot(const CodeGen::Arr &arr1, const CodeGen::Arr &arr2,
+        const CodeGen::Arr &arrOut, const CodeGen::ExprOut *init,
+        const std::function<int(int, int)> &epilogue)
+{
+    std::vector<int> shape1 = arr1.shape;
+    std::vector<int> shape2 = arr2.shape;
+    auto [dimSizes1, totalSize1] = CodeGen::PaddedArrSize(shape1);
+    auto [dimSizes2, totalSize2] = CodeGen::PaddedArrSize(shape2);
+
+    if (init == nullptr) {
+        // initialise output with 0s
+        CodeGen::ProgHeader((dimSizes1[0] * dimSizes2[1] * 2) / BLOCK_DIM, mod_);
+
+        int addrReg = ctx_->IndexIntoReg(mod_, 1);
+        ctx_->ASMImmOp(ir::Op::ADDI, addrReg, addrReg, arrOut.addr, mod_);
+        mod_.Append(ir::Make(ir::Op::SW, {ir::ZERO, addrReg}));
+    } else {
+        CodeGen::ProgHeader((dimSizes1[0] * dimSizes2[1]) / BLOCK_DIM, mod_);
+
+        int idxReg = ctx_->IndexIntoReg(mod_, 2);
+        int valReg;
+        if (init->t == CodeGen::OutType::mem) {
+            int initAddrReg = ctx_->AllocReg();
+            valReg = ctx_->AllocReg();
+            ctx_->ASMImmOp(ir::Op::ADDI, initAddrReg, idxReg,
+                    std::get<CodeGen::Arr>(init->v).addr, mod_);
+            ctx_->LoadReg(valReg, initAddrReg, mod_);
+            ctx_->FreeReg(initAddrReg);
+        } else {
+            valReg = ctx_->ToRegCast(*init, mod_);
+        }
+        int outAddrReg = ctx_->AllocReg();
+        ctx_->ASMImmOp(ir::Op::ADDI, outAddrReg, idxReg, arrOut.addr, mod_);
+        ctx_->StoreReg(valReg, outAddrReg, mod_);
+    }
+    mod_.Append(ir::Make(ir::Op::EXIT, {}));
+    ctx_->Reset();
+
+    CodeGen::ProgHeader(totalSize1 * NUM_THREADS, mod_);
+    int addr1Reg = ctx_->AllocReg();
+    int col1Reg = ctx_->AllocReg();
+    int row1Reg = ctx_->AllocReg();
+    // TODO make enum for registers to make this an ASMOp, too
+    //
+    // 8 elements of data are within 16 memory elements
+    // hence every 8 rows add 16
+    // addr = blockIdx + threadIdx + (blockIdx//BLOCK_DIM)*16
+    // TODO OPTIM make different program for every column to avoid data
+    // dependency
+    int tmpBlockIdxReg = ctx_->AllocReg();
+    ctx_->ASMImmOp(ir::Op::SRLI, tmpBlockIdxReg, ir::BLOCK_IDX,
+        static_cast<int>(std::log2(static_cast<double>(NUM_THREADS))),
+        mod_);
+    ctx_->ASMImmOp(ir::Op::SRLI, row1Reg, tmpBlockIdxReg,
+        static_cast<int>(std::log2(static_cast<double>(dimSizes1[1]))),
+        mod_);
+    ctx_->ASMImmOp(ir::Op::SLLI, addr1Reg, row1Reg,
+        static_cast<int>(std::log2(static_cast<double>(dimSizes1[1]*2))),
+        mod_);
+    
+    // row2 = col1
+    ctx_->ASMImmOp(ir::Op::ANDI, col1Reg, tmpBlockIdxReg, dimSizes1[1]-1, mod_); 
+    ctx_->FreeReg(tmpBlockIdxReg);
+
+    ctx_->ASMOp(ir::Op::ADD, addr1Reg, addr1Reg, col1Reg, mod_);
+    ctx_->ASMOp(ir::Op::ADD, addr1Reg, addr1Reg, ir::THREAD_IDX, mod_);
+    ctx_->ASMImmOp(ir::Op::ADDI, addr1Reg, addr1Reg, arr1.addr, mod_);
+    
+
+    int outValReg = ctx_->AllocReg();
+    int val1Reg = ctx_->AllocReg();
+    int val2Reg = ctx_->AllocReg();
+
+    ctx_->LoadReg(val1Reg, addr1Reg, mod_); // needs tmp register
+
+    // output address = row1 * arr2.shape[1]*2 + col2
+    ctx_->FreeReg(addr1Reg);
+    // TODO check if padded dim or non-padded dim required for loop limit
+    for (int i = 0; i < arr2.shape[1]; i++) {
+        int outAddrReg = ctx_->AllocReg();
+        ctx_->ASMImmOp(ir::Op::SLLI, outAddrReg, row1Reg,
+            static_cast<int>(std::log2(static_cast<double>(dimSizes2[1]*2))),
+            mod_);
+        // col2Reg = i
+        ctx_->ASMImmOp(ir::Op::ADDI, outAddrReg, outAddrReg, i, mod_);
+        ctx_->ASMOp(ir::Op::ADD, outAddrReg, outAddrReg, ir::THREAD_IDX, mod_);
+        ctx_->ASMImmOp(ir::Op::ADDI, outAddrReg, outAddrReg, arrOut.addr, mod_);
+
+        ctx_->LoadReg(outValReg, outAddrReg, mod_);
+        
+        int addr2Reg = ctx_->AllocReg();
+        // row2 = col1, col2 = i
+        ctx_->ASMImmOp(ir::Op::SLLI, addr2Reg, col1Reg,
+            static_cast<int>(std::log2(static_cast<double>(dimSizes2[1]*2))),
+            mod_);
+        ctx_->ASMImmOp(ir::Op::ADDI, addr2Reg, addr2Reg, i, mod_);
+        ctx_->ASMOp(ir::Op::ADD, addr2Reg, addr2Reg, ir::THREAD_IDX, mod_);
+        ctx_->ASMImmOp(ir::Op::ADDI, addr2Reg, addr2Reg, arr2.addr, mod_);
+        ctx_->LoadReg(val2Reg, addr2Reg, mod_);
+        ctx_->FreeReg(addr2Reg);
+        
+        // val1Reg is read again for the next column
+        ctx_->ASMOp(ir::Op::FMUL, val2Reg, val1Reg, val2Reg, mod_);
+        ctx_->ASMOp(ir::Op::FADD, outValReg, outValReg, val2Reg, mod_);
+
+        if (epilogue) {
+            // only kept by the blocks of the last column of arr1, which add
+            // the last term
+            int finalReg = epilogue(outValReg, outAddrReg);
+            mod_.Append(ir::Make(ir::Op::SEQI, {col1Reg}, dimSizes1[1] - 1));
+            ctx_->predMode = true;
+            ctx_->ASMImmOp(ir::Op::ADDI, outValReg, finalReg, 0, mod_);
+            ctx_->predMode = false;
+            ctx_->FreeReg(finalReg);
+        }
+
+
+        // only perform this for 1 lane
+        // threadIdx addition to addr is necessary, though, to make accesses
+        // of lanes contiguous
+        mod_.Append(ir::Make(ir::Op::SEQI, {ir::THREAD_IDX}, 0));
+
+        ctx_->predMode = true;
+        ctx_->StoreReg(outValReg, outAddrReg, mod_);
+        ctx_->predMode = false;
+        ctx_->FreeReg(outAddrReg);
+    }
+    ctx_->FreeReg(outValReg);
+    ctx_->FreeReg(col1Reg);
+    ctx_->FreeReg({val1Reg, val2Reg});
+    ctx_->FreeReg(row1Reg);
+
+    mod_.Append(ir::Make(ir::Op::EXIT, {}));
+    ctx_->Reset();
+}
+
 void ASMGenVisitor::VisitUnaryExpr
 (
     CodeGen::UnaryOp opType,
-    std::shared_ptr<ASTNode> op
+    ASTNodeRef op
 )
 {
-    op->Accept(this);
+    EvalExpr(op);
 
     if (ctx_->exprOut.t == CodeGen::OutType::mem) {
 		CodeGen::Arr arr = std::get<CodeGen::Arr>(ctx_->exprOut.v);
@@ -647,35 +1429,35 @@ void ASMGenVisitor::VisitUnaryExpr
             arr.shape[1] = tmpDim;
 
 
-            CodeGen::ProgHeader(totalSize/BLOCK_DIM, stream_);
-            int addrReg = ctx_->IndexIntoReg(stream_);
+            CodeGen::ProgHeader(totalSize/BLOCK_DIM, mod_);
+            int addrReg = ctx_->IndexIntoReg(mod_);
             int valReg = ctx_->AllocReg();
             int rowReg = ctx_->AllocReg();
             int colReg = ctx_->AllocReg();
 
             // row = addr / dimSizes[1]
-            ctx_->ASMImmOp("srli", rowReg, addrReg,
+            ctx_->ASMImmOp(ir::Op::SRLI, rowReg, addrReg,
                 static_cast<int>(std::log2(static_cast<double>(dimSizes[1]))),
-                stream_);
+                mod_);
             // col = addr % dimSizes[1]
-            ctx_->ASMImmOp("andi", colReg, addrReg, dimSizes[1]-1, stream_);
+            ctx_->ASMImmOp(ir::Op::ANDI, colReg, addrReg, dimSizes[1]-1, mod_);
 
-            ctx_->ASMImmOp("slli", addrReg, rowReg,
+            ctx_->ASMImmOp(ir::Op::SLLI, addrReg, rowReg,
                 static_cast<int>(std::log2(static_cast<double>(dimSizes[1]*2))),
-                stream_);
-            ctx_->ASMOp("add", addrReg, addrReg, colReg, stream_);
-            ctx_->LoadReg(valReg, addrReg, stream_);
+                mod_);
+            ctx_->ASMOp(ir::Op::ADD, addrReg, addrReg, colReg, mod_);
+            ctx_->LoadReg(valReg, addrReg, mod_);
 
             // addr = col * dimSizes[1] + row
-            ctx_->ASMImmOp("slli", addrReg, colReg,
+            ctx_->ASMImmOp(ir::Op::SLLI, addrReg, colReg,
                 static_cast<int>(std::log2(static_cast<double>(dimSizes[1]*2))),
-                stream_);
-            ctx_->ASMOp("add", addrReg, addrReg, rowReg, stream_);
+                mod_);
+            ctx_->ASMOp(ir::Op::ADD, addrReg, addrReg, rowReg, mod_);
 
-            ctx_->ASMImmOp("addi", addrReg, addrReg, arr.addr, stream_);
-            ctx_->StoreReg(valReg, addrReg, stream_);
+            ctx_->ASMImmOp(ir::Op::ADDI, addrReg, addrReg, arr.addr, mod_);
+            ctx_->StoreReg(valReg, addrReg, mod_);
 
-            stream_ << "exit\n";
+            mod_.Append(ir::Make(ir::Op::EXIT, {}));
             ctx_->FreeReg(valReg);
             ctx_->Reset();
 
@@ -699,20 +1481,20 @@ void ASMGenVisitor::VisitUnaryExpr
                 .shape = arr.shape,
             };
 
-            CodeGen::ProgHeader(totalSize/BLOCK_DIM, stream_);
-            int addrReg = ctx_->IndexIntoReg(stream_, 2);
+            CodeGen::ProgHeader(totalSize/BLOCK_DIM, mod_);
+            int addrReg = ctx_->IndexIntoReg(mod_, 2);
             int outAddrReg = ctx_->AllocReg();
-            ctx_->ASMImmOp("addi", outAddrReg, addrReg, arrOut.addr, stream_);
-            ctx_->ASMImmOp("addi", addrReg, addrReg, arr.addr, stream_);
+            ctx_->ASMImmOp(ir::Op::ADDI, outAddrReg, addrReg, arrOut.addr, mod_);
+            ctx_->ASMImmOp(ir::Op::ADDI, addrReg, addrReg, arr.addr, mod_);
             
             int valReg = ctx_->AllocReg();
-            ctx_->LoadReg(valReg, addrReg, stream_);
+            ctx_->LoadReg(valReg, addrReg, mod_);
 
-            ctx_->EmitUnaryExpr(opType, valReg, valReg, stream_);
-            ctx_->StoreReg(valReg, outAddrReg, stream_);
+            ctx_->EmitUnaryExpr(opType, valReg, valReg, mod_);
+            ctx_->StoreReg(valReg, outAddrReg, mod_);
 
             ctx_->Reset();
-            stream_ << "exit\n";
+            mod_.Append(ir::Make(ir::Op::EXIT, {}));
 
             ctx_->exprOut = {
                 .t = CodeGen::OutType::mem,
@@ -724,9 +1506,17 @@ void ASMGenVisitor::VisitUnaryExpr
             std::cerr << "codegen error: transpose not supported for scalars" << std::endl;
             std::exit(1);
         }
+        if (ctx_->exprOut.t == CodeGen::OutType::real) {
+            double val = CodeGen::UnaryOpToDoubleFn(opType)(
+                    CodeGen::RoundTF18(std::get<double>(ctx_->exprOut.v)));
+            if (std::isfinite(val)) {
+                ctx_->exprOut.v = CodeGen::RoundTF18(val);
+                return;
+            }
+        }
         // exprOut
         // for every other apply to register or every element of array
-        int opReg = std::get<int>(ctx_->exprOut.v);
+        int opReg = ctx_->ToRegCast(ctx_->exprOut, mod_);
 
         ctx_->FreeReg(opReg);
 
@@ -735,28 +1525,116 @@ void ASMGenVisitor::VisitUnaryExpr
             .t = CodeGen::OutType::reg,
             .v = outReg,
         };
-        ctx_->EmitUnaryExpr(opType, outReg, opReg, stream_);
+        ctx_->EmitUnaryExpr(opType, outReg, opReg, mod_);
+    }
+}
+
+/// The base is evaluated once and raised by square-and-multiply. Arrays are
+/// raised elementwise in a single program.
+void ASMGenVisitor::VisitPow(ASTNodeRef base, int exp)
+{
+    EvalExpr(base);
+
+    switch (ctx_->exprOut.t) {
+    case CodeGen::OutType::mem: {
+        CodeGen::Arr arr = std::get<CodeGen::Arr>(ctx_->exprOut.v);
+        auto [dimSizes, totalSize] = CodeGen::PaddedArrSize(arr.shape);
+
+        int newAddr = ctx_->AllocMem(totalSize * 2);
+        if (!ctx_->IsArrAVariable(arr)) {
+            ctx_->FreeMem(arr.addr);
+        }
+        CodeGen::Arr arrOut = {
+            .size = arr.size,
+            .addr = newAddr,
+            .shape = arr.shape,
+        };
+
+        CodeGen::ProgHeader(totalSize/BLOCK_DIM, mod_);
+        int addrReg = ctx_->IndexIntoReg(mod_, 2);
+        int outAddrReg = ctx_->AllocReg();
+        ctx_->ASMImmOp(ir::Op::ADDI, outAddrReg, addrReg, arrOut.addr, mod_);
+        ctx_->ASMImmOp(ir::Op::ADDI, addrReg, addrReg, arr.addr, mod_);
+
+        int valReg = ctx_->AllocReg();
+        ctx_->LoadReg(valReg, addrReg, mod_);
+        ctx_->FreeReg(addrReg);
+
+        int outReg = ctx_->AllocReg();
+        ctx_->EmitPow(outReg, valReg, exp, mod_);
+        ctx_->StoreReg(outReg, outAddrReg, mod_);
+
+        ctx_->Reset();
+        mod_.Append(ir::Make(ir::Op::EXIT, {}));
+
+        ctx_->exprOut = {
+            .t = CodeGen::OutType::mem,
+            .v = arrOut,
+        };
+        break;
+    }
+    case CodeGen::OutType::reg: {
+        int baseReg = std::get<int>(ctx_->exprOut.v);
+        ctx_->HoldReg(baseReg);
+        int outReg = ctx_->AllocReg();
+        ctx_->ReleaseReg(baseReg);
+        ctx_->EmitPow(outReg, baseReg, exp, mod_);
+        ctx_->FreeReg(baseReg);
+        ctx_->exprOut = {
+            .t = CodeGen::OutType::reg,
+            .v = outReg,
+        };
+        break;
+    }
+    case CodeGen::OutType::real: {
+        double val = CodeGen::PowTF18(std::get<double>(ctx_->exprOut.v), exp);
+        if (std::isfinite(val)) {
+            ctx_->exprOut.v = val;
+            break;
+        }
+        // overflows are left to the device like for a register base
+        int baseReg = ctx_->ToRegCast(ctx_->exprOut, mod_);
+        int outReg = ctx_->AllocReg();
+        ctx_->EmitPow(outReg, baseReg, exp, mod_);
+        ctx_->FreeReg(baseReg);
+        ctx_->exprOut = {
+            .t = CodeGen::OutType::reg,
+            .v = outReg,
+        };
+        break;
+    }
+    case CodeGen::OutType::integer: {
+        int val = std::get<int>(ctx_->exprOut.v);
+        int result = val;
+        for (int i = 1; i < exp; i++) {
+            result = CodeGen::BinaryOpToIntFn(CodeGen::BinaryOp::MULT)(result, val);
+        }
+        ctx_->exprOut.v = result;
+        break;
+    }
     }
 }
 
 /// this may only be called inside a program
-void ASMGenVisitor::VisitVar(std::string var)
+void ASMGenVisitor::VisitVar(const std::string &var)
 {
     if (var == "x") {
-        int xReg = ctx_->XIntoReg(stream_);
+        int xReg = ctx_->XIntoReg(mod_);
         ctx_->exprOut = {
             .t = CodeGen::OutType::reg,
             .v = xReg,
         };
     } else if (var == "y") {
-        int yReg = ctx_->YIntoReg(stream_);
+        int yReg = ctx_->YIntoReg(mod_);
         ctx_->exprOut = {
             .t = CodeGen::OutType::reg,
             .v = yReg,
         };
     } else if (var == "xytup") {
-        int xReg = ctx_->XIntoReg(stream_);
-        int yReg = ctx_->YIntoReg(stream_);
+        int xReg = ctx_->XIntoReg(mod_);
+        ctx_->HoldReg(xReg);
+        int yReg = ctx_->YIntoReg(mod_);
+        ctx_->HoldReg(yReg);
         // create 2x1 array containing x and y
         int addr = ctx_->AllocMem(BLOCK_DIM * 4);
         CodeGen::Arr arr = {
@@ -765,10 +1643,12 @@ void ASMGenVisitor::VisitVar(std::string var)
             .shape = {2,1},
         };
         int addrReg = ctx_->AllocReg();
-        ctx_->ASMImmOp("lui", addrReg, "zero", addr, stream_);
-        ctx_->StoreReg(xReg, addrReg, stream_);
-        ctx_->ASMImmOp("addi", addrReg, addrReg, 1, stream_);
-        ctx_->StoreReg(yReg, addrReg, stream_);
+        ctx_->ASMImmOp(ir::Op::LUI, addrReg, addr, mod_);
+        ctx_->StoreReg(xReg, addrReg, mod_);
+        ctx_->ASMImmOp(ir::Op::ADDI, addrReg, addrReg, 1, mod_);
+        ctx_->StoreReg(yReg, addrReg, mod_);
+        ctx_->ReleaseReg(xReg);
+        ctx_->ReleaseReg(yReg);
         ctx_->exprOut = {
             .t = CodeGen::OutType::mem,
             .v = arr,
@@ -793,65 +1673,50 @@ void ASMGenVisitor::VisitConst(double val)
     };
 }
 
-void ASMGenVisitor::VisitArrayLiteral(std::vector<int> shape, std::vector<double> elements)
+void ASMGenVisitor::VisitArrayLiteral(std::span<const int> shape, std::span<const double> elements)
 {
     // TODO pad shape with 1s to make it 2d
-    int addrReg = ctx_->AllocReg();
     std::vector<int> newShape;
     if (shape.size() < 2) {
         newShape = {1, shape[0]};
     } else {
-        newShape = shape;
+        newShape.assign(shape.begin(), shape.end());
     }
-    auto [paddedDims, paddedSize] = CodeGen::PaddedArrSize(newShape);
-    CodeGen::ProgHeader(1, stream_);
+    std::vector<uint32_t> words = CodeGen::PackTF18(newShape,
+            [&elements](int i) { return elements[i]; });
+    EmitArrInit(newShape, words);
+}
+
+void ASMGenVisitor::VisitLoadedArray(const std::string &,
+        std::span<const int> shape, std::span<const uint32_t> words)
+{
+    std::vector<int> arrShape(shape.begin(), shape.end());
+    EmitArrInit(arrShape, words);
+}
+
+/// programs that allocate a new array and initialise it with words given in
+/// the padded layout of CodeGen::PackTF18, as many as it takes for each of
+/// them to fit into instruction memory
+void ASMGenVisitor::EmitArrInit(std::vector<int> &shape, std::span<const uint32_t> words)
+{
+    auto [paddedDims, paddedSize] = CodeGen::PaddedArrSize(shape);
     int addr = ctx_->AllocMem(paddedSize * 2);
-    ctx_->ConstIntoReg(addrReg, addr, stream_);
+    int first = 0;
+    do {
+        CodeGen::ProgHeader(1, mod_);
+        first = ctx_->StoreArrWords(addr, shape, words, first, mod_);
+        ctx_->Reset();
+        mod_.Append(ir::Make(ir::Op::EXIT, {}));
+    } while (first < paddedSize);
 
     CodeGen::Arr arr = {
-        .size = static_cast<int>(elements.size()),
+        .size = std::accumulate(shape.begin(), shape.end(), 1, std::multiplies<int>()),
         .addr = addr,
-        .shape = newShape,
+        .shape = shape,
     };
 
     ctx_->exprOut = {
         .t = CodeGen::OutType::mem,
         .v = arr,
     };
- 
-    // only execute this on one thread
-    ctx_->PredicateBackup(stream_);
-    stream_ << "seqi %threadIdx, 0\n";
-    ctx_->predMode = true;
-    int valReg = ctx_->AllocReg();
-    //int tmpReg = ctx_->AllocReg();
-    int stores = 0;
-    for (double el : elements) {
-        ctx_->DoubleIntoReg(valReg, el, stream_); 
-        ctx_->StoreReg(valReg, addrReg, stream_);
-        // this means addrReg will be incremented by 1 compared to what it
-        // was at the start of the loop
-        ctx_->ASMImmOp("addi", addrReg, addrReg, 1, stream_);
-        stores++;
-        if (stores % BLOCK_DIM == 0) {
-            ctx_->ASMImmOp("addi", addrReg, addrReg, BLOCK_DIM, stream_);
-        }
-        // pad every dimension with 0s to align it with BLOCK_DIM
-        if (stores == newShape[newShape.size()-1]) {
-//             if (stores % BLOCK_DIM != 0) {
-//                 ctx_->ASMImmOp("addi", tmpReg, "zero", 0, stream_);
-//                 for (int i = 0; i < BLOCK_DIM - stores % BLOCK_DIM; i++) {
-//                     ctx_->StoreReg(tmpReg, addrReg, stream_);
-//                     ctx_->ASMImmOp("addi", addrReg, addrReg, 1, stream_);
-//                 }
-//             }
-            ctx_->ASMImmOp("addi", addrReg, addrReg, BLOCK_DIM - stores % BLOCK_DIM, stream_);
-
-            ctx_->ASMImmOp("addi", addrReg, addrReg, BLOCK_DIM, stream_);
-            stores = 0;
-        }
-    }
-    ctx_->PredicateRestore(stream_);
-    ctx_->Reset();
-    stream_ << "exit\n";
 }
@@ -3,47 +3,42 @@
 #include <list>
 #include <functional>
 #include <array>
+#include <bit>
 #include <algorithm> // for std::find, std::copy
 #include <vector>
 #include <numeric> // for accumulate
+#include <cstring> // for memcpy
+#include <sstream>
+#include <map>
 
 #include "constants.hpp"
 #include "codegen.hpp"
-
-/// returns a new register from the list of available ones
-/// if none are available anymore it will look at the list of registers
-/// associated to variables and spill them (currently into nothingness because
-/// only x and y are used which are reloaded not from memory but through
-/// a certain computation contained in XIntoReg/YIntoReg)
+#include "log.hpp"
+
+/// returns a new virtual register which opt::AllocateRegisters maps onto
+/// the registers of the device later on
+/// once as many registers are in use as the device has, a value associated
+/// to a variable other than x and y is given up first to keep the allocator
+/// from spilling. It is generated again when needed through varMap (see
+/// XIntoReg/YIntoReg and ASMGenVisitor::EvalExpr), which is cheaper than
+/// storing and reloading it.
 int CodeGen::AllocReg()
 {
-    int reg;
-    if (freeRegs_.empty()) {
-        if (!varMap.empty()) {
-            reg = -1;
-            for (auto [k, v] : varMap) {
-                if (k != "x" && k != "y") {
-                    reg = v;
-                    std::erase(usedRegs_, reg);
-                    //std::cout << "from varmap: " << reg << std::endl;
-                    varMap.erase(k);
-                    break;
-                }
-            }
-            if (reg == -1) {
-                std::cerr << "register allocation: from varmap failed" << std::endl;
+    if (static_cast<int>(usedRegs_.size()) >= ir::NUM_GP_REGS) {
+        for (auto [k, v] : varMap) {
+            if (k != "x" && k != "y"
+                    && std::find(heldRegs_.begin(), heldRegs_.end(), v) == heldRegs_.end()) {
+                counters.spills++;
+                varMap.erase(k);
+                FreeReg(v);
+                break;
             }
-        } else {
-            std::cerr << "register allocation error" << std::endl;
-            return -1;
         }
-    } else {
-        reg = freeRegs_.back();
-        //std::cout << "normal: " << reg << std::endl;
-        freeRegs_.pop_back();
     }
+    int reg = nextReg_++;
     usedRegs_.push_back(reg);
-    std::cerr << "register alloc: " << reg << std::endl;
+    counters.peakRegs = std::max<int>(counters.peakRegs, usedRegs_.size());
+    LOG(DEBUG, *log << "register alloc: " << ir::RegName(reg) << std::endl);
     return reg;
 }
 
@@ -66,9 +61,8 @@ void CodeGen::FreeReg()
     if (doesMapContainVal(varMap, reg)) {
         return;
     }
-    std::cerr << "register free: " << reg << std::endl;
+    LOG(DEBUG, *log << "register free: " << ir::RegName(reg) << std::endl);
     usedRegs_.pop_back();
-    freeRegs_.push_back(reg);
 }
 
 /// free given register but not if it is now in the variable map
@@ -78,9 +72,8 @@ void CodeGen::FreeReg(int reg)
         return;
     }
     if (std::find(usedRegs_.begin(), usedRegs_.end(), reg) != usedRegs_.end()) {
-        std::cerr << "register free: " << reg << std::endl;
+        LOG(DEBUG, *log << "register free: " << ir::RegName(reg) << std::endl);
         std::erase(usedRegs_, reg);
-        freeRegs_.push_back(reg);
     }
 }
 
@@ -92,62 +85,120 @@ void CodeGen::FreeReg(std::initializer_list<int> regs)
             continue;
         }
         if (std::find(usedRegs_.begin(), usedRegs_.end(), reg) != usedRegs_.end()) {
-            std::cerr << "register free: " << reg << std::endl;
+            LOG(DEBUG, *log << "register free: " << ir::RegName(reg) << std::endl);
             std::erase(usedRegs_, reg);
-            freeRegs_.push_back(reg);
         }
     }
 }
 
-std::string CodeGen::FormatOp(std::string op)
+/// appends instr to the current program, predicated if in predicate mode
+void CodeGen::Emit(ir::Instr instr, ir::Module &mod)
 {
-    if (predMode) {
-        return op + ".p";
-    } else {
-        return op;
-    }
+    instr.pred = predMode;
+    mod.Append(instr);
 }
 
-void CodeGen::PredicateBackup(std::ostream &stream)
+void CodeGen::PredicateBackup(ir::Module &mod)
 {
     predBackupReg = AllocReg();
     predModeBackup = predMode;
     predMode = false;
-    ASMImmOp("addi", predBackupReg, "zero", 2, stream);
-    ASMImmOp("addi.p", predBackupReg, "zero", 0, stream);
+    ASMImmOp(ir::Op::ADDI, predBackupReg, ir::ZERO, 2, mod);
+    predMode = true;
+    ASMImmOp(ir::Op::ADDI, predBackupReg, ir::ZERO, 0, mod);
     predMode = predModeBackup;
 }
 
-void CodeGen::PredicateRestore(std::ostream &stream)
+void CodeGen::PredicateRestore(ir::Module &mod)
 {
     FreeReg(predBackupReg);
     predMode = predModeBackup;
     predMode = false;
-    ASMImmOp("slti", predBackupReg, 1, stream);
+    ASMImmOp(ir::Op::SLTI, predBackupReg, 1, mod);
     predMode = predModeBackup;
 }
 
+void CodeGen::HoldReg(int reg)
+{
+    heldRegs_.push_back(reg);
+}
+
+void CodeGen::HoldReg(const ExprOut &out)
+{
+    if (out.t == OutType::reg) {
+        HoldReg(std::get<int>(out.v));
+    }
+}
+
+void CodeGen::ReleaseReg(int reg)
+{
+    auto it = std::find(heldRegs_.begin(), heldRegs_.end(), reg);
+    if (it != heldRegs_.end()) {
+        heldRegs_.erase(it);
+    }
+}
+
+void CodeGen::ReleaseReg(const ExprOut &out)
+{
+    if (out.t == OutType::reg) {
+        ReleaseReg(std::get<int>(out.v));
+    }
+}
+
+void CodeGen::ForgetValues(std::initializer_list<int> keep)
+{
+    std::vector<int> regs;
+    std::erase_if(varMap, [&regs](const auto &entry) {
+        const auto &[name, reg] = entry;
+        if (name == "x" || name == "y" || name == IDX_VAR_NAME
+                || name.starts_with(INVARIANT_PREFIX)) {
+            return false;
+        }
+        regs.push_back(reg);
+        return true;
+    });
+    for (int reg : regs) {
+        if (std::find(keep.begin(), keep.end(), reg) == keep.end()) {
+            FreeReg(reg);
+        }
+    }
+}
+
+int CodeGen::ToOwnedReg(int reg, ir::Module &mod)
+{
+    if (!doesMapContainVal(varMap, reg)) {
+        return reg;
+    }
+    int copyReg = AllocReg();
+    ASMImmOp(ir::Op::ADDI, copyReg, reg, 0, mod);
+    return copyReg;
+}
+
 void CodeGen::Reset()
 {
-    freeRegs_.sort();
-    usedRegs_.sort();
-    freeRegs_.merge(usedRegs_); // will leave usedRegs_ empty
-    freeRegs_.reverse(); // want highest register first
+    // registers are numbered per program
+    usedRegs_.clear();
+    nextReg_ = ir::VREG_BASE;
     varMap.clear();
+    heldRegs_.clear();
     predMode = false;
 }
 
-void CodeGen::ProgHeader(int noBlocks, std::ostream &stream)
+void CodeGen::ProgHeader(int noBlocks, ir::Module &mod)
 {
-    stream << "<" << noBlocks << "," << BLOCK_DIM << ">" << std::endl;
+    mod.BeginProgram(noBlocks);
 }
 
 uint32_t CodeGen::DoubleToTF18Int(double x)
 {
     //std::cerr << "double is " << x << std::endl;
-	float f = static_cast<float>(x);
-    uint32_t* bits = reinterpret_cast<uint32_t*>(&f);
-    uint32_t rawBits = *bits;
+    return FloatToTF18Int(static_cast<float>(x));
+}
+
+uint32_t CodeGen::FloatToTF18Int(float f)
+{
+    uint32_t rawBits;
+    std::memcpy(&rawBits, &f, sizeof(rawBits));
     uint32_t input_sign = (rawBits >> 31) & 0x1;
     uint32_t input_exp = (rawBits >> 23) & 0xFF;
     uint32_t input_mantissa = rawBits & 0x7FFFFF;
@@ -181,127 +232,119 @@ uint32_t CodeGen::DoubleToTF18Int(double x)
     return output_rawBits;
 }
 
-void CodeGen::ConstIntoReg(int reg, uint32_t val, std::ostream &stream)
+double CodeGen::TF18IntToDouble(uint32_t x)
 {
-    stream << FormatOp("lui") + " r" << reg << ", " << val << std::endl;
+    uint32_t sign = (x >> 17) & 0x1;
+    int exp = (x >> 10) & 0x7F;
+    uint32_t mantissa = x & 0x3FF;
+    if (exp == 0 && mantissa == 0) {
+        return 0.0;
+    }
+    double val = std::ldexp(1.0 + mantissa / 1024.0, exp - 63);
+    return sign ? -val : val;
 }
 
-void CodeGen::DoubleIntoReg(int reg, double val, std::ostream &stream)
+double CodeGen::RoundTF18(double x)
 {
-    stream << FormatOp("lui") + " r" << reg << ", 0x"
-           << std::hex << CodeGen::DoubleToTF18Int(val) << std::dec << std::endl;
+    return TF18IntToDouble(DoubleToTF18Int(x));
 }
 
-/// for operations with one register operand
-void CodeGen::ASMOp(std::string op, int target, int src, std::ostream &stream)
+double CodeGen::PowTF18(double val, int exp)
 {
-    stream << FormatOp(op) << " r" << target << ", r" << src << std::endl;
+    double base = RoundTF18(val);
+    double acc = base;
+    for (int bit = std::bit_width(static_cast<unsigned>(exp)) - 2; bit >= 0; bit--) {
+        acc *= acc;
+        if (exp >> bit & 1 && std::isfinite(acc)) {
+            acc = RoundTF18(acc) * base;
+        }
+        if (!std::isfinite(acc)) {
+            return acc;
+        }
+        acc = RoundTF18(acc);
+    }
+    return acc;
 }
 
-void CodeGen::ASMOp
-(
-	std::string op, int valReg, std::string addrReg, std::ostream &stream
-)
+void CodeGen::ConstIntoReg(int reg, uint32_t val, ir::Module &mod)
 {
-    stream << FormatOp(op) << " r" << valReg << ", " << addrReg << std::endl;
+    Emit(ir::Make(ir::Op::LUI, {reg}, val), mod);
 }
 
-/// for operations with two register operands
-void CodeGen::ASMOp
-(
-	std::string op, int target, int srcA, int srcB, std::ostream &stream
-)
+void CodeGen::DoubleIntoReg(int reg, double val, ir::Module &mod)
 {
-    stream << FormatOp(op) << " r" << target << ", r" << srcA << ", r" << srcB << std::endl;
+    TF18IntoReg(reg, CodeGen::DoubleToTF18Int(val), mod);
 }
 
-/// for operations with two register operands
-void CodeGen::ASMOp
-(
-	std::string op, int target, std::string srcA, std::string srcB, std::ostream &stream
-)
+void CodeGen::TF18IntoReg(int reg, uint32_t val, ir::Module &mod)
 {
-    stream << FormatOp(op) << " r" << target << ", " << srcA << ", " << srcB << std::endl;
+    ir::Instr instr = ir::Make(ir::Op::LUI, {reg}, val);
+    instr.tf18 = true;
+    Emit(instr, mod);
 }
 
 /// for operations with two register operands
-void CodeGen::ASMOp
-(
-	std::string op, int target, int srcA, std::string srcB, std::ostream &stream
-)
+void CodeGen::ASMOp(ir::Op op, int target, int src, ir::Module &mod)
 {
-    stream << FormatOp(op) << " r" << target << ", r" << srcA << ", " << srcB << std::endl;
+    Emit(ir::Make(op, {target, src}), mod);
 }
 
-/// for operations with immediate integer values
-void CodeGen::ASMImmOp
-(
-    std::string op, int src, int x, std::ostream &stream
-)
+/// for operations with three register operands
+void CodeGen::ASMOp(ir::Op op, int target, int srcA, int srcB, ir::Module &mod)
 {
-    stream << FormatOp(op) << " r" << src << ", " << x << std::endl;
+    Emit(ir::Make(op, {target, srcA, srcB}), mod);
 }
 
-/// for operations with immediate integer values
-void CodeGen::ASMImmOp
-(
-    std::string op, int target, int src, int x, std::ostream &stream
-)
+/// for operations with one register operand and an immediate integer value
+void CodeGen::ASMImmOp(ir::Op op, int src, int x, ir::Module &mod)
 {
-    stream << FormatOp(op) << " r" << target << ", r" << src << ", " << x << std::endl;
+    Emit(ir::Make(op, {src}, x), mod);
 }
 
 /// for operations with immediate integer values
-void CodeGen::ASMImmOp
-(
-    std::string op, int target, std::string src, int x, std::ostream &stream
-)
+void CodeGen::ASMImmOp(ir::Op op, int target, int src, int x, ir::Module &mod)
 {
-    stream << FormatOp(op) << " r" << target << ", " << src << ", " << x << std::endl;
+    Emit(ir::Make(op, {target, src}, x), mod);
 }
 
-
 /// for operations with immediate real values
-void CodeGen::ASMImmOp
-(
-    std::string op, int target, int src, double x, std::ostream &stream
-)
+void CodeGen::ASMImmOp(ir::Op op, int target, int src, double x, ir::Module &mod)
 {
     int immReg = AllocReg();
     FreeReg(immReg);
-    DoubleIntoReg(immReg, x, stream);
-    stream << FormatOp(op) << " r" << target << ", r" << src << ", r" << immReg << std::endl;
+    DoubleIntoReg(immReg, x, mod);
+    ASMOp(op, target, src, immReg, mod);
 }
 
 void CodeGen::ChangeRegScale
 (
     int reg, double oldMin, double oldMax, double newMin, double newMax,
-	std::ostream &stream
+	ir::Module &mod
 )
 {
     if (oldMin != 0.0) {
-        ASMImmOp("fsub", reg, reg, oldMin, stream);
+        ASMImmOp(ir::Op::FSUB, reg, reg, oldMin, mod);
     }
 
     if ((newMax - newMin)/(oldMax - oldMin) != 0.0) {
-        ASMImmOp("fmul", reg, reg, (newMax - newMin)/(oldMax - oldMin), stream);
+        ASMImmOp(ir::Op::FMUL, reg, reg, (newMax - newMin)/(oldMax - oldMin), mod);
     }
     // add the min because it will be negative
     if (newMin != 0.0) {
-        ASMImmOp("fadd", reg, reg, newMin, stream);
+        ASMImmOp(ir::Op::FADD, reg, reg, newMin, mod);
     }
 }
 
-int CodeGen::IndexIntoReg(std::ostream &stream, int multiplier)
+int CodeGen::IndexIntoReg(ir::Module &mod, int multiplier)
 {
     int reg;
     if (varMap.find(IDX_VAR_NAME) == varMap.end()) {
         reg = AllocReg();
         
-        ASMImmOp("slli", reg, "%blockIdx",
+        ASMImmOp(ir::Op::SLLI, reg, ir::BLOCK_IDX,
                 static_cast<int>(std::log2(static_cast<double>(BLOCK_DIM * multiplier))),
-                stream);
-        ASMOp("add", reg, reg, "%threadIdx", stream);
+                mod);
+        ASMOp(ir::Op::ADD, reg, reg, ir::THREAD_IDX, mod);
 
         varMap[IDX_VAR_NAME] = reg;
     } else {
@@ -310,46 +353,51 @@ int CodeGen::IndexIntoReg(std::ostream &stream, int multiplier)
     return reg;
 }
 
-int CodeGen::XIntoReg(std::ostream &stream, double min, double max)
+int CodeGen::XIntoReg(ir::Module &mod, double min, double max)
 {
     int reg;
 	if (varMap.find("x") != varMap.end()) {
 		reg = varMap["x"];
+	} else if (varMap.find(X_VAR_NAME) != varMap.end()) {
+		reg = varMap[X_VAR_NAME];
 	} else {
         reg = AllocReg();
-        int idxReg = IndexIntoReg(stream);
+        int idxReg = IndexIntoReg(mod);
         // remainder of divide by PLOT_WIDTH to get column
-        ASMImmOp("andi", reg, idxReg, PLOT_WIDTH - 1, stream);
-        ASMOp("cvtif", reg, reg, stream);
-        ChangeRegScale(reg, min, max, X_MIN, X_MAX, stream);
-        //ASMImmOp("fadd", reg, reg, 0.5 * (X_MAX - X_MIN)/PLOT_WIDTH, stream);
-        //varMap["x"] = reg; 
+        ASMImmOp(ir::Op::ANDI, reg, idxReg, PLOT_WIDTH - 1, mod);
+        ASMOp(ir::Op::CVTIF, reg, reg, mod);
+        ChangeRegScale(reg, min, max, X_MIN, X_MAX, mod);
+        //ASMImmOp(ir::Op::FADD, reg, reg, 0.5 * (X_MAX - X_MIN)/PLOT_WIDTH, mod);
+        // kept until AllocReg needs the register and recomputed after that
+        varMap[X_VAR_NAME] = reg;
         FreeReg(idxReg);
 	}
     return reg;
 }
 
-int CodeGen::YIntoReg(std::ostream &stream, double min, double max)
+int CodeGen::YIntoReg(ir::Module &mod, double min, double max)
 {
     int reg;
 	if (varMap.find("y") != varMap.end()) {
 		reg = varMap["y"];
+	} else if (varMap.find(Y_VAR_NAME) != varMap.end()) {
+		reg = varMap[Y_VAR_NAME];
 	} else {
         reg = AllocReg();
-        int idxReg = IndexIntoReg(stream);
+        int idxReg = IndexIntoReg(mod);
         // divide by PLOT_WIDTH without remainder to get row
-        ASMImmOp("srli", reg, idxReg,
+        ASMImmOp(ir::Op::SRLI, reg, idxReg,
                 static_cast<int>(std::log2(static_cast<double>(PLOT_WIDTH))),
-                stream);
+                mod);
 
         // flip y to make bottom be the lowest value instead of top
-        ASMImmOp("subi", reg, reg, PLOT_HEIGHT, stream);
-        ASMOp("sub", reg, 0, reg, stream);
+        ASMImmOp(ir::Op::SUBI, reg, reg, PLOT_HEIGHT, mod);
+        ASMOp(ir::Op::SUB, reg, ir::ZERO, reg, mod);
 
-        ASMOp("cvtif", reg, reg, stream);
-        ChangeRegScale(reg, min, max, Y_MIN, Y_MAX, stream);
-        //ASMImmOp("fadd", reg, reg, 0.5 * (Y_MAX - Y_MIN)/PLOT_HEIGHT, stream);
-        //varMap["y"] = reg; 
+        ASMOp(ir::Op::CVTIF, reg, reg, mod);
+        ChangeRegScale(reg, min, max, Y_MIN, Y_MAX, mod);
+        //ASMImmOp(ir::Op::FADD, reg, reg, 0.5 * (Y_MAX - Y_MIN)/PLOT_HEIGHT, mod);
+        varMap[Y_VAR_NAME] = reg;
         FreeReg(idxReg);
 	}
     return reg;
@@ -364,7 +412,7 @@ std::tuple<int, int, int> CodeGen::RotateRegs
 (
             int oldXReg, int oldYReg, int oldZReg,
             double angleX, double angleY, double angleZ,
-            std::ostream &stream
+            ir::Module &mod
 )
 {
     double xSin = std::sin(angleX), ySin = std::sin(angleY), zSin = std::sin(angleZ);
@@ -374,45 +422,45 @@ std::tuple<int, int, int> CodeGen::RotateRegs
     int newXReg = AllocReg();
 
     // OPTIM check for 0 angles
-    ASMImmOp("fmul", newXReg, oldXReg, yCos * zCos, stream);
+    ASMImmOp(ir::Op::FMUL, newXReg, oldXReg, yCos * zCos, mod);
 
     if (xSin * ySin * zCos - xCos * zSin != 0.0) {
-        ASMImmOp("fmul", tmpReg, oldYReg, xSin * ySin * zCos - xCos * zSin, stream);
-        ASMOp("fadd", newXReg, newXReg, tmpReg, stream);
+        ASMImmOp(ir::Op::FMUL, tmpReg, oldYReg, xSin * ySin * zCos - xCos * zSin, mod);
+        ASMOp(ir::Op::FADD, newXReg, newXReg, tmpReg, mod);
     }
 
     if (xCos * ySin * zCos + xSin * zSin != 0.0) {
-        ASMImmOp("fmul", tmpReg, oldZReg, xCos * ySin * zCos + xSin * zSin, stream);
-        ASMOp("fadd", newXReg, newXReg, tmpReg, stream);
+        ASMImmOp(ir::Op::FMUL, tmpReg, oldZReg, xCos * ySin * zCos + xSin * zSin, mod);
+        ASMOp(ir::Op::FADD, newXReg, newXReg, tmpReg, mod);
     }
 
     int newYReg = AllocReg();
 
-    ASMImmOp("fmul", newYReg, oldXReg, yCos * zSin, stream);
+    ASMImmOp(ir::Op::FMUL, newYReg, oldXReg, yCos * zSin, mod);
 
     if (xSin * ySin * zSin + xCos * zCos != 0.0) {
-        ASMImmOp("fmul", tmpReg, oldYReg, xSin * ySin * zSin + xCos * zCos, stream);
-        ASMOp("fadd", newYReg, newYReg, tmpReg, stream);
+        ASMImmOp(ir::Op::FMUL, tmpReg, oldYReg, xSin * ySin * zSin + xCos * zCos, mod);
+        ASMOp(ir::Op::FADD, newYReg, newYReg, tmpReg, mod);
     }
 
     if (xCos * ySin * zSin - xSin * zCos != 0.0) {
-        ASMImmOp("fmul", tmpReg, oldZReg, xCos * ySin * zSin - xSin * zCos, stream);
-        ASMOp("fadd", newYReg, newYReg, tmpReg, stream);
+        ASMImmOp(ir::Op::FMUL, tmpReg, oldZReg, xCos * ySin * zSin - xSin * zCos, mod);
+        ASMOp(ir::Op::FADD, newYReg, newYReg, tmpReg, mod);
     }
 
 
     int newZReg = AllocReg();
 
-    ASMImmOp("fmul", newZReg, oldXReg, -ySin, stream);
+    ASMImmOp(ir::Op::FMUL, newZReg, oldXReg, -ySin, mod);
 
     if (xSin * yCos != 0.0) {
-        ASMImmOp("fmul", tmpReg, oldYReg, xSin * yCos, stream);
-        ASMOp("fadd", newZReg, newZReg, tmpReg, stream);
+        ASMImmOp(ir::Op::FMUL, tmpReg, oldYReg, xSin * yCos, mod);
+        ASMOp(ir::Op::FADD, newZReg, newZReg, tmpReg, mod);
     }
 
     if (xCos * yCos != 0.0) {
-        ASMImmOp("fmul", tmpReg, oldZReg, xCos * yCos, stream);
-        ASMOp("fadd", newZReg, newZReg, tmpReg, stream);
+        ASMImmOp(ir::Op::FMUL, tmpReg, oldZReg, xCos * yCos, mod);
+        ASMOp(ir::Op::FADD, newZReg, newZReg, tmpReg, mod);
     }
 
     FreeReg(tmpReg);
@@ -436,7 +484,7 @@ std::tuple<int, int, int> CodeGen::RotateRegs
 void CodeGen::SetAxes
 (
         int xReg, int yReg, int zReg, double angleX, double angleY, double angleZ,
-        std::ostream &stream
+        ir::Module &mod
 )
 {
     // store matrix by columns
@@ -464,7 +512,7 @@ void CodeGen::SetAxes
     }};
 
 
-    PredicateBackup(stream);
+    PredicateBackup(mod);
 
     predMode = false;
 
@@ -472,7 +520,7 @@ void CodeGen::SetAxes
     int xLambdaReg = AllocReg();
     int yLambdaReg = AllocReg();
     int newZReg = AllocReg();
-    ASMImmOp("addi", newZReg, zReg, 0, stream);
+    ASMImmOp(ir::Op::ADDI, newZReg, zReg, 0, mod);
 
 
     for (auto col : rotMatTranspose) {
@@ -484,8 +532,8 @@ void CodeGen::SetAxes
             if (EQUALITY_ERROR_MARGIN / std::fabs(col[0]) > errMargin) {
                 errMargin = EQUALITY_ERROR_MARGIN / std::fabs(col[0]);
             }
-            DoubleIntoReg(xLambdaReg, col[0], stream);
-            ASMOp("fdiv", xLambdaReg, xReg, xLambdaReg, stream);
+            DoubleIntoReg(xLambdaReg, col[0], mod);
+            ASMOp(ir::Op::FDIV, xLambdaReg, xReg, xLambdaReg, mod);
         } else {
             xZero = true;
         }
@@ -493,17 +541,17 @@ void CodeGen::SetAxes
             if (EQUALITY_ERROR_MARGIN / std::fabs(col[1]) > errMargin) {
                 errMargin = EQUALITY_ERROR_MARGIN / std::fabs(col[1]);
             }
-            DoubleIntoReg(yLambdaReg, col[1], stream);
-            ASMOp("fdiv", yLambdaReg, yReg, yLambdaReg, stream);
+            DoubleIntoReg(yLambdaReg, col[1], mod);
+            ASMOp(ir::Op::FDIV, yLambdaReg, yReg, yLambdaReg, mod);
         } else {
             yZero = true;
         }
         
         if (xZero) {
             // check if xReg = 0
-            ASMOp("fabs", tmpReg, xReg, stream); 
-            DoubleIntoReg(xLambdaReg, errMargin, stream);
-            ASMOp("fslt", tmpReg, xLambdaReg, stream);
+            ASMOp(ir::Op::FABS, tmpReg, xReg, mod); 
+            DoubleIntoReg(xLambdaReg, errMargin, mod);
+            ASMOp(ir::Op::FSLT, tmpReg, xLambdaReg, mod);
             predMode = true;
             // lambda to use is yLambdaReg
             int backupReg = xLambdaReg;
@@ -514,20 +562,20 @@ void CodeGen::SetAxes
 
         if (yZero) {
             // check if yReg = 0
-            ASMOp("fabs", tmpReg, yReg, stream); 
+            ASMOp(ir::Op::FABS, tmpReg, yReg, mod); 
             // use EQUALITY_ERROR_MARGIN because it is not multiplied by anything
-            DoubleIntoReg(yLambdaReg, EQUALITY_ERROR_MARGIN, stream);
-            ASMOp("fslt", tmpReg, yLambdaReg, stream);
+            DoubleIntoReg(yLambdaReg, EQUALITY_ERROR_MARGIN, mod);
+            ASMOp(ir::Op::FSLT, tmpReg, yLambdaReg, mod);
             predMode = true;
         }
 
 
         if (!xZero && !yZero) {
             // check if their lambda coefficients match
-            ASMOp("fsub", tmpReg, xLambdaReg, yLambdaReg, stream); 
-            ASMOp("fabs", tmpReg, tmpReg, stream); 
-            DoubleIntoReg(yLambdaReg, errMargin, stream);
-            ASMOp("fslt", tmpReg, yLambdaReg, stream);
+            ASMOp(ir::Op::FSUB, tmpReg, xLambdaReg, yLambdaReg, mod); 
+            ASMOp(ir::Op::FABS, tmpReg, tmpReg, mod); 
+            DoubleIntoReg(yLambdaReg, errMargin, mod);
+            ASMOp(ir::Op::FSLT, tmpReg, yLambdaReg, mod);
             predMode = true;
         }
 
@@ -536,24 +584,24 @@ void CodeGen::SetAxes
         if (xZero && yZero) {
             // this will only happen if it also passed the checks that x=y=0
             // where passed because this operation is performed predicatedly
-            DoubleIntoReg(newZReg, Z_MIN, stream);
+            DoubleIntoReg(newZReg, Z_MIN, mod);
         } else {
             // load z value of axis into xLambdaReg
-            DoubleIntoReg(tmpReg, col[2], stream);
-            ASMOp("fmul", xLambdaReg, xLambdaReg, tmpReg, stream);
+            DoubleIntoReg(tmpReg, col[2], mod);
+            ASMOp(ir::Op::FMUL, xLambdaReg, xLambdaReg, tmpReg, mod);
             
-            DoubleIntoReg(tmpReg, EQUALITY_ERROR_MARGIN, stream);
-            ASMOp("fadd", xLambdaReg, xLambdaReg, tmpReg, stream);
-            ASMOp("fslt", zReg, xLambdaReg, stream);
+            DoubleIntoReg(tmpReg, EQUALITY_ERROR_MARGIN, mod);
+            ASMOp(ir::Op::FADD, xLambdaReg, xLambdaReg, tmpReg, mod);
+            ASMOp(ir::Op::FSLT, zReg, xLambdaReg, mod);
 
             predMode = true;
-            DoubleIntoReg(newZReg, Z_MIN, stream);
+            DoubleIntoReg(newZReg, Z_MIN, mod);
         }
     }
 
     predMode = false;
-    ASMImmOp("addi", zReg, newZReg, 0, stream);
-    PredicateRestore(stream);
+    ASMImmOp(ir::Op::ADDI, zReg, newZReg, 0, mod);
+    PredicateRestore(mod);
     FreeReg({tmpReg, xLambdaReg, newZReg});
 }
 
@@ -562,32 +610,32 @@ void CodeGen::SetAxes
 /// This is done by checking if valReg contains invalid value, i.e.
 /// minus infinity in TF18 representation, and if that is the case it takes
 /// first non-minus-infinity value of the three points to its left/top
-void CodeGen::Interpolate(int valReg, int addrReg, std::ostream &stream)
+void CodeGen::Interpolate(int valReg, int addrReg, ir::Module &mod)
 {
-    PredicateBackup(stream);
+    PredicateBackup(mod);
     //int illegalReg = AllocReg();
     // NOTE if tmpAddrReg introduces too much register pressure then just use
     // addrReg and add 512 at the end of this function to it to restore it
     // to its previous value
     int tmpAddrReg = AllocReg();
-    ASMOp("seq", valReg, "zero", stream);
-    ASMImmOp("subi", tmpAddrReg, addrReg, 1, stream);
+    ASMOp(ir::Op::SEQ, valReg, ir::ZERO, mod);
+    ASMImmOp(ir::Op::SUBI, tmpAddrReg, addrReg, 1, mod);
     predMode = true;
-    ASMOp("lw", valReg, tmpAddrReg, stream);
+    ASMOp(ir::Op::LW, valReg, tmpAddrReg, mod);
 
-    ASMOp("seq", valReg, "zero", stream);
+    ASMOp(ir::Op::SEQ, valReg, ir::ZERO, mod);
     predMode = false;
-    ASMImmOp("subi", tmpAddrReg, addrReg, PLOT_WIDTH, stream);
+    ASMImmOp(ir::Op::SUBI, tmpAddrReg, addrReg, PLOT_WIDTH, mod);
     predMode = true;
-    ASMOp("lw", valReg, tmpAddrReg, stream);
+    ASMOp(ir::Op::LW, valReg, tmpAddrReg, mod);
 
-    ASMOp("seq", valReg, "zero", stream);
+    ASMOp(ir::Op::SEQ, valReg, ir::ZERO, mod);
     predMode = false;
-    ASMImmOp("subi", tmpAddrReg, addrReg, PLOT_WIDTH + 1, stream);
+    ASMImmOp(ir::Op::SUBI, tmpAddrReg, addrReg, PLOT_WIDTH + 1, mod);
     predMode = true;
-    ASMOp("lw", valReg, tmpAddrReg, stream);
+    ASMOp(ir::Op::LW, valReg, tmpAddrReg, mod);
 
-    PredicateRestore(stream);
+    PredicateRestore(mod);
     FreeReg({tmpAddrReg});
 }
 
@@ -595,49 +643,49 @@ void CodeGen::Interpolate(int valReg, int addrReg, std::ostream &stream)
 /// converts values in xReg and yReg to integer address into 1D frame buffer
 /// array
 /// will modify xReg and yReg contents
-void CodeGen::FloatCoordsToAddrReg(int addrReg, int xReg, int yReg, std::ostream &stream,
+void CodeGen::FloatCoordsToAddrReg(int addrReg, int xReg, int yReg, ir::Module &mod,
         double min, double max)
 {
-	ChangeRegScale(xReg, X_MIN, X_MAX, min, max, stream);
-	ChangeRegScale(yReg, Y_MIN, Y_MAX, min, max, stream);
-
-    ASMOp("cvtfi", xReg, xReg, stream);
-    ASMOp("cvtfi", yReg, yReg, stream);
-    ASMImmOp("subi", yReg, yReg, PLOT_HEIGHT, stream);
-    ASMOp("sub", yReg, 0, yReg, stream);
-    ASMImmOp("slli", addrReg, yReg,
+	ChangeRegScale(xReg, X_MIN, X_MAX, min, max, mod);
+	ChangeRegScale(yReg, Y_MIN, Y_MAX, min, max, mod);
+
+    ASMOp(ir::Op::CVTFI, xReg, xReg, mod);
+    ASMOp(ir::Op::CVTFI, yReg, yReg, mod);
+    ASMImmOp(ir::Op::SUBI, yReg, yReg, PLOT_HEIGHT, mod);
+    ASMOp(ir::Op::SUB, yReg, ir::ZERO, yReg, mod);
+    ASMImmOp(ir::Op::SLLI, addrReg, yReg,
             static_cast<int>(std::log2(static_cast<double>(PLOT_WIDTH))),
-            stream);
-    ASMOp("add", addrReg, addrReg, xReg, stream);
+            mod);
+    ASMOp(ir::Op::ADD, addrReg, addrReg, xReg, mod);
 }
 
-void CodeGen::StoreColour(int valReg, int addrReg, std::ostream &stream)
+void CodeGen::StoreColour(int valReg, int addrReg, ir::Module &mod)
 {
-    ASMOp("cvtfc", valReg, valReg, stream);
-    ASMOp("spix", valReg, addrReg, stream);
+    ASMOp(ir::Op::CVTFC, valReg, valReg, mod);
+    ASMOp(ir::Op::SPIX, valReg, addrReg, mod);
 }
 
-void CodeGen::ResetMem(std::ostream &stream)
+void CodeGen::ResetMem(ir::Module &mod)
 {
-	CodeGen::ProgHeader((PLOT_WIDTH * PLOT_HEIGHT)/(BLOCK_DIM*(MAX_INSTR/4)), stream);
-	int addrReg = IndexIntoReg(stream);
+	CodeGen::ProgHeader((PLOT_WIDTH * PLOT_HEIGHT)/(BLOCK_DIM*(MAX_INSTR/4)), mod);
+	int addrReg = IndexIntoReg(mod);
     for (int i = 0; i < 64; i++) {
-	    ASMOp("sw", 0, addrReg, stream);
-        ASMImmOp("addi", addrReg, addrReg, BLOCK_DIM, stream);
+	    ASMOp(ir::Op::SW, ir::ZERO, addrReg, mod);
+        ASMImmOp(ir::Op::ADDI, addrReg, addrReg, BLOCK_DIM, mod);
 
     }
-	stream << "exit" << std::endl;
+	mod.Append(ir::Make(ir::Op::EXIT, {}));
 	Reset();
 }
 
-void CodeGen::DisplayMem(std::ostream &stream)
+void CodeGen::DisplayMem(ir::Module &mod)
 {
 	// note that this only works with BLOCK_DIM = 8
-	CodeGen::ProgHeader(PLOT_HEIGHT * NUM_THREADS, stream);
+	CodeGen::ProgHeader(PLOT_HEIGHT * NUM_THREADS, mod);
 	for (int i = 0;
 		i < ((SCREEN_WIDTH - PLOT_WIDTH)/2) / (NUM_THREADS * BLOCK_DIM);
 		i++) {
-		stream << "disp zero\n";
+		mod.Append(ir::Make(ir::Op::DISP, {ir::ZERO}));
 	}
 
 	int addrReg = AllocReg();
@@ -646,97 +694,150 @@ void CodeGen::DisplayMem(std::ostream &stream)
 
 	// col = (blockIdx % NUM_THREADS) * BLOCK_DIM + threadIdx + i * NUM_THREADS * BLOCK_DIM
 	// note that NUM_THREADS has to be a power of 2
-	ASMImmOp("andi", colReg, "%blockIdx", NUM_THREADS-1, stream);
-	ASMImmOp("slli", colReg, colReg,
+	ASMImmOp(ir::Op::ANDI, colReg, ir::BLOCK_IDX, NUM_THREADS-1, mod);
+	ASMImmOp(ir::Op::SLLI, colReg, colReg,
 		static_cast<int>(std::log2(static_cast<double>(BLOCK_DIM))),
-		stream);
-	ASMOp("add", colReg, colReg, "%threadIdx", stream);
+		mod);
+	ASMOp(ir::Op::ADD, colReg, colReg, ir::THREAD_IDX, mod);
 
 	// row = blockIdx / NUM_THREADS (integer division)
 	// addr = row * PLOT_WIDTH + col
-	ASMImmOp("srli", addrReg, "%blockIdx",
+	ASMImmOp(ir::Op::SRLI, addrReg, ir::BLOCK_IDX,
 		static_cast<int>(std::log2(static_cast<double>(NUM_THREADS))),
-		stream);
-	ASMImmOp("slli", addrReg, addrReg,
+		mod);
+	ASMImmOp(ir::Op::SLLI, addrReg, addrReg,
 		static_cast<int>(std::log2(static_cast<double>(PLOT_WIDTH))),
-		stream);
-	ASMOp("add", addrReg, addrReg, colReg, stream);
+		mod);
+	ASMOp(ir::Op::ADD, addrReg, addrReg, colReg, mod);
 
-	ASMOp("lw", valReg, addrReg, stream);
-	Interpolate(valReg, addrReg, stream);
-	stream << "disp r" << valReg << std::endl;
+	ASMOp(ir::Op::LW, valReg, addrReg, mod);
+	Interpolate(valReg, addrReg, mod);
+	mod.Append(ir::Make(ir::Op::DISP, {valReg}));
 
 	for (int i = 1; i < PLOT_WIDTH / (NUM_THREADS * BLOCK_DIM); i++) {
-		ASMImmOp("addi", addrReg, addrReg,
-				NUM_THREADS * BLOCK_DIM, stream);
+		ASMImmOp(ir::Op::ADDI, addrReg, addrReg,
+				NUM_THREADS * BLOCK_DIM, mod);
 
-		ASMOp("lw", valReg, addrReg, stream);
-		Interpolate(valReg, addrReg, stream);
-		stream << "disp r" << valReg << std::endl;
+		ASMOp(ir::Op::LW, valReg, addrReg, mod);
+		Interpolate(valReg, addrReg, mod);
+		mod.Append(ir::Make(ir::Op::DISP, {valReg}));
 	}
 	FreeReg({addrReg, colReg, valReg});
 
 	for (int i = 0;
 		i < ((SCREEN_WIDTH - PLOT_WIDTH)/2) / (NUM_THREADS * BLOCK_DIM);
 		i++) {
-		stream << "disp zero\n";
+		mod.Append(ir::Make(ir::Op::DISP, {ir::ZERO}));
 	}
 
-	stream << "exit" << std::endl;
+	mod.Append(ir::Make(ir::Op::EXIT, {}));
 	Reset();
 }
 
-void CodeGen::TopBottomWhiteMargin(std::ostream &stream)
+void CodeGen::TopBottomWhiteMargin(ir::Module &mod)
 {
 	CodeGen::ProgHeader(80,
-			stream);
+			mod);
 	for (int i = 0; i < 208; i++){ // 640
-	    stream << "disp r0" << std::endl;
+	    mod.Append(ir::Make(ir::Op::DISP, {ir::ZERO}));
     }
-	stream << "exit" << std::endl;
+	mod.Append(ir::Make(ir::Op::EXIT, {}));
 
 	Reset();
 
 }
 
-void CodeGen::StoreReg(int valReg, int addrReg, std::ostream &stream)
+void CodeGen::StoreReg(int valReg, int addrReg, ir::Module &mod)
 {
     int tmpReg = AllocReg();
     // TODO remove when switching to 18 bits
     // possible optimisation: if more registers available store shifted
     // copy of valReg in another reg to avoid shifting it left again in the end
-    //ASMImmOp("srli", valReg, valReg, 6, stream);
-	ASMImmOp("andi", tmpReg, valReg, (1<<9) - 1, stream);
-	ASMOp("sw", tmpReg, addrReg, stream);
-	ASMImmOp("srli", tmpReg, valReg, 9, stream);
-	ASMImmOp("addi", addrReg, addrReg, BLOCK_DIM, stream);
-	ASMOp("sw", tmpReg, addrReg, stream);
+    //ASMImmOp(ir::Op::SRLI, valReg, valReg, 6, mod);
+	ASMImmOp(ir::Op::ANDI, tmpReg, valReg, (1<<9) - 1, mod);
+	ASMOp(ir::Op::SW, tmpReg, addrReg, mod);
+	ASMImmOp(ir::Op::SRLI, tmpReg, valReg, 9, mod);
+	ASMImmOp(ir::Op::ADDI, addrReg, addrReg, BLOCK_DIM, mod);
+	ASMOp(ir::Op::SW, tmpReg, addrReg, mod);
     // restore addrReg and valReg
-	ASMImmOp("subi", addrReg, addrReg, BLOCK_DIM, stream);
-    //ASMImmOp("slli", valReg, valReg, 6, stream);
+	ASMImmOp(ir::Op::SUBI, addrReg, addrReg, BLOCK_DIM, mod);
+    //ASMImmOp(ir::Op::SLLI, valReg, valReg, 6, mod);
     FreeReg(tmpReg);
 }
 
-void CodeGen::LoadReg(int valReg, int addrReg, std::ostream &stream)
+void CodeGen::LoadReg(int valReg, int addrReg, ir::Module &mod)
 {
     int tmpReg = AllocReg();
     bool oldPredMode = predMode;
-	ASMOp("lw", valReg, addrReg, stream);
+	ASMOp(ir::Op::LW, valReg, addrReg, mod);
 
     predMode = false; // to make all read the same address
-	ASMImmOp("addi", tmpReg, addrReg, BLOCK_DIM, stream);
+	ASMImmOp(ir::Op::ADDI, tmpReg, addrReg, BLOCK_DIM, mod);
     predMode = oldPredMode;
 
-	ASMOp("lw", tmpReg, tmpReg, stream);
-	ASMImmOp("slli", tmpReg, tmpReg, 9, stream);
-	ASMOp("add", valReg, valReg, tmpReg, stream);
+	ASMOp(ir::Op::LW, tmpReg, tmpReg, mod);
+	ASMImmOp(ir::Op::SLLI, tmpReg, tmpReg, 9, mod);
+	ASMOp(ir::Op::ADD, valReg, valReg, tmpReg, mod);
 
     // TODO remove this as soon as everything is 18 bits
-    //ASMImmOp("slli", valReg, valReg, 6, stream);
+    //ASMImmOp(ir::Op::SLLI, valReg, valReg, 6, mod);
 
     FreeReg(tmpReg);
 }
 
+/// Store the words of an array given in the padded layout of PackTF18 to
+/// memory starting at addr, from word first on until the current program
+/// would not fit into instruction memory anymore. Only thread 0 performs the
+/// stores and padding words are skipped. Returns the index of the first word
+/// which is left to store or the padded size if all of them were stored.
+int CodeGen::StoreArrWords(int addr, std::vector<int> &shape,
+        std::span<const uint32_t> words, int first, ir::Module &mod)
+{
+    // address adjustment, value and StoreReg for every word
+    constexpr int WORD_INSTRS = 8;
+    // PredicateRestore and exit
+    constexpr int END_INSTRS = 2;
+
+    auto [paddedDims, paddedSize] = PaddedArrSize(shape);
+    int addrReg = AllocReg();
+    // 8 elements of data are within 16 memory elements (high halves in the
+    // second 8)
+    auto wordOffset = [](int k) { return (k / BLOCK_DIM) * 2 * BLOCK_DIM + k % BLOCK_DIM; };
+    int offset = wordOffset(first);
+    ConstIntoReg(addrReg, addr + offset, mod);
+
+    // only execute this on one thread
+    PredicateBackup(mod);
+    mod.Append(ir::Make(ir::Op::SEQI, {ir::THREAD_IDX}, 0));
+    predMode = true;
+    int valReg = AllocReg();
+    int k = first;
+    for (; k < paddedSize; k++) {
+        // skip padding: any index beyond the unpadded size of its dimension
+        bool padding = false;
+        for (int d = shape.size() - 1, rest = k; d >= 0; d--) {
+            padding |= rest % paddedDims[d] >= shape[d];
+            rest /= paddedDims[d];
+        }
+        if (padding) {
+            continue;
+        }
+        if (mod.programs.back().NumInstrs() + WORD_INSTRS + END_INSTRS > MAX_INSTR) {
+            break;
+        }
+        int kOffset = wordOffset(k);
+        if (kOffset != offset) {
+            ASMImmOp(ir::Op::ADDI, addrReg, addrReg, kOffset - offset, mod);
+            offset = kOffset;
+        }
+        TF18IntoReg(valReg, words[k], mod);
+        StoreReg(valReg, addrReg, mod);
+    }
+    PredicateRestore(mod);
+    FreeReg({valReg, addrReg});
+    return k;
+}
+
 int CodeGen::AllocMem(int size)
 {
     for (int i = 0; i < freeMem.size(); i++) {
@@ -749,7 +850,10 @@ int CodeGen::AllocMem(int size)
                 freeMem.erase(freeMem.begin() + i);
             }
             usedMem[addr] = size;
-            std::cerr << "allocating " << size << " elements @ " << addr << "\n";
+            memInUse_ += size;
+            counters.peakMem = std::max(counters.peakMem, memInUse_);
+            counters.peakFreeList = std::max<int>(counters.peakFreeList, freeMem.size());
+            LOG(DEBUG, *log << "allocating " << size << " elements @ " << addr << "\n");
             return addr;
         }
     }
@@ -759,70 +863,147 @@ int CodeGen::AllocMem(int size)
 
 void CodeGen::FreeMem(int addr)
 {
-    std::cerr << "freeing " << usedMem[addr] << " elements @ " << addr << std::endl;
+    LOG(DEBUG, *log << "freeing " << usedMem[addr] << " elements @ " << addr << std::endl);
     int size = usedMem[addr];
     usedMem.erase(addr);
+    memInUse_ -= size;
     bool added = false;
     for (int i = 0; i < freeMem.size(); i++) {
         auto [a, sz] = freeMem[i];
         if (addr + size == a) {
-            std::cerr << "merging with next entry" << std::endl;
+            LOG(DEBUG, *log << "merging with next entry" << std::endl);
             freeMem[i].second += size;
             freeMem[i].first = addr;
             added = true;
         } else if (addr + size < a) {
-            std::cerr << "inserting before next entry" << std::endl;
+            LOG(DEBUG, *log << "inserting before next entry" << std::endl);
             freeMem.insert(freeMem.begin() + i, {addr, size});
             added = true;
         }
         // check if it aligns with previous one
         if (i > 0 && freeMem[i-1].first + freeMem[i-1].second == addr) {
-            std::cerr << "merging with previous entry" << std::endl;
+            LOG(DEBUG, *log << "merging with previous entry" << std::endl);
             freeMem[i-1].second += freeMem[i].second;
             freeMem.erase(freeMem.begin() + i);
         }
         if (added) {
-            std::cerr << "Number of items in freeMem: " << freeMem.size() << std::endl;
+            LOG(DEBUG, *log << "Number of items in freeMem: " << freeMem.size() << std::endl);
             break;
         }
     }
 
+    counters.peakFreeList = std::max<int>(counters.peakFreeList, freeMem.size());
+    LOG(DEBUG,
+        for (auto [addr, size] : freeMem) {
+            *log << "@ " << addr << ": " << size << std::endl;
+        });
+}
+
+void CodeGen::Counters::Merge(const Counters &other)
+{
+    peakRegs = std::max(peakRegs, other.peakRegs);
+    peakMem = std::max(peakMem, other.peakMem);
+    peakFreeList = std::max(peakFreeList, other.peakFreeList);
+    spills += other.spills;
+    fusedPrograms += other.fusedPrograms;
+}
+
+std::string CodeGen::MemStateToStr() const
+{
+    // usedMem is unordered so sort it to get the same text for the same state
+    std::map<int, int> used(usedMem.begin(), usedMem.end());
+    std::ostringstream out;
+    out << used.size();
+    for (auto [addr, size] : used) {
+        out << " " << addr << " " << size;
+    }
+    out << " " << freeMem.size();
     for (auto [addr, size] : freeMem) {
-        std::cerr << "@ " << addr << ": " << size << std::endl;
+        out << " " << addr << " " << size;
+    }
+    return out.str();
+}
+
+void CodeGen::MemStateFromStr(const std::string &state)
+{
+    std::istringstream in {state};
+    std::size_t n;
+    usedMem.clear();
+    memInUse_ = 0;
+    in >> n;
+    for (std::size_t i = 0; i < n; i++) {
+        int addr, size;
+        in >> addr >> size;
+        usedMem[addr] = size;
+        memInUse_ += size;
+    }
+    counters.peakMem = std::max(counters.peakMem, memInUse_);
+    freeMem.clear();
+    in >> n;
+    for (std::size_t i = 0; i < n; i++) {
+        int addr, size;
+        in >> addr >> size;
+        freeMem.push_back({addr, size});
     }
 }
 
 void CodeGen::EmitBinExpr(CodeGen::BinaryOp opType, int targetReg,
-        int val1Reg, int val2Reg, std::ostream &stream)
+        int val1Reg, int val2Reg, ir::Module &mod)
 {
-	std::string operation = "f" + CodeGen::BinaryOpToStr(opType);
-	ASMOp(operation, targetReg, val1Reg, val2Reg, stream);
+	ASMOp(CodeGen::BinaryOpToFloatOp(opType), targetReg, val1Reg, val2Reg, mod);
 }
 
 void CodeGen::EmitUnaryExpr(CodeGen::UnaryOp opType, int targetReg,
-		int srcReg, std::ostream &stream)
+		int srcReg, ir::Module &mod)
 {
     bool oldPredMode = predMode;
     switch (opType) {
     case UnaryOp::MINUS:
-        ASMOp("fsub", targetReg, 0, srcReg, stream);
+        ASMOp(ir::Op::FSUB, targetReg, ir::ZERO, srcReg, mod);
         break;
     case UnaryOp::RELU:
-        ASMOp("fslt", targetReg, 0, stream);
+        if (targetReg != srcReg) {
+            ASMImmOp(ir::Op::ADDI, targetReg, srcReg, 0, mod);
+        }
+        ASMOp(ir::Op::FSLT, targetReg, ir::ZERO, mod);
         predMode = true;
-        ASMImmOp("lui", targetReg, 0, stream);
+        ASMImmOp(ir::Op::LUI, targetReg, 0, mod);
         predMode = oldPredMode;
         break;
     case UnaryOp::SIN:
+        ASMOp(ir::Op::CVTFR, targetReg, srcReg, mod);
+        ASMOp(ir::Op::FSIN, targetReg, targetReg, mod);
+        break;
     case UnaryOp::COS:
-        ASMOp("cvtfr", srcReg, srcReg, stream);
-    default:
-        std::string operation = "f" + CodeGen::UnaryOpToStr(opType);
-        ASMOp(operation, targetReg, srcReg, stream);
+        ASMOp(ir::Op::CVTFR, targetReg, srcReg, mod);
+        ASMOp(ir::Op::FCOS, targetReg, targetReg, mod);
+        break;
+    case UnaryOp::EXP:
+        ASMOp(ir::Op::FEXP, targetReg, srcReg, mod);
+        break;
+    case UnaryOp::SQRT:
+        ASMOp(ir::Op::FSQRT, targetReg, srcReg, mod);
+        break;
+    case UnaryOp::TRANSPOSE:
+        std::cerr << "CodeGen error: transpose has no scalar instruction" << std::endl;
+        std::exit(1);
+    }
+}
+
+void CodeGen::EmitPow(int targetReg, int baseReg, int exp, ir::Module &mod)
+{
+    // the leading bit of exp stands for the base itself
+    int accReg = baseReg;
+    for (int bit = std::bit_width(static_cast<unsigned>(exp)) - 2; bit >= 0; bit--) {
+        ASMOp(ir::Op::FMUL, targetReg, accReg, accReg, mod);
+        accReg = targetReg;
+        if (exp >> bit & 1) {
+            ASMOp(ir::Op::FMUL, targetReg, targetReg, baseReg, mod);
+        }
     }
 }
 
-int CodeGen::ToRegCast(ExprOut out, std::ostream &stream)
+int CodeGen::ToRegCast(ExprOut out, ir::Module &mod)
 {
 	int outReg;
     if (out.t == CodeGen::OutType::mem) {
@@ -833,15 +1014,15 @@ int CodeGen::ToRegCast(ExprOut out, std::ostream &stream)
         }
         outReg = AllocReg();
 
-        LoadReg(outReg, arr.addr, stream);
+        LoadReg(outReg, arr.addr, mod);
     } else if (out.t == CodeGen::OutType::reg) {
         outReg = std::get<int>(out.v); // target output reg
     } else if (out.t == CodeGen::OutType::real) {
         outReg = AllocReg();
-        DoubleIntoReg(outReg, std::get<double>(out.v), stream);
+        DoubleIntoReg(outReg, std::get<double>(out.v), mod);
     } else if (out.t == CodeGen::OutType::integer) {
         outReg = AllocReg();
-        ConstIntoReg(outReg, std::get<int>(out.v), stream);
+        ConstIntoReg(outReg, std::get<int>(out.v), mod);
     } else {
         std::cerr << "unrecognised output type: should never happen" << std::endl;
         std::exit(1);
@@ -850,12 +1031,12 @@ int CodeGen::ToRegCast(ExprOut out, std::ostream &stream)
 }
 
 // TODO fix this for all operand types
-CodeGen::Arr CodeGen::ToArrCast(ExprOut out, std::ostream &stream)
+CodeGen::Arr CodeGen::ToArrCast(ExprOut out, ir::Module &mod)
 {
     if (out.t == CodeGen::OutType::mem) {
         return std::get<CodeGen::Arr>(out.v);
     } else {
-        int valReg = ToRegCast(out, stream);
+        int valReg = ToRegCast(out, mod);
         int addr = AllocMem(BLOCK_DIM*4);
         CodeGen::Arr arrOut = {
             .size = 1,
@@ -863,9 +1044,9 @@ CodeGen::Arr CodeGen::ToArrCast(ExprOut out, std::ostream &stream)
             .shape = {1, 1},
         };
         int addrReg = AllocReg();
-        ASMImmOp("addi", addrReg, "zero", addr, stream);
+        ASMImmOp(ir::Op::ADDI, addrReg, ir::ZERO, addr, mod);
         // TODO maybe need "nop"s around this
-        StoreReg(valReg, addrReg, stream);
+        StoreReg(valReg, addrReg, mod);
         return arrOut;
     }
 }
@@ -882,6 +1063,22 @@ bool CodeGen::IsArrAVariable(Arr a)
     return false;
 }
 
+void CodeGen::Unbind(const std::string &var)
+{
+    auto it = varMemMap.find(var);
+    if (it == varMemMap.end()) {
+        return;
+    }
+    ExprOut out = it->second;
+    varMemMap.erase(it);
+    if (out.t == OutType::mem) {
+        Arr arr = std::get<Arr>(out.v);
+        if (usedMem.contains(arr.addr) && !IsArrAVariable(arr)) {
+            FreeMem(arr.addr);
+        }
+    }
+}
+
 
 std::tuple<std::vector<int>, int> CodeGen::PaddedArrSize(std::vector<int> &shape)
 {
@@ -900,6 +1097,27 @@ std::tuple<std::vector<int>, int> CodeGen::PaddedArrSize(std::vector<int> &shape
     return {dimSizes, out};
 }
 
+/// TF18 words of an array in the padded row-major layout of PaddedArrSize
+/// with 0 in the padding. element(i) returns the i-th element of the array
+/// in row-major order of shape.
+std::vector<uint32_t> CodeGen::PackTF18(std::vector<int> &shape,
+        const std::function<double(int)> &element)
+{
+    auto [paddedDims, paddedSize] = PaddedArrSize(shape);
+    int size = std::accumulate(shape.begin(), shape.end(), 1, std::multiplies<int>());
+    std::vector<uint32_t> words(paddedSize, 0);
+    for (int i = 0; i < size; i++) {
+        int k = 0;
+        for (int d = 0, rest = i, stride = size; d < static_cast<int>(shape.size()); d++) {
+            stride /= shape[d];
+            k = k * paddedDims[d] + rest / stride;
+            rest %= stride;
+        }
+        words[k] = DoubleToTF18Int(element(i));
+    }
+    return words;
+}
+
 std::string CodeGen::ShapeToStr(std::vector<int> &shape)
 {
     std::string out = "";
@@ -911,6 +1129,72 @@ std::string CodeGen::ShapeToStr(std::vector<int> &shape)
     return out;
 }
 
+std::string CodeGen::ExprOutToStr(const ExprOut &out)
+{
+    std::ostringstream str;
+    str << static_cast<int>(out.t);
+    switch (out.t) {
+    case OutType::reg:
+    case OutType::integer:
+        str << " " << std::get<int>(out.v);
+        break;
+    case OutType::real: {
+        // bit pattern so that the value survives the round trip exactly
+        double val = std::get<double>(out.v);
+        uint64_t bits;
+        std::memcpy(&bits, &val, sizeof(bits));
+        str << " " << bits;
+        break;
+    }
+    case OutType::mem: {
+        const Arr &arr = std::get<Arr>(out.v);
+        str << " " << arr.size << " " << arr.addr << " " << arr.shape.size();
+        for (int dim : arr.shape) {
+            str << " " << dim;
+        }
+        break;
+    }
+    }
+    return str.str();
+}
+
+CodeGen::ExprOut CodeGen::ExprOutFromStr(const std::string &str)
+{
+    std::istringstream in {str};
+    int t;
+    in >> t;
+    ExprOut out {.t = static_cast<OutType>(t), .v = -1};
+    switch (out.t) {
+    case OutType::reg:
+    case OutType::integer: {
+        int val;
+        in >> val;
+        out.v = val;
+        break;
+    }
+    case OutType::real: {
+        uint64_t bits;
+        double val;
+        in >> bits;
+        std::memcpy(&val, &bits, sizeof(val));
+        out.v = val;
+        break;
+    }
+    case OutType::mem: {
+        Arr arr;
+        std::size_t dims;
+        in >> arr.size >> arr.addr >> dims;
+        arr.shape.resize(dims);
+        for (int &dim : arr.shape) {
+            in >> dim;
+        }
+        out.v = arr;
+        break;
+    }
+    }
+    return out;
+}
+
 std::string CodeGen::UnaryOpToStr(CodeGen::UnaryOp op)
 {
     switch (op) {
@@ -968,6 +1252,48 @@ std::function<double(double,double)> CodeGen::BinaryOpToDoubleFn(BinaryOp op)
 }
 
 
+ir::Op CodeGen::BinaryOpToFloatOp(BinaryOp op)
+{
+    switch (op) {
+    case BinaryOp::PLUS:
+        return ir::Op::FADD;
+    case BinaryOp::MINUS:
+        return ir::Op::FSUB;
+    case BinaryOp::MULT:
+        return ir::Op::FMUL;
+    case BinaryOp::DIV:
+        return ir::Op::FDIV;
+    case BinaryOp::DOT:
+        std::cerr << "dot product not supported as scalar operation" << std::endl;
+        std::exit(1);
+    }
+    std::cerr << "unknown binary operator" << std::endl;
+    std::exit(1);
+}
+
+std::function<double(double)> CodeGen::UnaryOpToDoubleFn(UnaryOp op)
+{
+    switch (op) {
+    case UnaryOp::MINUS:
+        return [](double a) { return -a; };
+    case UnaryOp::SQRT:
+        return [](double a) { return std::sqrt(a); };
+    case UnaryOp::EXP:
+        return [](double a) { return std::exp(a); };
+    case UnaryOp::SIN:
+        return [](double a) { return std::sin(a); };
+    case UnaryOp::COS:
+        return [](double a) { return std::cos(a); };
+    case UnaryOp::RELU:
+        return [](double a) { return a < 0.0 ? 0.0 : a; };
+    case UnaryOp::TRANSPOSE:
+        std::cerr << "transpose not supported as scalar operation" << std::endl;
+        std::exit(1);
+    }
+    std::cerr << "unknown unary operator" << std::endl;
+    std::exit(1);
+}
+
 std::string CodeGen::BinaryOpToStr(CodeGen::BinaryOp op)
 {
     switch (op) {
@@ -0,0 +1,468 @@
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <string_view>
+#include <cerrno>
+#include <cstdio>
+#include <csignal>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <chrono>
+#include <atomic>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#include <algorithm>
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "ast.hpp"
+#include "codegen.hpp"
+#include "constants.hpp"
+#include "ir.hpp"
+#include "log.hpp"
+#include "parser.hpp"
+#include "stats.hpp"
+#include "driver.hpp"
+
+namespace driver {
+
+namespace {
+
+/// what leaving out a statement saves
+struct DeadCode {
+    int programs = 0;
+    /// words of data memory allocated at its peak
+    int memWords = 0;
+};
+
+/// Leaves out the assignment stmt, which no output depends on. It is still
+/// generated, from a copy of codeGen with the bindings of the assignments
+/// left out before in deadVars, into a module which is thrown away. So its
+/// errors are reported as before and what it would have cost is known.
+DeadCode DropAssignment(const AST &ast, NodeId stmt, CodeGen &codeGen,
+        std::unordered_map<std::string, CodeGen::ExprOut> &deadVars)
+{
+    std::ostringstream log;
+    auto scratch = std::make_shared<CodeGen>(codeGen);
+    scratch->log = &log;
+    scratch->counters = {};
+    for (const auto &[name, out] : deadVars) {
+        scratch->varMemMap[name] = out;
+    }
+    ir::Module code;
+    ASMGenVisitor visitor {scratch, code};
+    ast.Accept(stmt, &visitor);
+
+    DeadCode saved;
+    for (const ir::Program &prog : code.programs) {
+        saved.programs += prog.numBlocks != ir::Program::CONTINUATION;
+    }
+    saved.memWords = std::max(0, scratch->counters.peakMem - codeGen.MemInUse());
+    const std::string &var = ast.Name(ast.Node(stmt).a);
+    deadVars[var] = scratch->varMemMap[var];
+    codeGen.Unbind(var);
+    return saved;
+}
+
+} // namespace
+
+ir::Module Generate(std::istream &inStream, const Options &opts)
+{
+    using Clock = std::chrono::steady_clock;
+    CompileStats unused;
+    CompileStats &stats = opts.stats != nullptr ? *opts.stats : unused;
+    int cacheHits = opts.cache != nullptr ? opts.cache->hits.load() : 0;
+    int cacheMisses = opts.cache != nullptr ? opts.cache->misses.load() : 0;
+    int cacheEvictions = opts.cache != nullptr ? opts.cache->evictions.load() : 0;
+
+    // source is lexed straight from the input stream as the parser consumes it
+    auto start = Clock::now();
+    std::chrono::nanoseconds lexTime {0};
+    AST ast = parse::Parse(inStream, &lexTime);
+    ast.Simplify();
+    stats.lex += lexTime;
+    stats.parse += Clock::now() - start - lexTime;
+
+    if (opts.printAST) {
+        PrintVisitor *pvisitor = new PrintVisitor(std::cerr);
+        ast.Root().Accept(pvisitor);
+        delete pvisitor;
+    }
+
+    start = Clock::now();
+    std::shared_ptr<CodeGen> codeGen = std::make_shared<CodeGen>();
+    codeGen->singleOut = opts.singleOut;
+    ir::Module code;
+
+    if (!codeGen->singleOut) {
+        // PROGRAM to reset frame buffer to make it all 0
+        codeGen->ResetMem(code);
+    }
+
+    std::vector<NodeId> stmts;
+    for (NodeId cell = ast.root; cell != AST::NO_NODE; cell = ast.Node(cell).b) {
+        stmts.push_back(ast.Node(cell).a);
+    }
+    stats.statements += stmts.size();
+
+    struct Job {
+        std::shared_ptr<CodeGen> codeGen;
+        ir::Module code;
+        std::ostringstream log;
+    };
+    std::vector<std::unique_ptr<Job>> jobs(stmts.size());
+    std::vector<std::size_t> parallel;
+    std::vector<bool> live = ast.LiveStatements(stmts);
+    // bindings of the assignments left out
+    std::unordered_map<std::string, CodeGen::ExprOut> deadVars;
+
+    ASMGenVisitor *avisitor = new ASMGenVisitor(codeGen, code, opts.cache);
+    for (std::size_t i = 0; i < stmts.size(); i++) {
+        if (!live[i]) {
+            DeadCode saved = DropAssignment(ast, stmts[i], *codeGen, deadVars);
+            LOG(INFO, std::cerr << "dead code: statement " << i << " assigning '"
+                    << ast.Name(ast.Node(stmts[i]).a) << "' left out, "
+                    << saved.programs << " programs and " << saved.memWords
+                    << " words of data memory saved" << std::endl);
+            stats.deadStatements++;
+            stats.deadPrograms += saved.programs;
+            stats.deadMemWords += saved.memWords;
+            continue;
+        }
+        if (ast.Node(stmts[i]).kind == NodeKind::ASSIGNMENT) {
+            deadVars.erase(ast.Name(ast.Node(stmts[i]).a));
+        }
+        if (opts.jobs <= 1 || ast.TouchesMem(stmts[i])) {
+            if (parallel.empty()) {
+                ast.Accept(stmts[i], avisitor);
+                continue;
+            }
+            // earlier independent statements are still to be emitted
+            jobs[i] = std::make_unique<Job>();
+            codeGen->log = &jobs[i]->log;
+            ASMGenVisitor visitor {codeGen, jobs[i]->code, opts.cache};
+            ast.Accept(stmts[i], &visitor);
+            codeGen->log = &std::cerr;
+        } else {
+            jobs[i] = std::make_unique<Job>();
+            jobs[i]->codeGen = std::make_shared<CodeGen>(*codeGen);
+            jobs[i]->codeGen->log = &jobs[i]->log;
+            jobs[i]->codeGen->counters = {};
+            parallel.push_back(i);
+        }
+    }
+    delete avisitor;
+
+    std::atomic<std::size_t> next = 0;
+    auto worker = [&]() {
+        for (std::size_t k = next++; k < parallel.size(); k = next++) {
+            Job &job = *jobs[parallel[k]];
+            ASMGenVisitor visitor {job.codeGen, job.code, opts.cache};
+            ast.Accept(stmts[parallel[k]], &visitor);
+        }
+    };
+    std::vector<std::thread> threads;
+    int numThreads = std::min<std::size_t>(opts.jobs, parallel.size());
+    for (int t = 1; t < numThreads; t++) {
+        threads.emplace_back(worker);
+    }
+    worker();
+    for (std::thread &t : threads) {
+        t.join();
+    }
+
+    stats.alloc.Merge(codeGen->counters);
+    for (std::unique_ptr<Job> &job : jobs) {
+        if (job) {
+            std::cerr << job->log.str();
+            code.Append(std::move(job->code));
+            if (job->codeGen) {
+                stats.alloc.Merge(job->codeGen->counters);
+            }
+        }
+    }
+
+    if (opts.cache != nullptr) {
+        opts.cache->Trim();
+        stats.cacheHits += opts.cache->hits - cacheHits;
+        stats.cacheMisses += opts.cache->misses - cacheMisses;
+        stats.cacheEvictions += opts.cache->evictions - cacheEvictions;
+    }
+    stats.codegen += Clock::now() - start;
+
+    if (opts.passes != nullptr) {
+        start = Clock::now();
+        opts.passes->Run(code);
+        stats.passes += Clock::now() - start;
+    }
+
+    if (opts.stats != nullptr) {
+        stats.CountPrograms(code);
+    }
+    return code;
+}
+
+namespace {
+
+/// first program with more instructions than fit in instruction memory
+std::string CheckProgramSizes(const ir::Module &mod)
+{
+    for (std::size_t prog = 0; prog < mod.programs.size(); prog++) {
+        if (mod.programs[prog].NumInstrs() > MAX_INSTR) {
+            return "program " + std::to_string(prog) + " has more than "
+                + std::to_string(MAX_INSTR) + " instructions";
+        }
+    }
+    return "";
+}
+
+} // namespace
+
+void Compile(std::istream &inStream, std::ostream &outStream, const Options &opts)
+{
+    ir::Module code = Generate(inStream, opts);
+    std::string err = CheckProgramSizes(code);
+    if (!err.empty()) {
+        std::cerr << err << std::endl;
+        std::exit(1);
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    ir::Emit(code, outStream, opts.format);
+    outStream.flush();
+    if (opts.stats != nullptr) {
+        opts.stats->emit += std::chrono::steady_clock::now() - start;
+    }
+}
+
+namespace {
+
+volatile std::sig_atomic_t stopRequested = 0;
+
+constexpr uint8_t STATUS_OK = 0;
+constexpr uint8_t STATUS_ERROR = 1;
+
+bool ReadAll(int fd, char *buf, std::size_t n)
+{
+    while (n > 0) {
+        ssize_t r = read(fd, buf, n);
+        if (r <= 0) {
+            return false;
+        }
+        buf += r;
+        n -= r;
+    }
+    return true;
+}
+
+bool WriteAll(int fd, const char *buf, std::size_t n)
+{
+    while (n > 0) {
+        ssize_t w = write(fd, buf, n);
+        if (w <= 0) {
+            return false;
+        }
+        buf += w;
+        n -= w;
+    }
+    return true;
+}
+
+bool ReadU32(int fd, uint32_t &val)
+{
+    unsigned char b[4];
+    if (!ReadAll(fd, reinterpret_cast<char *>(b), 4)) {
+        return false;
+    }
+    val = b[0] | (b[1] << 8) | (b[2] << 16) | (static_cast<uint32_t>(b[3]) << 24);
+    return true;
+}
+
+bool Respond(int fd, uint8_t status, std::string_view payload)
+{
+    char head[5] = {static_cast<char>(status)};
+    uint32_t len = payload.size();
+    for (int i = 0; i < 4; i++) {
+        head[i+1] = static_cast<char>(len >> (8*i));
+    }
+    return WriteAll(fd, head, sizeof(head))
+        && WriteAll(fd, payload.data(), payload.size());
+}
+
+/// Compiles and assembles src in a child process so that the compiler's
+/// exit-on-error handling only ever ends that request. The child writes the
+/// binary to a pipe and its diagnostics to errFile.
+bool HandleRequest(int fd, const std::string &src, const Options &opts, FILE *errFile)
+{
+    int outPipe[2];
+    if (pipe(outPipe) != 0) {
+        return Respond(fd, STATUS_ERROR, "could not create pipe");
+    }
+    std::fflush(errFile);
+    rewind(errFile);
+    if (ftruncate(fileno(errFile), 0) != 0) {
+        return Respond(fd, STATUS_ERROR, "could not reset diagnostics file");
+    }
+
+    std::cout.flush();
+    pid_t pid = fork();
+    if (pid < 0) {
+        close(outPipe[0]);
+        close(outPipe[1]);
+        return Respond(fd, STATUS_ERROR, "could not fork compiler");
+    }
+    if (pid == 0) {
+        close(outPipe[0]);
+        dup2(fileno(errFile), STDERR_FILENO);
+
+        std::istringstream in {src};
+        ir::Module code = Generate(in, opts);
+        std::string err = CheckProgramSizes(code);
+        if (!err.empty()) {
+            std::cerr << err << std::endl;
+            std::exit(1);
+        }
+
+        std::ostringstream bin;
+        ir::Emit(code, bin, ir::Format::BIN);
+        std::string out = bin.str();
+        bool ok = WriteAll(outPipe[1], out.data(), out.size());
+        _exit(ok ? 0 : 1);
+    }
+
+    close(outPipe[1]);
+    std::string out;
+    char buf[1 << 16];
+    for (ssize_t r; (r = read(outPipe[0], buf, sizeof(buf))) > 0;) {
+        out.append(buf, r);
+    }
+    close(outPipe[0]);
+
+    int status;
+    while (waitpid(pid, &status, 0) < 0 && errno == EINTR) {
+    }
+    if (WIFEXITED(status) && WEXITSTATUS(status) == 0) {
+        return Respond(fd, STATUS_OK, out);
+    }
+
+    // report the last line of diagnostics which holds the error message
+    std::string log;
+    rewind(errFile);
+    for (std::size_t r; (r = std::fread(buf, 1, sizeof(buf), errFile)) > 0;) {
+        log.append(buf, r);
+    }
+    while (!log.empty() && log.back() == '\n') {
+        log.pop_back();
+    }
+    std::size_t nl = log.rfind('\n');
+    std::string msg = nl == std::string::npos ? log : log.substr(nl + 1);
+    if (msg.empty()) {
+        msg = "compiler failed";
+    }
+    return Respond(fd, STATUS_ERROR, msg);
+}
+
+/// serves requests on one connection until it is closed
+void ServeConnection(int inFd, int outFd, const Options &opts, FILE *errFile)
+{
+    std::string src;
+    for (char kind; ReadAll(inFd, &kind, 1);) {
+        if (kind == 'S') {
+            uint32_t len;
+            if (!ReadU32(inFd, len)) {
+                return;
+            }
+            src.resize(len);
+            if (!ReadAll(inFd, src.data(), len)) {
+                return;
+            }
+        } else if (kind == 'D') {
+            uint32_t offset, eraseLen, len;
+            if (!ReadU32(inFd, offset) || !ReadU32(inFd, eraseLen)
+                    || !ReadU32(inFd, len)) {
+                return;
+            }
+            std::string text(len, '\0');
+            if (!ReadAll(inFd, text.data(), len)) {
+                return;
+            }
+            if (offset > src.size() || eraseLen > src.size() - offset) {
+                if (!Respond(outFd, STATUS_ERROR, "source diff out of range")) {
+                    return;
+                }
+                continue;
+            }
+            src.replace(offset, eraseLen, text);
+        } else {
+            Respond(outFd, STATUS_ERROR, "unknown request kind");
+            return;
+        }
+
+        if (!HandleRequest(outFd, src, opts, errFile)) {
+            return;
+        }
+    }
+}
+
+} // namespace
+
+int Serve(const std::string &socketPath, const Options &opts)
+{
+    FILE *errFile = std::tmpfile();
+    if (errFile == nullptr) {
+        std::cerr << "conv server: could not create diagnostics file" << std::endl;
+        return 1;
+    }
+    // a client hanging up mid-response must not take the server down
+    std::signal(SIGPIPE, SIG_IGN);
+
+    if (socketPath.empty()) {
+        ServeConnection(STDIN_FILENO, STDOUT_FILENO, opts, errFile);
+        std::fclose(errFile);
+        return 0;
+    }
+
+    sockaddr_un addr {};
+    addr.sun_family = AF_UNIX;
+    if (socketPath.size() >= sizeof(addr.sun_path)) {
+        std::cerr << "conv server: socket path too long" << std::endl;
+        return 1;
+    }
+    std::strcpy(addr.sun_path, socketPath.c_str());
+
+    int listenFd = socket(AF_UNIX, SOCK_STREAM, 0);
+    unlink(socketPath.c_str());
+    if (listenFd < 0
+            || bind(listenFd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) != 0
+            || listen(listenFd, 4) != 0) {
+        std::cerr << "conv server: could not listen on '" << socketPath << "'"
+                  << std::endl;
+        return 1;
+    }
+
+    // SIGINT and SIGTERM interrupt accept and end the server normally
+    struct sigaction stop {};
+    stop.sa_handler = [](int) { stopRequested = 1; };
+    sigaction(SIGINT, &stop, nullptr);
+    sigaction(SIGTERM, &stop, nullptr);
+
+    while (!stopRequested) {
+        int conn = accept(listenFd, nullptr, nullptr);
+        if (conn < 0) {
+            continue;
+        }
+        ServeConnection(conn, conn, opts, errFile);
+        close(conn);
+    }
+    close(listenFd);
+    unlink(socketPath.c_str());
+    std::fclose(errFile);
+    return 0;
+}
+
+} // namespace driver
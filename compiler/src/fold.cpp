@@ -0,0 +1,382 @@
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <iostream>
+#include <optional>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include "codegen.hpp"
+#include "constants.hpp"
+#include "ir.hpp"
+#include "log.hpp"
+#include "opt.hpp"
+
+namespace opt {
+
+namespace {
+
+using ir::Instr;
+using ir::Op;
+using ir::Reg;
+
+/// integers of at most this magnitude are converted to TF18 exactly
+constexpr long EXACT_INT = 2048;
+
+struct Range {
+    long lo;
+    long hi;
+};
+
+/// what is known about the value of a register at some point of a program
+struct Fact {
+    std::optional<uint32_t> bits;
+    std::optional<Range> range;
+};
+
+bool IsFloatOp(Op op)
+{
+    return op >= Op::FADD && op <= Op::FEXP;
+}
+
+bool IsAddImm(Op op)
+{
+    return op == Op::ADDI || op == Op::SUBI;
+}
+
+/// immediate of addi/subi as the amount added
+long AddedImm(const Instr &instr)
+{
+    return instr.op == Op::ADDI ? instr.imm : -static_cast<long>(instr.imm);
+}
+
+Instr AddImm(Reg rd, Reg ra, long val)
+{
+    return ir::Make(val >= 0 ? Op::ADDI : Op::SUBI, {rd, ra}, std::labs(val));
+}
+
+std::optional<uint32_t> FoldFloat(Op op, const Fact &a, const Fact &b)
+{
+    if (!a.bits || (op != Op::FABS && !b.bits)) {
+        return {};
+    }
+    double x = CodeGen::TF18IntToDouble(*a.bits);
+    double y = op == Op::FABS ? 0.0 : CodeGen::TF18IntToDouble(*b.bits);
+    double val;
+    switch (op) {
+    case Op::FADD:
+        val = x + y;
+        break;
+    case Op::FSUB:
+        val = x - y;
+        break;
+    case Op::FMUL:
+        val = x * y;
+        break;
+    case Op::FDIV:
+        if (y == 0.0) {
+            return {};
+        }
+        val = x / y;
+        break;
+    case Op::FABS:
+        val = std::fabs(x);
+        break;
+    default:
+        return {};
+    }
+    if (!std::isfinite(val)) {
+        return {};
+    }
+    return CodeGen::DoubleToTF18Int(val);
+}
+
+/// value an instruction writes to its destination given facts of its operands
+Fact Evaluate(const Instr &instr, const Fact &a, const Fact &b)
+{
+    Fact out;
+    long imm = instr.imm;
+    switch (instr.op) {
+    case Op::LUI:
+        out.bits = instr.imm;
+        if (!instr.tf18) {
+            out.range = Range {imm, imm};
+        }
+        return out;
+    case Op::ADDI:
+    case Op::SUBI:
+        if (a.range) {
+            long add = AddedImm(instr);
+            out.range = Range {a.range->lo + add, a.range->hi + add};
+        }
+        break;
+    case Op::ADD:
+        if (a.range && b.range) {
+            out.range = Range {a.range->lo + b.range->lo, a.range->hi + b.range->hi};
+        }
+        break;
+    case Op::SUB:
+        if (a.range && b.range) {
+            out.range = Range {a.range->lo - b.range->hi, a.range->hi - b.range->lo};
+        }
+        break;
+    case Op::ANDI:
+        if (imm >= 0) {
+            long hi = a.range && a.range->lo >= 0 ? std::min(a.range->hi, imm) : imm;
+            out.range = Range {0, hi};
+        }
+        break;
+    case Op::SLLI:
+        if (a.range && a.range->lo >= 0 && imm < 16 && a.range->hi < (1L << 16)) {
+            out.range = Range {a.range->lo << imm, a.range->hi << imm};
+        }
+        break;
+    case Op::SRLI:
+        if (a.range && a.range->lo >= 0) {
+            out.range = Range {a.range->lo >> imm, a.range->hi >> imm};
+        }
+        break;
+    case Op::CVTIF:
+        if (a.range && a.range->lo == a.range->hi && std::labs(a.range->lo) <= EXACT_INT) {
+            out.bits = CodeGen::DoubleToTF18Int(a.range->lo);
+        }
+        return out;
+    default:
+        if (IsFloatOp(instr.op)) {
+            out.bits = FoldFloat(instr.op, a, b);
+        }
+        return out;
+    }
+    if (out.range && out.range->lo == out.range->hi) {
+        out.bits = static_cast<uint32_t>(out.range->lo);
+    }
+    return out;
+}
+
+/// what is known after a predicated write of val over old
+Fact Merge(const Fact &old, const Fact &val)
+{
+    Fact out;
+    if (old.bits && val.bits && *old.bits == *val.bits) {
+        out.bits = old.bits;
+    }
+    if (old.range && val.range) {
+        out.range = Range {std::min(old.range->lo, val.range->lo),
+            std::max(old.range->hi, val.range->hi)};
+    }
+    return out;
+}
+
+/// Forward pass over one block which rewrites instructions in place. Removed
+/// instructions are marked in dead.
+void FoldBlock(std::vector<Instr> &instrs, int numBlocks, std::vector<bool> &dead)
+{
+    const uint32_t ONE = CodeGen::DoubleToTF18Int(1.0);
+
+    std::unordered_map<Reg, Fact> facts;
+    facts[ir::ZERO] = {.bits = 0, .range = Range {0, 0}};
+    facts[ir::THREAD_IDX] = {.bits = {}, .range = Range {0, BLOCK_DIM - 1}};
+    facts[ir::BLOCK_DIM_REG] = {.bits = BLOCK_DIM, .range = Range {BLOCK_DIM, BLOCK_DIM}};
+    if (numBlocks > 0) {
+        facts[ir::BLOCK_IDX] = {.bits = {}, .range = Range {0, numBlocks - 1}};
+    }
+    auto fact = [&](Reg r) {
+        auto it = facts.find(r);
+        return it == facts.end() ? Fact {} : it->second;
+    };
+
+    // position of the last write and read of every register
+    std::unordered_map<Reg, int> lastDef;
+    std::unordered_map<Reg, int> lastUse;
+    // range of the integer converted by the cvtif at a position
+    std::unordered_map<int, Range> cvtifRange;
+
+    for (int i = 0; i < static_cast<int>(instrs.size()); i++) {
+        Instr &instr = instrs[i];
+        Fact a = fact(instr.ra);
+        Fact b = fact(instr.rb);
+        Reg copySrc = ir::NO_REG;
+
+        switch (instr.op) {
+        case Op::FADD:
+            copySrc = b.bits == 0u ? instr.ra : a.bits == 0u ? instr.rb : ir::NO_REG;
+            break;
+        case Op::FSUB:
+            copySrc = b.bits == 0u ? instr.ra : ir::NO_REG;
+            break;
+        case Op::FMUL:
+            copySrc = b.bits == ONE ? instr.ra : a.bits == ONE ? instr.rb : ir::NO_REG;
+            break;
+        case Op::FDIV:
+            copySrc = b.bits == ONE ? instr.ra : ir::NO_REG;
+            break;
+        case Op::ADDI:
+        case Op::SUBI:
+            copySrc = instr.imm == 0 ? instr.ra : ir::NO_REG;
+            break;
+        default:
+            break;
+        }
+
+        Fact val = Evaluate(instr, a, b);
+        if (copySrc != ir::NO_REG) {
+            if (copySrc == instr.rd) {
+                dead[i] = true;
+                continue;
+            }
+            bool pred = instr.pred;
+            instr = ir::Make(Op::ADDI, {instr.rd, copySrc}, 0);
+            instr.pred = pred;
+            val = fact(copySrc);
+        } else if ((IsFloatOp(instr.op) || instr.op == Op::CVTIF) && val.bits) {
+            bool pred = instr.pred;
+            instr = ir::Make(Op::LUI, {instr.rd}, *val.bits);
+            instr.tf18 = true;
+            instr.pred = pred;
+        } else if ((instr.op == Op::FSUB || instr.op == Op::FADD) && !instr.pred
+                && instr.rd == instr.ra && b.bits && lastDef.contains(instr.rd)) {
+            // (float)s - c = (float)(s - c) if both sides are exact
+            int k = lastDef[instr.rd];
+            double c = CodeGen::TF18IntToDouble(*b.bits);
+            long add = static_cast<long>(instr.op == Op::FSUB ? -c : c);
+            auto range = cvtifRange.find(k);
+            if (instrs[k].op == Op::CVTIF && !instrs[k].pred && lastUse[instr.rd] <= k
+                    && range != cvtifRange.end() && c == std::trunc(c)
+                    && std::fabs(c) <= MAX_IMM
+                    && std::max(std::labs(range->second.lo + add),
+                        std::labs(range->second.hi + add)) <= EXACT_INT) {
+                instrs[k] = AddImm(instr.rd, instrs[k].ra, add);
+                instr = ir::Make(Op::CVTIF, {instr.rd, instr.rd});
+                cvtifRange[i] = Range {range->second.lo + add, range->second.hi + add};
+                val = {};
+            }
+        }
+
+        if (instr.op == Op::CVTIF && a.range && !cvtifRange.contains(i)
+                && std::max(std::labs(a.range->lo), std::labs(a.range->hi)) <= EXACT_INT) {
+            cvtifRange[i] = *a.range;
+        }
+
+        for (Reg r : instr.Uses()) {
+            if (r != ir::NO_REG) {
+                lastUse[r] = i;
+            }
+        }
+        Reg d = instr.Def();
+        if (d != ir::NO_REG) {
+            if (instr.pred) {
+                // lanes with the predicate unset keep the old value
+                lastUse[d] = i;
+                facts[d] = Merge(fact(d), val);
+            } else {
+                facts[d] = val;
+            }
+            lastDef[d] = i;
+        }
+    }
+}
+
+/// Merges addi/subi chains on a register. -r - c is rewritten to -(r + c)
+/// first so that the addition can join an earlier chain.
+bool MergeImmediates(std::vector<Instr> &instrs)
+{
+    bool changed = false;
+    for (int i = 0; i + 1 < static_cast<int>(instrs.size()); i++) {
+        Instr &x = instrs[i];
+        Instr &y = instrs[i+1];
+        if (x.pred != y.pred || !IsAddImm(y.op) || y.rd != y.ra) {
+            continue;
+        }
+        if (IsAddImm(x.op) && x.rd == y.ra) {
+            long total = AddedImm(x) + AddedImm(y);
+            if (std::labs(total) > MAX_IMM) {
+                continue;
+            }
+            bool pred = x.pred;
+            if (total == 0 && x.ra == x.rd) {
+                instrs.erase(instrs.begin() + i, instrs.begin() + i + 2);
+            } else {
+                x = AddImm(x.rd, x.ra, total);
+                x.pred = pred;
+                instrs.erase(instrs.begin() + i + 1);
+            }
+            changed = true;
+            i = i > 0 ? i - 2 : -1;
+        } else if (x.op == Op::SUB && x.ra == ir::ZERO && x.rb == x.rd && x.rd == y.rd) {
+            std::swap(x, y);
+            Instr add = AddImm(x.rd, x.ra, -AddedImm(x));
+            add.pred = x.pred;
+            x = add;
+            changed = true;
+            i = i > 0 ? i - 2 : -1;
+        }
+    }
+    return changed;
+}
+
+} // namespace
+
+int RemoveDeadCode(ir::Program &prog)
+{
+    int removed = 0;
+    // there are no branches so registers live out of a block are the ones
+    // live into the next
+    std::unordered_set<Reg> live;
+    for (auto block = prog.blocks.rbegin(); block != prog.blocks.rend(); ++block) {
+        std::vector<Instr> &instrs = block->instrs;
+        std::vector<bool> dead(instrs.size(), false);
+        for (int i = instrs.size() - 1; i >= 0; i--) {
+            Reg d = instrs[i].Def();
+            if (d != ir::NO_REG && !live.contains(d)) {
+                dead[i] = true;
+                removed++;
+                continue;
+            }
+            if (d != ir::NO_REG && !instrs[i].pred) {
+                live.erase(d);
+            }
+            for (Reg r : instrs[i].Uses()) {
+                if (r != ir::NO_REG) {
+                    live.insert(r);
+                }
+            }
+        }
+        std::size_t k = 0;
+        std::erase_if(instrs, [&](const Instr &) { return dead[k++]; });
+    }
+    return removed;
+}
+
+void FoldConstants(ir::Module &mod)
+{
+    for (std::size_t p = 0; p < mod.programs.size(); p++) {
+        ir::Program &prog = mod.programs[p];
+        // the rest of such a program is not known
+        if (prog.numBlocks == ir::Program::CONTINUATION) {
+            continue;
+        }
+        int before = prog.NumInstrs();
+        for (int round = 0, size = before + 1; round < 4 && prog.NumInstrs() < size; round++) {
+            size = prog.NumInstrs();
+            for (ir::Block &block : prog.blocks) {
+                std::vector<bool> dead(block.instrs.size(), false);
+                FoldBlock(block.instrs, prog.numBlocks, dead);
+                std::size_t k = 0;
+                std::erase_if(block.instrs, [&](const Instr &) { return dead[k++]; });
+            }
+            RemoveDeadCode(prog);
+            for (ir::Block &block : prog.blocks) {
+                while (MergeImmediates(block.instrs)) {}
+            }
+        }
+        int removed = before - prog.NumInstrs();
+        if (removed > 0) {
+            LOG(INFO, std::cerr << "fold: program " << p << ": " << removed
+                    << " of " << before << " instructions removed" << std::endl);
+        }
+    }
+}
+
+} // namespace opt
@@ -0,0 +1,350 @@
+#include <array>
+#include <cstring>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <string_view>
+
+#include "assembler.hpp"
+#include "constants.hpp"
+#include "ir.hpp"
+#include "log.hpp"
+
+namespace ir {
+
+namespace {
+
+// indexed by Op
+constexpr std::array<OpInfo, static_cast<int>(Op::NOP) + 1> OP_INFO {{
+    {"add", Form::RRR}, {"sub", Form::RRR}, {"mul", Form::RRR},
+    {"div", Form::RRR}, {"rem", Form::RRR}, {"and", Form::RRR},
+    {"or", Form::RRR}, {"xor", Form::RRR}, {"sll", Form::RRR},
+    {"srl", Form::RRR}, {"sra", Form::RRR}, {"slt", Form::CMP_RR},
+    {"seq", Form::CMP_RR},
+    {"addi", Form::RRI}, {"subi", Form::RRI}, {"muli", Form::RRI},
+    {"divi", Form::RRI}, {"remi", Form::RRI}, {"andi", Form::RRI},
+    {"ori", Form::RRI}, {"xori", Form::RRI}, {"slli", Form::RRI},
+    {"srli", Form::RRI}, {"srai", Form::RRI}, {"slti", Form::CMP_RI},
+    {"seqi", Form::CMP_RI},
+    {"lui", Form::RI},
+    {"fadd", Form::RRR}, {"fsub", Form::RRR}, {"fmul", Form::RRR},
+    {"fdiv", Form::RRR}, {"fabs", Form::RR}, {"frcp", Form::RR},
+    {"fsqrt", Form::RR}, {"frsqrt", Form::RR}, {"fsin", Form::RR},
+    {"fcos", Form::RR}, {"flog", Form::RR}, {"fexp", Form::RR},
+    {"fslt", Form::CMP_RR}, {"fseq", Form::CMP_RR},
+    {"cvtif", Form::RR}, {"cvtfi", Form::RR}, {"cvtfr", Form::RR},
+    {"cvtfc", Form::RR},
+    {"lw", Form::LOAD}, {"sw", Form::STORE}, {"spix", Form::STORE},
+    {"disp", Form::OUT}, {"exit", Form::NONE}, {"nop", Form::NONE},
+}};
+
+int NumRegOperands(Form form)
+{
+    switch (form) {
+    case Form::RRR:
+        return 3;
+    case Form::RRI:
+    case Form::RR:
+    case Form::CMP_RR:
+    case Form::LOAD:
+    case Form::STORE:
+        return 2;
+    case Form::RI:
+    case Form::CMP_RI:
+    case Form::OUT:
+        return 1;
+    case Form::NONE:
+        return 0;
+    }
+    return 0;
+}
+
+bool HasImm(Form form)
+{
+    return form == Form::RRI || form == Form::RI || form == Form::CMP_RI;
+}
+
+} // namespace
+
+const OpInfo &Info(Op op)
+{
+    return OP_INFO[static_cast<int>(op)];
+}
+
+Reg Instr::Def() const
+{
+    switch (Info(op).form) {
+    case Form::RRR:
+    case Form::RRI:
+    case Form::RR:
+    case Form::RI:
+    case Form::LOAD:
+        return rd;
+    default:
+        return NO_REG;
+    }
+}
+
+std::array<Reg, 2> Instr::Uses() const
+{
+    return {ra, rb};
+}
+
+Instr Make(Op op, std::initializer_list<Reg> regs, std::int32_t imm)
+{
+    Form form = Info(op).form;
+    if (static_cast<int>(regs.size()) != NumRegOperands(form)) {
+        std::cerr << "IR error: '" << Info(op).name << "' takes "
+                  << NumRegOperands(form) << " register operands but got "
+                  << regs.size() << std::endl;
+        std::exit(1);
+    }
+    Instr instr {.op = op, .imm = imm};
+    const Reg *r = regs.begin();
+    switch (form) {
+    case Form::RRR:
+        instr.rd = r[0];
+        instr.ra = r[1];
+        instr.rb = r[2];
+        break;
+    case Form::RRI:
+    case Form::RR:
+    case Form::LOAD:
+        instr.rd = r[0];
+        instr.ra = r[1];
+        break;
+    case Form::RI:
+        instr.rd = r[0];
+        break;
+    case Form::CMP_RR:
+    case Form::STORE:
+        instr.ra = r[0];
+        instr.rb = r[1];
+        break;
+    case Form::CMP_RI:
+    case Form::OUT:
+        instr.ra = r[0];
+        break;
+    case Form::NONE:
+        break;
+    }
+    return instr;
+}
+
+int Program::NumInstrs() const
+{
+    int n = 0;
+    for (const Block &block : blocks) {
+        n += block.instrs.size();
+    }
+    return n;
+}
+
+void Module::BeginProgram(int numBlocks)
+{
+    programs.push_back({.numBlocks = numBlocks, .blocks = {Block {}}});
+}
+
+void Module::Append(const Instr &instr)
+{
+    if (programs.empty()) {
+        BeginProgram(Program::CONTINUATION);
+    }
+    programs.back().blocks.back().instrs.push_back(instr);
+}
+
+void Module::Append(Module &&other)
+{
+    auto first = other.programs.begin();
+    if (first != other.programs.end() && first->numBlocks == Program::CONTINUATION
+            && !programs.empty()) {
+        Block &last = programs.back().blocks.back();
+        for (Block &block : first->blocks) {
+            last.instrs.insert(last.instrs.end(), block.instrs.begin(), block.instrs.end());
+        }
+        ++first;
+    }
+    programs.insert(programs.end(), std::make_move_iterator(first),
+            std::make_move_iterator(other.programs.end()));
+    other.programs.clear();
+}
+
+int Module::NumInstrs() const
+{
+    int n = 0;
+    for (const Program &prog : programs) {
+        n += prog.NumInstrs();
+    }
+    return n;
+}
+
+void PassManager::Add(std::string name, Pass pass)
+{
+    passes_.emplace_back(std::move(name), std::move(pass));
+}
+
+void PassManager::Run(Module &mod) const
+{
+    for (const auto &[name, pass] : passes_) {
+        int before = mod.NumInstrs();
+        pass(mod);
+        LOG(DEBUG, std::cerr << "pass " << name << ": " << before << " -> "
+                << mod.NumInstrs() << " instructions" << std::endl);
+    }
+}
+
+std::string RegName(Reg reg)
+{
+    switch (reg) {
+    case ZERO:
+        return "zero";
+    case BLOCK_IDX:
+        return "%blockIdx";
+    case BLOCK_DIM_REG:
+        return "%blockDim";
+    case THREAD_IDX:
+        return "%threadIdx";
+    }
+    std::string name = reg >= VREG_BASE ? "v" : "r";
+    name += std::to_string(reg >= VREG_BASE ? reg - VREG_BASE : reg);
+    return name;
+}
+
+static void EmitText(const Module &mod, std::ostream &stream)
+{
+    for (const Program &prog : mod.programs) {
+        if (prog.numBlocks != Program::CONTINUATION) {
+            stream << "<" << prog.numBlocks << "," << BLOCK_DIM << ">\n";
+        }
+        for (const Block &block : prog.blocks) {
+            for (const Instr &instr : block.instrs) {
+                const OpInfo &info = Info(instr.op);
+                stream << info.name << (instr.pred ? ".p" : "");
+                const char *sep = " ";
+                auto reg = [&](Reg r) {
+                    if (r >= VREG_BASE) {
+                        std::cerr << "IR error: virtual register " << RegName(r)
+                                  << " left for emission" << std::endl;
+                        std::exit(1);
+                    }
+                    stream << sep << RegName(r);
+                    sep = ", ";
+                };
+                switch (info.form) {
+                case Form::RRR:
+                    reg(instr.rd), reg(instr.ra), reg(instr.rb);
+                    break;
+                case Form::RRI:
+                case Form::RR:
+                case Form::LOAD:
+                    reg(instr.rd), reg(instr.ra);
+                    break;
+                case Form::RI:
+                    reg(instr.rd);
+                    break;
+                case Form::CMP_RR:
+                case Form::STORE:
+                    reg(instr.ra), reg(instr.rb);
+                    break;
+                case Form::CMP_RI:
+                case Form::OUT:
+                    reg(instr.ra);
+                    break;
+                case Form::NONE:
+                    break;
+                }
+                if (HasImm(info.form)) {
+                    if (instr.tf18) {
+                        stream << ", 0x" << std::hex << instr.imm << std::dec;
+                    } else {
+                        stream << ", " << instr.imm;
+                    }
+                }
+                stream << "\n";
+            }
+        }
+    }
+}
+
+void Emit(const Module &mod, std::ostream &stream, Format format)
+{
+    if (format == Format::TEXT) {
+        EmitText(mod, stream);
+        return;
+    }
+    std::stringstream text;
+    EmitText(mod, text);
+    Assembler assembler;
+    assembler.assemble(text, stream, format == Format::HEX ? "hex" : "bin");
+}
+
+namespace {
+
+template<typename T>
+void Put(std::string &out, T val)
+{
+    out.append(reinterpret_cast<const char *>(&val), sizeof(val));
+}
+
+template<typename T>
+T Get(std::string_view &in)
+{
+    T val {};
+    if (in.size() < sizeof(val)) {
+        std::cerr << "IR error: truncated module data" << std::endl;
+        std::exit(1);
+    }
+    std::memcpy(&val, in.data(), sizeof(val));
+    in.remove_prefix(sizeof(val));
+    return val;
+}
+
+} // namespace
+
+std::string Serialize(const Module &mod)
+{
+    std::string out;
+    Put<std::uint32_t>(out, mod.programs.size());
+    for (const Program &prog : mod.programs) {
+        Put<std::int32_t>(out, prog.numBlocks);
+        Put<std::uint32_t>(out, prog.blocks.size());
+        for (const Block &block : prog.blocks) {
+            Put<std::uint32_t>(out, block.instrs.size());
+            for (const Instr &instr : block.instrs) {
+                Put<std::uint8_t>(out, static_cast<std::uint8_t>(instr.op));
+                Put<std::uint8_t>(out, instr.pred | instr.tf18 << 1);
+                Put<std::int32_t>(out, instr.rd);
+                Put<std::int32_t>(out, instr.ra);
+                Put<std::int32_t>(out, instr.rb);
+                Put<std::int32_t>(out, instr.imm);
+            }
+        }
+    }
+    return out;
+}
+
+Module Deserialize(std::string_view data)
+{
+    Module mod;
+    mod.programs.resize(Get<std::uint32_t>(data));
+    for (Program &prog : mod.programs) {
+        prog.numBlocks = Get<std::int32_t>(data);
+        prog.blocks.resize(Get<std::uint32_t>(data));
+        for (Block &block : prog.blocks) {
+            block.instrs.resize(Get<std::uint32_t>(data));
+            for (Instr &instr : block.instrs) {
+                instr.op = static_cast<Op>(Get<std::uint8_t>(data));
+                std::uint8_t flags = Get<std::uint8_t>(data);
+                instr.pred = flags & 1;
+                instr.tf18 = flags & 2;
+                instr.rd = Get<std::int32_t>(data);
+                instr.ra = Get<std::int32_t>(data);
+                instr.rb = Get<std::int32_t>(data);
+                instr.imm = Get<std::int32_t>(data);
+            }
+        }
+    }
+    return mod;
+}
+
+} // namespace ir
@@ -1,106 +1,292 @@
-#include <unordered_map>
-#include <regex>
+#include <array>
 #include <tuple>
 #include <cctype>
-#include <functional>
+#include <cstdint>
+#include <charconv>
+#include <string_view>
+#include <algorithm>
+#include <system_error>
 
 #include "lex.hpp"
 
 namespace lex {
-std::tuple<Token, int, LexType> Lex(std::istream &inStream)
+
+namespace {
+
+/// DFA over raw input bytes. State 0 is the dead state (no transition) and
+/// state 1 the start state. The table is built at compile time from the
+/// keyword list plus the number and variable name patterns:
+/// - variable name: \$[a-zA-Z][a-zA-Z0-9_]*
+/// - real: [0-9]+\.[0-9]*
+/// - int: [0-9]+
+/// - string: "[^"\n]*"
+constexpr int MAX_STATES = 96;
+constexpr uint8_t DEAD = 0;
+constexpr uint8_t START = 1;
+
+struct Dfa {
+    std::array<std::array<uint8_t, 256>, MAX_STATES> next {};
+    std::array<Token, MAX_STATES> accept {};
+    int numStates = 2;
+};
+
+constexpr std::pair<std::string_view, Token> KEYWORDS[] = {
+    {"x", Token::X},
+    {"y", Token::Y},
+    {".plot", Token::PLOT},
+    {".plotxy", Token::PLOTXY},
+    {".simple_plotxy", Token::PLOTXY_SIMPLE},
+    {".plotx", Token::PLOTX},
+    {".load", Token::LOAD},
+    {"+", Token::PLUS},
+    {"-", Token::MINUS},
+    {"*", Token::MULT},
+    {"/", Token::DIV},
+    {"dot", Token::DOT},
+    {"^", Token::POW},
+    {".T", Token::TRANSPOSE},
+    {"exp", Token::EXP},
+    {"sin", Token::SIN},
+    {"cos", Token::COS},
+    {"sqrt", Token::SQRT},
+    {"relu", Token::RELU},
+    {"(", Token::LROUND_BRACK},
+    {")", Token::RROUND_BRACK},
+    {"[", Token::LSQUARE_BRACK},
+    {"]", Token::RSQUARE_BRACK},
+    {",", Token::COMMA},
+    {"=", Token::EQUAL},
+    {"|", Token::VERT_LINE},
+};
+
+constexpr bool isDigit(int c) { return c >= '0' && c <= '9'; }
+constexpr bool isAlpha(int c) { return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z'); }
+
+constexpr Dfa BuildDfa()
 {
-    static int lineNo = 1;
-    std::unordered_map<std::string, std::pair<Token, std::function<LexType(std::string)>>>
-        tok_map =
-    {
-        // variable name must start with a character but can't be single letter
-        // x or y
-        {"\\$[a-zA-Z][a-zA-Z0-9_]*",
-            std::make_pair(Token::VARNAME, [](std::string t){ return t.substr(1,t.size()-1); })},
-        {"x", {Token::X, [](std::string t){ return t; }}},
-        {"y", {Token::Y, [](std::string t){ return t; }}},
-        {"\\.plot",
-            {Token::PLOT, [](std::string t){ return t; }}},
-        {"\\.plotxy",
-            {Token::PLOTXY, [](std::string t){ return t; }}},
-        {"\\.simple_plotxy",
-            {Token::PLOTXY_SIMPLE, [](std::string t){ return t; }}},
-        {"\\.plotx",
-            {Token::PLOTX, [](std::string t){ return t; }}},
-        {"\\+",
-            {Token::PLUS, [](std::string t){ return CodeGen::BinaryOp::PLUS; }}},
-        {"-",
-            {Token::MINUS, [](std::string t){ return CodeGen::BinaryOp::MINUS; }}},
-        {"\\*",
-            {Token::MULT, [](std::string t){ return CodeGen::BinaryOp::MULT; }}},
-        {"/",
-            {Token::DIV, [](std::string t){ return CodeGen::BinaryOp::DIV; }}},
-        {"dot",
-            {Token::DOT, [](std::string t){ return CodeGen::BinaryOp::DOT; }}},
-        {"\\^",
-            {Token::POW, [](std::string t){ return t; }}},
-        {"\\.T",
-            {Token::TRANSPOSE, [](std::string t){ return t; }}},
-        {"exp",
-            {Token::EXP, [](std::string t){ return CodeGen::UnaryOp::EXP; }}},
-        {"sin",
-            {Token::SIN, [](std::string t){ return CodeGen::UnaryOp::SIN; }}},
-        {"cos",
-            {Token::COS, [](std::string t){ return CodeGen::UnaryOp::COS; }}},
-        {"sqrt",
-            {Token::SQRT, [](std::string t){ return CodeGen::UnaryOp::SQRT; }}},
-        {"relu",
-            {Token::RELU, [](std::string t){ return CodeGen::UnaryOp::RELU; }}},
-        {"\\(", 
-            {Token::LROUND_BRACK, [](std::string t){ return t; }}},
-        {"\\)",
-            {Token::RROUND_BRACK, [](std::string t){ return t; }}},
-        {"\\[",
-            {Token::LSQUARE_BRACK, [](std::string t){ return t; }}},
-        {"\\]",
-            {Token::RSQUARE_BRACK, [](std::string t){ return t; }}},
-        {"[0-9]+\\.([0-9]*)?",
-            {Token::REAL, [](std::string t){ return std::stod(t); }}},
-        {"[0-9]+",
-            {Token::INT, [](std::string t){ return std::stoi(t); }}},
-        {",",
-            {Token::COMMA, [](std::string t){ return t; }}},
-        {"=",
-            {Token::EQUAL, [](std::string t){ return t; }}},
-        {"\\|",
-            {Token::VERT_LINE, [](std::string t){ return t; }}},
-    };
+    Dfa dfa;
+    for (Token &t : dfa.accept) {
+        t = Token::ILLEGAL;
+    }
 
-    if (inStream.peek() == EOF) {
-        return {Token::_EOF_, lineNo, ""};
+    // keywords and punctuation form a trie below the start state
+    for (auto [kw, tok] : KEYWORDS) {
+        uint8_t s = START;
+        for (char c : kw) {
+            uint8_t &n = dfa.next[s][static_cast<unsigned char>(c)];
+            if (n == DEAD) {
+                n = dfa.numStates++;
+            }
+            s = n;
+        }
+        dfa.accept[s] = tok;
     }
 
+    uint8_t intState = dfa.numStates++;
+    uint8_t realState = dfa.numStates++;
+    uint8_t dollarState = dfa.numStates++;
+    uint8_t varState = dfa.numStates++;
+    uint8_t quoteState = dfa.numStates++;
+    uint8_t stringState = dfa.numStates++;
+    for (int c = 0; c < 256; c++) {
+        if (isDigit(c)) {
+            dfa.next[START][c] = intState;
+            dfa.next[intState][c] = intState;
+            dfa.next[realState][c] = realState;
+        }
+        if (isAlpha(c)) {
+            dfa.next[dollarState][c] = varState;
+        }
+        if (isAlpha(c) || isDigit(c) || c == '_') {
+            dfa.next[varState][c] = varState;
+        }
+        if (c != '"' && c != '\n') {
+            dfa.next[quoteState][c] = quoteState;
+        }
+    }
+    dfa.next[intState]['.'] = realState;
+    dfa.next[START]['$'] = dollarState;
+    dfa.next[START]['"'] = quoteState;
+    dfa.next[quoteState]['"'] = stringState;
+    dfa.accept[intState] = Token::INT;
+    dfa.accept[realState] = Token::REAL;
+    dfa.accept[varState] = Token::VARNAME;
+    dfa.accept[stringState] = Token::STRING;
+    return dfa;
+}
+
+constexpr Dfa DFA = BuildDfa();
+static_assert(DFA.numStates <= MAX_STATES, "lexer DFA needs more states");
+
+LexType TokenValue(Token t, const std::string &text)
+{
+    switch (t) {
+    case Token::VARNAME:
+        return text.substr(1, text.size()-1);
+    case Token::STRING:
+        return text.substr(1, text.size()-2);
+    case Token::REAL: {
+        double d = 0.0;
+        std::from_chars(text.data(), text.data() + text.size(), d);
+        return d;
+    }
+    case Token::INT: {
+        int i = 0;
+        std::from_chars(text.data(), text.data() + text.size(), i);
+        return i;
+    }
+    case Token::PLUS:
+        return CodeGen::BinaryOp::PLUS;
+    case Token::MINUS:
+        return CodeGen::BinaryOp::MINUS;
+    case Token::MULT:
+        return CodeGen::BinaryOp::MULT;
+    case Token::DIV:
+        return CodeGen::BinaryOp::DIV;
+    case Token::DOT:
+        return CodeGen::BinaryOp::DOT;
+    case Token::EXP:
+        return CodeGen::UnaryOp::EXP;
+    case Token::SIN:
+        return CodeGen::UnaryOp::SIN;
+    case Token::COS:
+        return CodeGen::UnaryOp::COS;
+    case Token::SQRT:
+        return CodeGen::UnaryOp::SQRT;
+    case Token::RELU:
+        return CodeGen::UnaryOp::RELU;
+    default:
+        return text;
+    }
+}
+
+} // namespace
+
+std::tuple<Token, int, LexType> Lex(std::istream &inStream, int &lineNo)
+{
     // ignore any whitespace
-    while(std::isspace(inStream.peek())) {
+    while (std::isspace(inStream.peek())) {
         if (inStream.get() == '\n') {
             lineNo++;
         }
     }
 
+    if (inStream.peek() == EOF) {
+        return {Token::_EOF_, lineNo, ""};
+    }
 
+    // follow transitions until the next character would leave the DFA
     std::string token = "";
-    std::tuple<Token, int, LexType> res = {Token::ILLEGAL, lineNo, ""};
-    for (char out = inStream.get(); out != EOF; out = inStream.get()) {
-        token += out;
-        bool matched = false;
-        for (auto &[key, val] : tok_map) {
-            std::regex rx {key};
-            if (std::regex_match(token, rx)) {
-                matched = true;
-                res = {val.first, lineNo, val.second(token)};
+    uint8_t state = START;
+    for (int c = inStream.peek(); c != EOF; c = inStream.peek()) {
+        uint8_t next = DFA.next[state][static_cast<unsigned char>(c)];
+        if (next == DEAD) {
+            break;
+        }
+        state = next;
+        token += static_cast<char>(inStream.get());
+    }
+
+    if (state == START) {
+        // character that can't start any token
+        token += static_cast<char>(inStream.get());
+    }
+
+    Token t = DFA.accept[state];
+    if (t == Token::ILLEGAL) {
+        return {Token::ILLEGAL, lineNo, token};
+    }
+    return {t, lineNo, TokenValue(t, token)};
+}
+
+std::tuple<Token, int, LexType> TokenStream::TimedLex()
+{
+    auto start = std::chrono::steady_clock::now();
+    std::tuple<Token, int, LexType> tok = Lex(inStream_, lineNo_);
+    lexTime_ += std::chrono::steady_clock::now() - start;
+    return tok;
+}
+
+const std::tuple<Token, int, LexType> &TokenStream::Peek(std::size_t k)
+{
+    while (lookahead_.size() <= k) {
+        lookahead_.push_back(TimedLex());
+    }
+    return lookahead_[k];
+}
+
+std::tuple<Token, int, LexType> TokenStream::Next()
+{
+    if (lookahead_.empty()) {
+        return TimedLex();
+    }
+    std::tuple<Token, int, LexType> tok = std::move(lookahead_.front());
+    lookahead_.pop_front();
+    return tok;
+}
+
+std::string TokenStream::ScanRealList(std::vector<double> &out, int &errLine)
+{
+    if (!lookahead_.empty()) {
+        errLine = std::get<1>(lookahead_.front());
+        return "array literal scanned with pending lookahead";
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    errLine = lineNo_;
+    std::string buf;
+    std::getline(inStream_, buf, ']');
+    if (inStream_.eof()) {
+        inStream_.clear(std::ios_base::eofbit);
+        return "expected ] to close array literal";
+    }
+    lineNo_ += std::count(buf.begin(), buf.end(), '\n');
+
+    const char *p = buf.data();
+    const char *end = p + buf.size();
+    auto skipSpace = [&]() {
+        while (p != end && std::isspace(static_cast<unsigned char>(*p))) {
+            if (*p == '\n') {
+                errLine++;
             }
+            p++;
         }
+    };
+
+    auto skipDigits = [&]() {
+        while (p != end && isDigit(*p)) {
+            p++;
+        }
+    };
 
-        if (!matched && std::get<0>(res) != Token::ILLEGAL) {
-            inStream.unget();
-            return res;
+    // the values are REAL tokens, optionally after a MINUS one, and a
+    // trailing comma before ] is allowed like with the token parser
+    for (skipSpace(); p != end; skipSpace()) {
+        bool neg = *p == '-';
+        if (neg) {
+            p++;
+            skipSpace();
         }
+        const char *num = p;
+        skipDigits();
+        if (p == num || p == end || *p != '.') {
+            return "expected double for array literal value";
+        }
+        p++;
+        skipDigits();
+        double val;
+        std::from_chars(num, p, val);
+        out.push_back(neg ? -val : val);
+        skipSpace();
+        if (p == end) {
+            break;
+        } else if (*p != ',') {
+            return "expected comma to separate array literal values";
+        }
+        p++;
     }
-    return res;
+    lexTime_ += std::chrono::steady_clock::now() - start;
+    return "";
 }
+
 } // namespace lex
@@ -4,9 +4,14 @@
 #include <memory>
 #include <sstream>
 #include <string>
+#include <string_view>
+#include <charconv>
 #include <cstdint>
 #include <fstream>
 #include <filesystem>
+#include <thread>
+#include <algorithm>
+#include <cstdlib>
 
 #include "context.hpp"
 #include "ast.hpp"
@@ -14,19 +19,47 @@
 #include "constants.hpp"
 #include "codegen.hpp"
 #include "parser.hpp"
+#include "driver.hpp"
+#include "ir.hpp"
+#include "opt.hpp"
+#include "stmt_cache.hpp"
+#include "stats.hpp"
+#include "log.hpp"
 
 
+/// whether all of str is a number, which is stored in val
+template <typename T>
+bool ParseNumber(std::string_view str, T &val)
+{
+    auto [end, ec] = std::from_chars(str.data(), str.data() + str.size(), val);
+    return ec == std::errc {} && end == str.data() + str.size();
+}
+
 int main(int argc, char *argv[])
 {
+    std::ios_base::sync_with_stdio(false);
+
     const char *usage =
-        "Usage: conv [-s|--single-out] [-o/--out output file] [input asm file]";
+        "Usage: conv [-s|--single-out] [-j|--jobs n] [-c|--cache dir]\n"
+        "            [--cache-size bytes] [--log-level error|warn|info|debug]\n"
+        "            [--stats json file or -] [--emit asm|bin|hex]\n"
+        "            [-o/--out output file] [input asm file]\n"
+        "       conv [-s|--single-out] [-j|--jobs n] [-c|--cache dir]\n"
+        "            [--cache-size bytes] [--log-level error|warn|info|debug]\n"
+        "            --server [socket path]";
     bool useStdout = true;
     bool useStdin = true;
     std::streambuf *coutBak = std::cout.rdbuf();
     std::streambuf *cinBak = std::cin.rdbuf();
     std::ifstream in;
     std::ofstream out;
-    bool singleOut = false;
+    driver::Options opts;
+    opts.jobs = std::max(1u, std::thread::hardware_concurrency());
+    bool server = false;
+    std::string socketPath = "";
+    std::string cacheDir = "";
+    std::uintmax_t cacheSize = StmtCache::DEFAULT_MAX_BYTES;
+    std::string statsPath = "";
     for (int i = 1; i < argc; i++) {
         if (argv[i] == std::string("-o")
                 || argv[i] == std::string("--out")) {
@@ -39,9 +72,77 @@ int main(int argc, char *argv[])
                 std::cerr << usage << std::endl;
                 std::exit(1);
             }
+        } else if (argv[i] == std::string("-c")
+                || argv[i] == std::string("--cache")) {
+            if (i < argc - 1) {
+                cacheDir = argv[i+1];
+                i++;
+            } else {
+                std::cerr << usage << std::endl;
+                std::exit(1);
+            }
+        } else if (argv[i] == std::string("--cache-size")) {
+            if (i < argc - 1 && ParseNumber(argv[i+1], cacheSize)) {
+                i++;
+            } else {
+                std::cerr << usage << std::endl;
+                std::exit(1);
+            }
+        } else if (argv[i] == std::string("-j")
+                || argv[i] == std::string("--jobs")) {
+            if (i < argc - 1 && ParseNumber(argv[i+1], opts.jobs)) {
+                opts.jobs = std::max(1, opts.jobs);
+                i++;
+            } else {
+                std::cerr << usage << std::endl;
+                std::exit(1);
+            }
+        } else if (argv[i] == std::string("--log-level")) {
+            const std::pair<const char *, LogLevel> levels[] = {
+                {"error", LogLevel::ERROR},
+                {"warn", LogLevel::WARN},
+                {"info", LogLevel::INFO},
+                {"debug", LogLevel::DEBUG},
+            };
+            auto level = std::find_if(std::begin(levels), std::end(levels),
+                    [&](auto &l) { return i < argc - 1 && argv[i+1] == std::string(l.first); });
+            if (level == std::end(levels)) {
+                std::cerr << usage << std::endl;
+                std::exit(1);
+            }
+            logLevel = level->second;
+            i++;
+        } else if (argv[i] == std::string("--emit")) {
+            const std::pair<const char *, ir::Format> formats[] = {
+                {"asm", ir::Format::TEXT},
+                {"bin", ir::Format::BIN},
+                {"hex", ir::Format::HEX},
+            };
+            auto format = std::find_if(std::begin(formats), std::end(formats),
+                    [&](auto &f) { return i < argc - 1 && argv[i+1] == std::string(f.first); });
+            if (format == std::end(formats)) {
+                std::cerr << usage << std::endl;
+                std::exit(1);
+            }
+            opts.format = format->second;
+            i++;
+        } else if (argv[i] == std::string("--stats")) {
+            if (i < argc - 1) {
+                statsPath = argv[i+1];
+                i++;
+            } else {
+                std::cerr << usage << std::endl;
+                std::exit(1);
+            }
+        } else if (argv[i] == std::string("--server")) {
+            server = true;
+            if (i < argc - 1 && argv[i+1][0] != '-') {
+                socketPath = argv[i+1];
+                i++;
+            }
         } else if (argv[i] == std::string("-s")
                 || argv[i] == std::string("--single-out")) {
-            singleOut = true;
+            opts.singleOut = true;
         } else {
             in.open(argv[i]);
             std::cin.rdbuf(in.rdbuf());
@@ -49,31 +150,68 @@ int main(int argc, char *argv[])
         }
     }
 
-    std::string inStr = "";
-    for (std::string line; std::getline(std::cin, line, '\n');) {
-        inStr += line;
-    }
-    std::istringstream inStream {inStr};
-
-    std::shared_ptr<ASTNode> astRoot = parse::Parse(inStream);
+    CompileStats stats;
+    // whole-module rewrites between code generation and emission
+    ir::PassManager passes;
+    passes.Add("fold", opt::FoldConstants);
+    passes.Add("strength", opt::ReduceStrength);
+    passes.Add("merge", opt::MergePrograms);
+    passes.Add("schedule", [&stats](ir::Module &mod) {
+        stats.cyclesSaved += opt::Schedule(mod);
+    });
+    passes.Add("regalloc", [&stats](ir::Module &mod) {
+        stats.memorySpills += opt::AllocateRegisters(mod);
+    });
+    // reading values from the registers they were loaded into first would
+    // only lengthen live ranges before allocation
+    passes.Add("peephole", opt::Peephole);
+    passes.Add("constpool", opt::PoolConstants);
+    opts.passes = &passes;
 
+    // requests are compiled in forked children, so the code of unchanged
+    // statements is only kept between requests by the statement cache
+    std::string serverCacheDir = "";
+    if (server && cacheDir.empty()) {
+        std::string dirTemplate = std::filesystem::temp_directory_path() / "conv-server-XXXXXX";
+        if (mkdtemp(dirTemplate.data()) == nullptr) {
+            std::cerr << "could not create statement cache directory" << std::endl;
+            std::exit(1);
+        }
+        cacheDir = serverCacheDir = dirTemplate;
+    }
 
+    std::unique_ptr<StmtCache> cache;
+    if (!cacheDir.empty()) {
+        cache = std::make_unique<StmtCache>(cacheDir, cacheSize);
+        opts.cache = cache.get();
+    }
 
-    PrintVisitor *pvisitor = new PrintVisitor(std::cerr);
-    astRoot->Accept(pvisitor);
-    delete pvisitor;
+    if (server) {
+        int status = driver::Serve(socketPath, opts);
+        if (!serverCacheDir.empty()) {
+            std::filesystem::remove_all(serverCacheDir);
+        }
+        return status;
+    }
 
-    std::shared_ptr<CodeGen> codeGen = std::make_shared<CodeGen>();
-    codeGen->singleOut = singleOut;
+    if (!statsPath.empty()) {
+        opts.stats = &stats;
+    }
+    opts.printAST = LogLevel::INFO <= logLevel;
+    driver::Compile(std::cin, std::cout, opts);
 
-    if (!codeGen->singleOut) {
-        // PROGRAM to reset frame buffer to make it all 0
-        codeGen->ResetMem(std::cout);
+    if (cache) {
+        LOG(INFO, std::cerr << "statement cache: " << cache->hits << " hits, "
+                << cache->misses << " misses, " << cache->evictions
+                << " evictions" << std::endl);
     }
 
-    ASMGenVisitor *avisitor = new ASMGenVisitor(codeGen, std::cout);
-    astRoot->Accept(avisitor);
-    delete avisitor;
+    if (statsPath == "-") {
+        stats.WriteJSON(std::cerr);
+    } else if (!statsPath.empty()) {
+        std::ofstream statsFile {statsPath};
+        stats.WriteJSON(statsFile);
+    }
 
     if (!useStdout) {
         out.close();
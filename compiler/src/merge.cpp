@@ -0,0 +1,316 @@
+#include <algorithm>
+#include <cstdint>
+#include <iostream>
+#include <unordered_map>
+#include <vector>
+
+#include "constants.hpp"
+#include "ir.hpp"
+#include "log.hpp"
+#include "opt.hpp"
+
+namespace opt {
+
+namespace {
+
+using ir::Instr;
+using ir::Op;
+using ir::Reg;
+
+/// registers are 18 bits wide and so are data memory addresses
+constexpr int REG_BITS = 18;
+constexpr long MAX_VAL = (1L << REG_BITS) - 1;
+
+/// instructions added in front of every merged program, see Merge
+constexpr int PROLOGUE_INSTRS = 9;
+/// instructions added in front of every store of a merged program
+constexpr int STORE_INSTRS = 2;
+
+/// Values a register can hold, inclusive. By default any value.
+struct Interval {
+    long lo = 0;
+    long hi = MAX_VAL;
+
+    bool Overlaps(const Interval &other) const
+    {
+        return lo <= other.hi && other.lo <= hi;
+    }
+};
+
+/// [lo, hi] or any value if the bounds leave the range of a register, where
+/// the results wrap around
+Interval Bounded(long lo, long hi)
+{
+    if (lo < 0 || hi > MAX_VAL) {
+        return {};
+    }
+    return {lo, hi};
+}
+
+/// Data memory a program reads and writes, as ranges of the addresses of its
+/// loads and stores
+struct Effects {
+    /// whether the program can share a launch with others
+    bool mergeable;
+    std::vector<Interval> reads;
+    std::vector<Interval> writes;
+    int stores;
+};
+
+/// range of the value instr writes given the ranges of the registers
+Interval Eval(const Instr &instr, const std::unordered_map<Reg, Interval> &regs)
+{
+    auto range = [&](Reg r) {
+        auto it = regs.find(r);
+        return it == regs.end() ? Interval {} : it->second;
+    };
+    Interval a = range(instr.ra);
+    Interval b = range(instr.rb);
+    long imm = instr.imm;
+    switch (instr.op) {
+    case Op::ADD:
+        return Bounded(a.lo + b.lo, a.hi + b.hi);
+    case Op::SUB:
+        return Bounded(a.lo - b.hi, a.hi - b.lo);
+    case Op::ADDI:
+        return Bounded(a.lo + imm, a.hi + imm);
+    case Op::SUBI:
+        return Bounded(a.lo - imm, a.hi - imm);
+    case Op::SLLI:
+        return imm < REG_BITS ? Bounded(a.lo << imm, a.hi << imm) : Interval {};
+    case Op::SRLI:
+        return {a.lo >> imm, a.hi >> imm};
+    case Op::AND:
+        return {0, std::min(a.hi, b.hi)};
+    case Op::ANDI:
+        return {0, std::min(a.hi, imm)};
+    case Op::LUI:
+        return instr.tf18 ? Interval {} : Bounded(imm, imm);
+    default:
+        return {};
+    }
+}
+
+bool SetsPredicate(const Instr &instr)
+{
+    ir::Form form = ir::Info(instr.op).form;
+    return form == ir::Form::CMP_RR || form == ir::Form::CMP_RI;
+}
+
+Interval Join(const Interval &a, const Interval &b)
+{
+    return {std::min(a.lo, b.lo), std::max(a.hi, b.hi)};
+}
+
+Effects Analyse(const ir::Program &prog)
+{
+    Effects fx {.mergeable = prog.numBlocks > 0, .reads = {}, .writes = {}, .stores = 0};
+    // ranges over all lanes and over the lanes the predicate is set in, which
+    // predicated instructions see
+    std::unordered_map<Reg, Interval> all {
+        {ir::ZERO, {0, 0}},
+        {ir::BLOCK_IDX, {0, prog.numBlocks - 1}},
+        {ir::BLOCK_DIM_REG, {BLOCK_DIM, BLOCK_DIM}},
+        {ir::THREAD_IDX, {0, BLOCK_DIM - 1}},
+    };
+    std::unordered_map<Reg, Interval> active = all;
+    for (const ir::Block &block : prog.blocks) {
+        for (const Instr &instr : block.instrs) {
+            auto &regs = instr.pred ? active : all;
+            auto range = [&](Reg r) {
+                auto it = regs.find(r);
+                return it == regs.end() ? Interval {} : it->second;
+            };
+            // the order of the pixels on the screen is that of the launches
+            if (instr.op == Op::DISP || instr.op == Op::SPIX) {
+                fx.mergeable = false;
+            }
+            if (instr.op == Op::LW) {
+                fx.reads.push_back(range(instr.ra));
+            }
+            if (instr.op == Op::SW) {
+                fx.writes.push_back(range(instr.rb));
+                fx.stores++;
+            }
+            if (SetsPredicate(instr)) {
+                active = all;
+            }
+            Reg d = instr.Def();
+            if (d == ir::NO_REG) {
+                continue;
+            }
+            if (d < ir::FIRST_GP_REG) {
+                fx.mergeable = false;
+                continue;
+            }
+            Interval val = Eval(instr, active);
+            if (instr.pred) {
+                // the other lanes keep the old value
+                auto old = all.find(d);
+                all[d] = old == all.end() ? Interval {} : Join(old->second, val);
+            } else {
+                all[d] = Eval(instr, all);
+            }
+            active[d] = val;
+        }
+    }
+    return fx;
+}
+
+bool Overlap(const std::vector<Interval> &a, const std::vector<Interval> &b)
+{
+    return std::any_of(a.begin(), a.end(), [&](const Interval &x) {
+        return std::any_of(b.begin(), b.end(),
+                [&](const Interval &y) { return x.Overlaps(y); });
+    });
+}
+
+/// whether later can run at the same time as earlier without changing what
+/// either of them reads or leaves in memory
+bool Independent(const Effects &earlier, const Effects &later)
+{
+    return !Overlap(earlier.writes, later.reads) && !Overlap(earlier.writes, later.writes)
+        && !Overlap(earlier.reads, later.writes);
+}
+
+/// Program running every program of group on its own range of block
+/// indices, in order. Every block runs all of them: each reads its block
+/// index relative to the start of its range, and its stores go to
+/// DISCARD_ADDR in the blocks outside of it, so that computing a store
+/// address by a block of another program has no effect.
+ir::Program Merge(const std::vector<ir::Program *> &group)
+{
+    ir::Program merged {.numBlocks = 0, .blocks = {}};
+    Reg base = ir::VREG_BASE;
+    for (const ir::Program *prog : group) {
+        int first = merged.numBlocks;
+        int end = first + prog->numBlocks;
+        merged.numBlocks = end;
+
+        Reg idxReg = base++;
+        Reg inReg = base++;
+        Reg beforeReg = base++;
+        Reg selReg = base++;
+        Reg discardReg = base++;
+        std::vector<Instr> prologue {
+            ir::Make(Op::SUBI, {idxReg, ir::BLOCK_IDX}, first),
+            // 1 if the block is in [first, end): from the sign bits of
+            // blockIdx - end and blockIdx - first
+            ir::Make(Op::SUBI, {inReg, ir::BLOCK_IDX}, end),
+            ir::Make(Op::SRLI, {inReg, inReg}, REG_BITS - 1),
+            ir::Make(Op::SRLI, {beforeReg, idxReg}, REG_BITS - 1),
+            ir::Make(Op::SUB, {inReg, inReg, beforeReg}),
+            // store addresses are masked by sel, all ones in the range, and
+            // offset by discard, DISCARD_ADDR outside of it
+            ir::Make(Op::SUB, {selReg, ir::ZERO, inReg}),
+            ir::Make(Op::SUBI, {inReg, inReg}, 1),
+            ir::Make(Op::LUI, {discardReg}, DISCARD_ADDR),
+            ir::Make(Op::AND, {discardReg, discardReg, inReg}),
+        };
+
+        // registers for the store addresses follow the ones of the program
+        Reg top = base;
+        for (const ir::Block &block : prog->blocks) {
+            for (const Instr &instr : block.instrs) {
+                for (Reg r : {instr.rd, instr.ra, instr.rb}) {
+                    top = std::max(top, r - ir::VREG_BASE + base + 1);
+                }
+            }
+        }
+        auto rename = [&](Reg r) {
+            if (r == ir::BLOCK_IDX) {
+                return idxReg;
+            }
+            return r >= ir::VREG_BASE ? r - ir::VREG_BASE + base : r;
+        };
+        for (const ir::Block &block : prog->blocks) {
+            ir::Block out;
+            if (&block == &prog->blocks.front()) {
+                out.instrs = prologue;
+                prologue.clear();
+            }
+            for (Instr instr : block.instrs) {
+                // the merged program exits after the last of them
+                if (instr.op == Op::EXIT) {
+                    continue;
+                }
+                for (Reg *r : {&instr.rd, &instr.ra, &instr.rb}) {
+                    if (*r != ir::NO_REG) {
+                        *r = rename(*r);
+                    }
+                }
+                if (instr.op == Op::SW) {
+                    Reg addrReg = top++;
+                    out.instrs.push_back(ir::Make(Op::AND, {addrReg, instr.rb, selReg}));
+                    out.instrs.push_back(ir::Make(Op::ADD, {addrReg, addrReg, discardReg}));
+                    instr.rb = addrReg;
+                }
+                out.instrs.push_back(instr);
+            }
+            merged.blocks.push_back(std::move(out));
+        }
+        base = top;
+    }
+    merged.blocks.back().instrs.push_back(ir::Make(Op::EXIT, {}));
+    return merged;
+}
+
+} // namespace
+
+void MergePrograms(ir::Module &mod)
+{
+    std::vector<ir::Program> out;
+    std::vector<ir::Program *> group;
+    std::vector<Effects> groupFx;
+    std::size_t groupStart = 0;
+    int groupBlocks = 0;
+    int groupInstrs = 0;
+    auto flush = [&]() {
+        if (group.size() == 1) {
+            out.push_back(std::move(*group.front()));
+        } else if (group.size() > 1) {
+            out.push_back(Merge(group));
+            LOG(INFO, std::cerr << "merge: programs " << groupStart << " to "
+                    << groupStart + group.size() - 1 << " run as one launch of "
+                    << groupBlocks << " blocks" << std::endl);
+        }
+        group.clear();
+        groupFx.clear();
+    };
+
+    for (std::size_t p = 0; p < mod.programs.size(); p++) {
+        ir::Program &prog = mod.programs[p];
+        Effects fx = Analyse(prog);
+        // the registers of a program are shared with its continuation
+        if (p + 1 < mod.programs.size()
+                && mod.programs[p + 1].numBlocks == ir::Program::CONTINUATION) {
+            fx.mergeable = false;
+        }
+        int instrs = prog.NumInstrs() + PROLOGUE_INSTRS + STORE_INSTRS * fx.stores;
+        // a launch of up to NUM_THREADS blocks keeps every block busy at
+        // once; spill code added later has to fit, too
+        bool fits = fx.mergeable && !group.empty()
+            && groupBlocks + prog.numBlocks <= NUM_THREADS
+            && groupInstrs + instrs <= MAX_INSTR / 2
+            && std::all_of(groupFx.begin(), groupFx.end(),
+                    [&](const Effects &earlier) { return Independent(earlier, fx); });
+        if (!fits) {
+            flush();
+            if (!fx.mergeable) {
+                out.push_back(std::move(prog));
+                continue;
+            }
+            groupStart = p;
+            groupBlocks = 0;
+            groupInstrs = 0;
+        }
+        group.push_back(&prog);
+        groupFx.push_back(std::move(fx));
+        groupBlocks += prog.numBlocks;
+        groupInstrs += instrs;
+    }
+    flush();
+    mod.programs = std::move(out);
+}
+
+} // namespace opt
@@ -0,0 +1,227 @@
+#include <cstring>
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <charconv>
+#include <climits>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "codegen.hpp"
+#include "constants.hpp"
+#include "npy.hpp"
+
+namespace npy {
+
+namespace {
+
+constexpr std::string_view NPY_MAGIC = "\x93NUMPY";
+
+/// read-only mapping of a whole file which is unmapped when it goes out of
+/// scope
+class MappedFile
+{
+public:
+    MappedFile(const std::string &path)
+        : data_ {nullptr}, size_ {0}
+    {
+        int fd = open(path.c_str(), O_RDONLY);
+        if (fd < 0) {
+            return;
+        }
+        struct stat st;
+        if (fstat(fd, &st) == 0 && st.st_size > 0) {
+            void *p = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (p != MAP_FAILED) {
+                data_ = static_cast<const char *>(p);
+                size_ = st.st_size;
+            }
+        }
+        close(fd);
+    }
+
+    ~MappedFile()
+    {
+        if (data_ != nullptr) {
+            munmap(const_cast<char *>(data_), size_);
+        }
+    }
+
+    MappedFile(const MappedFile &) = delete;
+    MappedFile &operator=(const MappedFile &) = delete;
+
+    const char *data_;
+    std::size_t size_;
+};
+
+uint32_t ReadU32(const char *p)
+{
+    const unsigned char *u = reinterpret_cast<const unsigned char *>(p);
+    return u[0] | (u[1] << 8) | (u[2] << 16) | (static_cast<uint32_t>(u[3]) << 24);
+}
+
+/// value following 'key': in the header dictionary of an .npy file
+std::string_view HeaderValue(std::string_view header, std::string_view key)
+{
+    std::string quoted = "'";
+    quoted += key;
+    quoted += '\'';
+    std::size_t pos = header.find(quoted);
+    if (pos == std::string_view::npos) {
+        return {};
+    }
+    pos = header.find(':', pos);
+    if (pos == std::string_view::npos) {
+        return {};
+    }
+    pos = header.find_first_not_of(' ', pos + 1);
+    if (pos == std::string_view::npos) {
+        return {};
+    }
+    std::size_t end = header[pos] == '(' ? header.find(')', pos) + 1
+                                         : header.find_first_of(",}", pos);
+    return header.substr(pos, end - pos);
+}
+
+/// error message if dim cannot be the size of a dimension
+std::string CheckDim(long long dim)
+{
+    if (dim <= 0 || dim > INT_MAX) {
+        return "invalid dimension " + std::to_string(dim) + " in shape";
+    }
+    return "";
+}
+
+std::string ParseShape(std::string_view tuple, std::vector<int> &shape)
+{
+    const char *p = tuple.data() + 1;
+    const char *end = tuple.data() + tuple.size() - 1;
+    while (p < end) {
+        while (p < end && (*p == ' ' || *p == ',')) {
+            p++;
+        }
+        if (p == end) {
+            break;
+        }
+        long long dim;
+        auto [next, ec] = std::from_chars(p, end, dim);
+        if (ec != std::errc {}) {
+            return "malformed shape " + std::string(tuple);
+        }
+        std::string err = CheckDim(dim);
+        if (!err.empty()) {
+            return err;
+        }
+        shape.push_back(dim);
+        p = next;
+    }
+    return "";
+}
+
+} // namespace
+
+std::string LoadTF18(const std::string &path, std::vector<int> &shape,
+        std::vector<uint32_t> &words)
+{
+    MappedFile file {path};
+    if (file.data_ == nullptr) {
+        return "could not map file '" + path + "'";
+    }
+
+    const char *data;
+    std::size_t elementSize = sizeof(float);
+    bool fortranOrder = false;
+    std::string_view buf {file.data_, file.size_};
+    if (buf.starts_with(NPY_MAGIC)) {
+        if (buf.size() < 10) {
+            return "truncated .npy header in '" + path + "'";
+        }
+        int major = static_cast<unsigned char>(buf[6]);
+        std::size_t headerStart = major == 1 ? 10 : 12;
+        std::size_t headerLen = major == 1
+            ? static_cast<unsigned char>(buf[8]) | (static_cast<unsigned char>(buf[9]) << 8)
+            : ReadU32(buf.data() + 8);
+        if (buf.size() < headerStart + headerLen) {
+            return "truncated .npy header in '" + path + "'";
+        }
+        std::string_view header = buf.substr(headerStart, headerLen);
+
+        std::string_view descr = HeaderValue(header, "descr");
+        if (descr == "'<f4'") {
+            elementSize = sizeof(float);
+        } else if (descr == "'<f8'") {
+            elementSize = sizeof(double);
+        } else {
+            return "unsupported .npy dtype " + std::string(descr)
+                + " (only '<f4' and '<f8')";
+        }
+        fortranOrder = HeaderValue(header, "fortran_order") == "True";
+        std::string_view shapeTuple = HeaderValue(header, "shape");
+        if (shapeTuple.empty()) {
+            return "missing shape in .npy header of '" + path + "'";
+        }
+        std::string err = ParseShape(shapeTuple, shape);
+        if (!err.empty()) {
+            return err + " of '" + path + "'";
+        }
+        data = buf.data() + headerStart + headerLen;
+    } else {
+        if (buf.size() < 4 || buf.size() < 4 + 4 * std::size_t {ReadU32(buf.data())}) {
+            return "truncated raw matrix header in '" + path + "'";
+        }
+        uint32_t dims = ReadU32(buf.data());
+        for (uint32_t i = 0; i < dims; i++) {
+            uint32_t dim = ReadU32(buf.data() + 4 + 4 * i);
+            std::string err = CheckDim(dim);
+            if (!err.empty()) {
+                return err + " of '" + path + "'";
+            }
+            shape.push_back(dim);
+        }
+        data = buf.data() + 4 + 4 * dims;
+    }
+
+    if (shape.size() > 2) {
+        return "only matrices with up to 2 dimensions can be loaded but '"
+            + path + "' has " + std::to_string(shape.size());
+    }
+    while (shape.size() < 2) {
+        shape.insert(shape.begin(), 1);
+    }
+
+    // the padded array has to fit into data memory, which also keeps the
+    // element count from overflowing
+    std::size_t paddedCols = (static_cast<std::size_t>(shape[1]) + BLOCK_DIM - 1)
+        / BLOCK_DIM * BLOCK_DIM;
+    if (static_cast<std::size_t>(shape[0]) > DISCARD_ADDR / (2 * paddedCols)) {
+        return "'" + path + "' with shape " + CodeGen::ShapeToStr(shape)
+            + " does not fit into data memory";
+    }
+    std::size_t size = static_cast<std::size_t>(shape[0]) * shape[1];
+    if (static_cast<std::size_t>(buf.data() + buf.size() - data) < size * elementSize) {
+        return "'" + path + "' holds fewer elements than its shape "
+            + CodeGen::ShapeToStr(shape) + " needs";
+    }
+
+    int rows = shape[0];
+    int cols = shape[1];
+    words = CodeGen::PackTF18(shape, [&](int i) {
+        // file index of the i-th element in row-major order
+        std::size_t idx = fortranOrder ? (i % cols) * rows + i / cols : i;
+        if (elementSize == sizeof(float)) {
+            float f;
+            std::memcpy(&f, data + idx * sizeof(float), sizeof(float));
+            return static_cast<double>(f);
+        }
+        double d;
+        std::memcpy(&d, data + idx * sizeof(double), sizeof(double));
+        return d;
+    });
+    return "";
+}
+
+} // namespace npy
@@ -4,7 +4,9 @@
 #include <tuple>
 #include <istream>
 
+#include "constants.hpp"
 #include "lex.hpp"
+#include "npy.hpp"
 #include "parser.hpp"
 
 namespace parse {
@@ -15,9 +17,9 @@ static void parsingError(int lineNo, std::string msg)
     std::exit(1);
 }
 
-std::shared_ptr<ASTNode> ParseFac(std::istream &inStream)
+NodeId ParseFac(lex::TokenStream &tokens, AST &ast)
 {
-    auto [opType, lineNo, val] = lex::Lex(inStream); // int
+    auto [opType, lineNo, val] = tokens.Next(); // int
     if (opType == lex::Token::X || opType == lex::Token::Y
             || opType == lex::Token::VARNAME) {
         if (opType == lex::Token::VARNAME &&
@@ -27,210 +29,211 @@ std::shared_ptr<ASTNode> ParseFac(std::istream &inStream)
                     "variable names");
         }
         std::string name = std::get<std::string>(val);
-        return std::make_shared<VarNode>(std::get<std::string>(val));
+        return ast.AddVar(name);
     } else if (opType == lex::Token::REAL) { // real
-        return std::make_shared<RealConstNode>(std::get<double>(val));
+        return ast.AddConst(std::get<double>(val));
     } else if (opType == lex::Token::INT) { // int
-        return std::make_shared<RealConstNode>(static_cast<double>(std::get<int>(val)));
+        return ast.AddConst(static_cast<double>(std::get<int>(val)));
     } else if (opType == lex::Token::LROUND_BRACK) { // ( expr )
-        std::shared_ptr<ASTNode> expr = ParseExpr(inStream);
-        auto [t, ln, v] = lex::Lex(inStream);
+        NodeId expr = ParseExpr(tokens, ast);
+        auto [t, ln, v] = tokens.Next();
         if (t != lex::Token::RROUND_BRACK) {
             parsingError(ln, "expected ')'");
         }
         return expr;
     } else if (opType == lex::Token::MINUS) {
-        std::shared_ptr<ASTNode> expr = ParseTerm(inStream);
-        return std::make_shared<UnaryExprNode>(CodeGen::UnaryOp::MINUS, expr);
+        NodeId expr = ParseTerm(tokens, ast);
+        return ast.AddUnaryExpr(CodeGen::UnaryOp::MINUS, expr);
     } else if (opType == lex::Token::VERT_LINE) { // |shape_arr|[val_arr]
         std::vector<int> shape;
 
         lex::Token t;
         int ln;
         lex::LexType v;
-        for (std::tie(t, ln, v) = lex::Lex(inStream);
+        for (std::tie(t, ln, v) = tokens.Next();
                 t != lex::Token::VERT_LINE;
-                std::tie(t, ln, v) = lex::Lex(inStream)) {
+                std::tie(t, ln, v) = tokens.Next()) {
             if (t != lex::Token::INT) {
                 parsingError(ln, "expected integer for shape list");
             }
             shape.push_back(std::get<int>(v));
-            std::tie(t, ln, v) = lex::Lex(inStream);
+            std::tie(t, ln, v) = tokens.Next();
             if (t == lex::Token::VERT_LINE) {
-                std::tie(t, ln, v) = lex::Lex(inStream);
+                std::tie(t, ln, v) = tokens.Next();
                 break;
             } else if (t != lex::Token::COMMA) {
                 parsingError(ln, "expected comma to separate shape list values");
             }
         }
 
-        std::vector<double> vals;
         if (t != lex::Token::LSQUARE_BRACK) {
             parsingError(ln, "expected [ to initialise array literal got '"
                     + std::get<std::string>(v) + "'");
         }
-        for (std::tie(t, ln, v) = lex::Lex(inStream);
-                t != lex::Token::RSQUARE_BRACK;
-                std::tie(t, ln, v) = lex::Lex(inStream)) {
-            bool neg = false;
-            if (t == lex::Token::MINUS) {
-                neg = true;
-                std::tie(t, ln, v) = lex::Lex(inStream);
+
+        if (shape.empty()) {
+            parsingError(ln, "array literal needs at least one dimension");
+        }
+        // same bound as npy::LoadTF18: every dimension but the first is
+        // padded to BLOCK_DIM and each element takes 2 words
+        std::size_t numElements = shape[0];
+        std::size_t paddedCols = 1;
+        for (std::size_t d = 0; d < shape.size(); d++) {
+            if (shape[d] <= 0) {
+                parsingError(ln, "invalid dimension " + std::to_string(shape[d])
+                        + " in array literal shape");
             }
-            if (t != lex::Token::REAL) {
-                parsingError(ln, "expected double for array literal value");
+            if (d == 0 && shape.size() > 1) {
+                continue;
             }
-            if (neg) {
-                vals.push_back(-std::get<double>(v));
-            } else {
-                vals.push_back(std::get<double>(v));
-            }
-            std::tie(t, ln, v) = lex::Lex(inStream);
-            if (t == lex::Token::RSQUARE_BRACK) {
+            std::size_t padded = (static_cast<std::size_t>(shape[d]) + BLOCK_DIM - 1)
+                / BLOCK_DIM * BLOCK_DIM;
+            if (paddedCols > DISCARD_ADDR / (2 * padded)) {
+                paddedCols = DISCARD_ADDR + 1;
                 break;
-            } else if (t != lex::Token::COMMA) {
-                parsingError(ln, "expected comma to separate array literal values");
             }
+            paddedCols *= padded;
+            if (d > 0) {
+                numElements *= shape[d];
+            }
+        }
+        std::size_t rows = shape.size() > 1 ? shape[0] : 1;
+        if (paddedCols > DISCARD_ADDR || rows > DISCARD_ADDR / (2 * paddedCols)) {
+            parsingError(ln, "array literal of shape " + CodeGen::ShapeToStr(shape)
+                    + " does not fit into data memory");
+        }
+        std::vector<double> vals;
+        vals.reserve(numElements);
+        std::string err = tokens.ScanRealList(vals, ln);
+        if (!err.empty()) {
+            parsingError(ln, err);
+        }
+        if (vals.size() != numElements) {
+            parsingError(ln, "array literal of shape " + CodeGen::ShapeToStr(shape)
+                    + " needs " + std::to_string(numElements) + " values but got "
+                    + std::to_string(vals.size()));
         }
-        return std::make_shared<ArrayLiteralNode>(std::move(shape), std::move(vals));
+        return ast.AddArrayLiteral(shape, vals);
     // TODO make this an else if with a function that checks if something is
     // a unary function
     } else { // fn ( expr )
-        auto [t1, ln1, v1] = lex::Lex(inStream);
+        auto [t1, ln1, v1] = tokens.Next();
         if (t1 != lex::Token::LROUND_BRACK) {
             parsingError(ln1, "expected '(' for unary function");
         }
-        std::shared_ptr<ASTNode> expr = ParseExpr(inStream);
-        auto [t2, ln2, v2] = lex::Lex(inStream);
+        NodeId expr = ParseExpr(tokens, ast);
+        auto [t2, ln2, v2] = tokens.Next();
         if (t2 != lex::Token::RROUND_BRACK) {
             parsingError(ln2, "expected ')' for unary function but got '" + std::get<std::string>(v2) + "'");
         }
-        return std::make_shared<UnaryExprNode>(std::get<CodeGen::UnaryOp>(val), expr);
+        return ast.AddUnaryExpr(std::get<CodeGen::UnaryOp>(val), expr);
     }
 }
 
-std::shared_ptr<ASTNode> ParsePowRHS(std::istream &inStream,
-        std::shared_ptr<ASTNode> lhsOp)
+NodeId ParsePowRHS(lex::TokenStream &tokens, AST &ast,
+        NodeId lhsOp)
 {
-    int oldPos = inStream.tellg();
-    auto [opType, lineNo, val] = lex::Lex(inStream);
+    auto [opType, lineNo, val] = tokens.Peek();
     if (opType == lex::Token::POW) {
-        auto [t, ln, v] = lex::Lex(inStream);
+        tokens.Next();
+        auto [t, ln, v] = tokens.Next();
         if (t != lex::Token::INT) {
             parsingError(ln, "expected integer power");
         }
         int pow = std::get<int>(v);
-        std::shared_ptr<ASTNode> topExpr = lhsOp;
-        for (int i = 1; i < pow; i++) {
-            topExpr = std::make_shared<BinaryExprNode>(CodeGen::BinaryOp::MULT,
-                    topExpr, lhsOp);
-        }
-        return topExpr;
+        return pow < 2 ? lhsOp : ast.AddPow(lhsOp, pow);
     } else if (opType == lex::Token::TRANSPOSE) {
-        return std::make_shared<UnaryExprNode>(CodeGen::UnaryOp::TRANSPOSE, lhsOp);
+        tokens.Next();
+        return ast.AddUnaryExpr(CodeGen::UnaryOp::TRANSPOSE, lhsOp);
     } else {
-        if (inStream.eof()) {
-            inStream.clear();
-        }
-        inStream.seekg(oldPos);
         return lhsOp;
     }
 }
 
 
-std::shared_ptr<ASTNode> ParsePow(std::istream &inStream)
+NodeId ParsePow(lex::TokenStream &tokens, AST &ast)
 {
-    std::shared_ptr<ASTNode> op1 = ParseFac(inStream);
-    return ParsePowRHS(inStream, op1);
+    NodeId op1 = ParseFac(tokens, ast);
+    return ParsePowRHS(tokens, ast, op1);
 }
 
 
-std::shared_ptr<ASTNode> ParseTermRHS(std::istream &inStream,
-        std::shared_ptr<ASTNode> lhsOp)
+NodeId ParseTermRHS(lex::TokenStream &tokens, AST &ast,
+        NodeId lhsOp)
 {
-    int oldPos = inStream.tellg();
-    auto [opType, lineNo, val] = lex::Lex(inStream);
+    auto [opType, lineNo, val] = tokens.Peek();
     if (opType == lex::Token::MULT || opType == lex::Token::DIV
         || opType == lex::Token::DOT) {
-        std::shared_ptr<ASTNode> rhsOp = ParsePow(inStream); 
-        std::shared_ptr<ASTNode> binExpr =
-            std::make_shared<BinaryExprNode>(std::get<CodeGen::BinaryOp>(val),
-                lhsOp, rhsOp);
-        return ParseTermRHS(inStream, binExpr);
+        tokens.Next();
+        NodeId rhsOp = ParsePow(tokens, ast); 
+        NodeId binExpr =
+            ast.AddBinExpr(std::get<CodeGen::BinaryOp>(val), lhsOp, rhsOp);
+        return ParseTermRHS(tokens, ast, binExpr);
     } else {
-        if (inStream.eof()) {
-            inStream.clear();
-        }
-        inStream.seekg(oldPos);
         return lhsOp;
     }
 }
 
 
-std::shared_ptr<ASTNode> ParseTerm(std::istream &inStream)
+NodeId ParseTerm(lex::TokenStream &tokens, AST &ast)
 {
-    std::shared_ptr<ASTNode> op1 = ParsePow(inStream);
-    return ParseTermRHS(inStream, op1);
+    NodeId op1 = ParsePow(tokens, ast);
+    return ParseTermRHS(tokens, ast, op1);
 }
 
-std::shared_ptr<ASTNode> ParseExprRHS(std::istream &inStream,
-        std::shared_ptr<ASTNode> lhsOp)
+NodeId ParseExprRHS(lex::TokenStream &tokens, AST &ast,
+        NodeId lhsOp)
 {
-    int oldPos = inStream.tellg();
-    auto [opType, lineNo, val] = lex::Lex(inStream);
+    auto [opType, lineNo, val] = tokens.Peek();
     if (opType == lex::Token::PLUS || opType == lex::Token::MINUS) {
-        std::shared_ptr<ASTNode> rhsOp = ParseTerm(inStream); 
-        std::shared_ptr<ASTNode> binExpr =
-            std::make_shared<BinaryExprNode>(std::get<CodeGen::BinaryOp>(val),
-                lhsOp, rhsOp);
-        return ParseExprRHS(inStream, binExpr);
+        tokens.Next();
+        NodeId rhsOp = ParseTerm(tokens, ast); 
+        NodeId binExpr =
+            ast.AddBinExpr(std::get<CodeGen::BinaryOp>(val), lhsOp, rhsOp);
+        return ParseExprRHS(tokens, ast, binExpr);
     } else {
-        if (inStream.eof()) {
-            inStream.clear();
-        }
-        inStream.seekg(oldPos);
         return lhsOp;
     }
 }
 
-std::shared_ptr<ASTNode> ParseExpr(std::istream &inStream)
+NodeId ParseExpr(lex::TokenStream &tokens, AST &ast)
 {
-    std::shared_ptr<ASTNode> op1 = ParseTerm(inStream);
-    return ParseExprRHS(inStream, op1);
+    NodeId op1 = ParseTerm(tokens, ast);
+    return ParseExprRHS(tokens, ast, op1);
 }
 
-std::shared_ptr<ASTNode> ParseStatement(std::istream &inStream)
+NodeId ParseStatement(lex::TokenStream &tokens, AST &ast)
 {
-    auto [opType, lineNo, val] = lex::Lex(inStream);
+    auto [opType, lineNo, val] = tokens.Next();
     if (opType == lex::Token::PLOT) {
-        auto [t, ln, v] = lex::Lex(inStream);
+        auto [t, ln, v] = tokens.Next();
         if (t != lex::Token::VARNAME) {
             parsingError(ln, "expected variable name for .plot first argument");
         }
         std::string varName = std::get<std::string>(v);
 
-        std::tie(t, ln, v) = lex::Lex(inStream);
+        std::tie(t, ln, v) = tokens.Next();
         if (t != lex::Token::REAL) {
             parsingError(ln, "expected real for minimum of .plot as second argument");
         }
         double min = std::get<double>(v);
 
-        std::tie(t, ln, v) = lex::Lex(inStream);
+        std::tie(t, ln, v) = tokens.Next();
         if (t != lex::Token::REAL) {
             parsingError(ln, "expected real for maximum of .plot as third argument");
         }
         double max = std::get<double>(v);
 
-        return std::make_shared<PlotStatement>(varName, min, max);
+        return ast.AddPlot(varName, min, max);
     } else if (opType == lex::Token::PLOTXY) {
         // need 3 angles
         std::vector<double> angles {};
         for (int i = 0; i < 3; i++) {
-            auto [t, ln, v] = lex::Lex(inStream);
+            auto [t, ln, v] = tokens.Next();
             bool neg = false;
             if (t == lex::Token::MINUS) {
                 neg = true;
-                std::tie(t, ln, v) = lex::Lex(inStream);
+                std::tie(t, ln, v) = tokens.Next();
             }
             if (t != lex::Token::REAL && t != lex::Token::INT) {
                 parsingError(lineNo, "expected 'plotxy angleX angleY angleZ xyExpr'");
@@ -244,16 +247,15 @@ std::shared_ptr<ASTNode> ParseStatement(std::istream &inStream)
                 angles[angles.size()-1] *= -1;
             }
         }
-        std::shared_ptr<ASTNode> xyExpr = ParseExpr(inStream);
-        return std::make_shared<PlotXYStatement>(angles[0], angles[1], angles[2],
-                xyExpr);
+        NodeId xyExpr = ParseExpr(tokens, ast);
+        return ast.AddPlotXY(angles[0], angles[1], angles[2], xyExpr);
     } else if (opType == lex::Token::PLOTXY_SIMPLE) {
         double min, max;
         bool neg = false;
-        auto [t, ln, v] = lex::Lex(inStream);
+        auto [t, ln, v] = tokens.Next();
         if (t == lex::Token::MINUS) {
             neg = true;
-            std::tie(t, ln, v) = lex::Lex(inStream);
+            std::tie(t, ln, v) = tokens.Next();
         }
         if (t != lex::Token::REAL && t != lex::Token::INT) {
             parsingError(lineNo, "expected 'plotxy angleX angleY angleZ xyExpr'");
@@ -267,11 +269,11 @@ std::shared_ptr<ASTNode> ParseStatement(std::istream &inStream)
             min *= -1;
         }
 
-        std::tie(t, ln, v) = lex::Lex(inStream);
+        std::tie(t, ln, v) = tokens.Next();
         neg = false;
         if (t == lex::Token::MINUS) {
             neg = true;
-            std::tie(t, ln, v) = lex::Lex(inStream);
+            std::tie(t, ln, v) = tokens.Next();
         }
         if (t != lex::Token::REAL && t != lex::Token::INT) {
             parsingError(lineNo, "expected '.simple_plotxy min max xyExpr'");
@@ -285,23 +287,44 @@ std::shared_ptr<ASTNode> ParseStatement(std::istream &inStream)
             max *= -1;
         }
 
-        std::shared_ptr<ASTNode> xyExpr = ParseExpr(inStream);
-        return std::make_shared<PlotXYSimpleStatement>(min, max, xyExpr);
+        NodeId xyExpr = ParseExpr(tokens, ast);
+        return ast.AddPlotXYSimple(min, max, xyExpr);
     } else if (opType == lex::Token::PLOTX) {
-        std::shared_ptr<ASTNode> xExpr = ParseExpr(inStream);
-        return std::make_shared<PlotXStatement>(xExpr);
+        NodeId xExpr = ParseExpr(tokens, ast);
+        return ast.AddPlotX(xExpr);
+    } else if (opType == lex::Token::LOAD) {
+        auto [t1, ln1, v1] = tokens.Next();
+        if (t1 != lex::Token::VARNAME) {
+            parsingError(ln1, "expected variable name for .load first argument");
+        }
+        if (std::get<std::string>(v1) == "x" || std::get<std::string>(v1) == "y") {
+            parsingError(ln1, "x and y are reserved names and can't be used for "
+                    "variable names");
+        }
+        auto [t2, ln2, v2] = tokens.Next();
+        if (t2 != lex::Token::STRING) {
+            parsingError(ln2, "expected quoted file path for .load second argument");
+        }
+        std::string path = std::get<std::string>(v2);
+        std::vector<int> shape;
+        std::vector<uint32_t> words;
+        std::string err = npy::LoadTF18(path, shape, words);
+        if (!err.empty()) {
+            parsingError(ln2, err);
+        }
+        return ast.AddAssignment(std::get<std::string>(v1),
+                ast.AddLoadedArray(path, shape, words));
     } else if (opType == lex::Token::VARNAME) {
         if (std::get<std::string>(val) == "x" || std::get<std::string>(val) == "y") {
             parsingError(lineNo, "x and y are reserved names and can't be used for "
                     "variable names");
         }
-        auto [t, ln, v] = lex::Lex(inStream);
+        auto [t, ln, v] = tokens.Next();
         if (t != lex::Token::EQUAL) {
             parsingError(ln, "expected equality sign for assignment expression");
         }
-        std::shared_ptr<ASTNode> rhs = ParseExpr(inStream);
-        return std::make_shared<Assignment>(
-                std::get<std::string>(val), rhs);
+        NodeId rhs = ParseExpr(tokens, ast);
+        return ast.AddAssignment(std::get<std::string>(val), rhs);
 
     } else if (opType == lex::Token::ILLEGAL) {
         std::cerr << "Parsing error on line " << lineNo
@@ -315,19 +338,24 @@ std::shared_ptr<ASTNode> ParseStatement(std::istream &inStream)
     }
 }
 
-std::shared_ptr<ASTNode> ParseStatementList(std::istream &inStream)
+NodeId ParseStatementList(lex::TokenStream &tokens, AST &ast)
 {
-    std::shared_ptr<ASTNodeList> statementList =
-        std::make_shared<ASTNodeList>(ParseStatement(inStream));
-    while (inStream.peek() != EOF) {
-        statementList->Append(ParseStatement(inStream));
+    NodeId statementList = ast.AddList(ParseStatement(tokens, ast));
+    while (std::get<0>(tokens.Peek()) != lex::Token::_EOF_) {
+        ast.Append(statementList, ParseStatement(tokens, ast));
     }
     return statementList;
 }
 
-std::shared_ptr<ASTNode> Parse(std::istream &inStream)
+AST Parse(std::istream &inStream, std::chrono::nanoseconds *lexTime)
 {
-    return ParseStatementList(inStream);
+    lex::TokenStream tokens {inStream};
+    AST ast;
+    ast.root = ParseStatementList(tokens, ast);
+    if (lexTime != nullptr) {
+        *lexTime += tokens.LexTime();
+    }
+    return ast;
 }
 
 } // namespace parse
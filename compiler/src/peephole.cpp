@@ -0,0 +1,359 @@
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <iostream>
+#include <map>
+#include <unordered_map>
+#include <vector>
+
+#include "ir.hpp"
+#include "log.hpp"
+#include "opt.hpp"
+
+namespace opt {
+
+namespace {
+
+using ir::Instr;
+using ir::Op;
+using ir::Reg;
+
+/// What a register holds after a lui or a move. Facts established by a
+/// predicated instruction only hold in the lanes with the predicate set and
+/// so only for predicated readers until the predicate is set again.
+struct Fact {
+    enum class Kind {
+        CONST,
+        COPY,
+    };
+
+    Kind kind;
+    /// immediate of the lui or the register copied
+    std::int32_t val;
+    bool predOnly;
+    /// value of the predicate counter when established
+    int predEpoch;
+    /// position of the defining instruction
+    int pos;
+};
+
+bool SetsPredicate(const Instr &instr)
+{
+    ir::Form form = ir::Info(instr.op).form;
+    return form == ir::Form::CMP_RR || form == ir::Form::CMP_RI;
+}
+
+/// whether fact applies to reader while the predicate counter is at predEpoch
+bool Holds(const Fact &fact, const Instr &reader, int predEpoch)
+{
+    return !fact.predOnly || (reader.pred && fact.predEpoch == predEpoch);
+}
+
+bool IsAddImm(const Instr &instr)
+{
+    return (instr.op == Op::ADDI || instr.op == Op::SUBI) && instr.rd == instr.ra;
+}
+
+bool IsMove(const Instr &instr)
+{
+    return instr.op == Op::ADDI && instr.imm == 0;
+}
+
+bool Reads(const Instr &instr, Reg reg)
+{
+    return instr.ra == reg || instr.rb == reg || (instr.pred && instr.Def() == reg);
+}
+
+class BlockPeephole
+{
+public:
+    explicit BlockPeephole(std::vector<Instr> &instrs)
+        : instrs_ {instrs}, dead_(instrs.size(), false)
+    {}
+
+    /// Forward pass which reads constants and copies from the register they
+    /// were first loaded into and drops loads of values already in place
+    void PropagateCopies();
+
+    /// Merges addi/subi on a register with the next instruction using that
+    /// register if it is an addi/subi on it, too, as in StoreReg followed by
+    /// another store to a neighbouring address
+    void MergeAddImm();
+
+    /// removes the instructions marked dead and returns their number
+    int Compact();
+private:
+    void Invalidate(Reg reg);
+    Reg Source(Reg reg, const Instr &reader) const;
+
+    std::vector<Instr> &instrs_;
+    std::vector<bool> dead_;
+    std::unordered_map<Reg, Fact> facts_;
+    int predEpoch_ = 0;
+};
+
+/// forgets reg and every copy of it before reg is written
+void BlockPeephole::Invalidate(Reg reg)
+{
+    facts_.erase(reg);
+    std::erase_if(facts_, [reg](const auto &entry) {
+        return entry.second.kind == Fact::Kind::COPY && entry.second.val == reg;
+    });
+}
+
+/// register holding the same value as reg for reader which was written
+/// first, or reg itself
+Reg BlockPeephole::Source(Reg reg, const Instr &reader) const
+{
+    auto it = facts_.find(reg);
+    if (it == facts_.end() || !Holds(it->second, reader, predEpoch_)) {
+        return reg;
+    }
+    const Fact &fact = it->second;
+    if (fact.kind == Fact::Kind::COPY) {
+        return fact.val;
+    }
+    if (fact.val == 0) {
+        return ir::ZERO;
+    }
+    Reg best = reg;
+    int bestPos = fact.pos;
+    for (const auto &[other, otherFact] : facts_) {
+        if (otherFact.kind == Fact::Kind::CONST && otherFact.val == fact.val
+                && Holds(otherFact, reader, predEpoch_) && otherFact.pos < bestPos) {
+            best = other;
+            bestPos = otherFact.pos;
+        }
+    }
+    return best;
+}
+
+void BlockPeephole::PropagateCopies()
+{
+    for (int i = 0; i < static_cast<int>(instrs_.size()); i++) {
+        Instr &instr = instrs_[i];
+        if (instr.ra != ir::NO_REG) {
+            instr.ra = Source(instr.ra, instr);
+        }
+        if (instr.rb != ir::NO_REG) {
+            instr.rb = Source(instr.rb, instr);
+        }
+
+        Reg d = instr.Def();
+        auto known = facts_.find(d);
+        bool redundant = false;
+        if (known != facts_.end() && Holds(known->second, instr, predEpoch_)) {
+            const Fact &fact = known->second;
+            redundant = (instr.op == Op::LUI && fact.kind == Fact::Kind::CONST
+                    && fact.val == instr.imm)
+                || (IsMove(instr) && fact.kind == Fact::Kind::COPY && fact.val == instr.ra);
+        }
+        if (redundant || (IsMove(instr) && instr.ra == d)) {
+            dead_[i] = true;
+            continue;
+        }
+
+        if (SetsPredicate(instr)) {
+            predEpoch_++;
+        }
+        if (d == ir::NO_REG) {
+            continue;
+        }
+        Invalidate(d);
+        Fact fact {.kind = Fact::Kind::CONST, .val = 0, .predOnly = instr.pred,
+            .predEpoch = predEpoch_, .pos = i};
+        if (instr.op == Op::LUI) {
+            fact.val = instr.imm;
+            facts_[d] = fact;
+        } else if (IsMove(instr) && instr.ra != ir::ZERO) {
+            fact.kind = Fact::Kind::COPY;
+            fact.val = instr.ra;
+            facts_[d] = fact;
+        } else if (IsMove(instr)) {
+            facts_[d] = fact;
+        }
+    }
+}
+
+void BlockPeephole::MergeAddImm()
+{
+    for (int i = 0; i < static_cast<int>(instrs_.size()); i++) {
+        if (dead_[i] || !IsAddImm(instrs_[i])) {
+            continue;
+        }
+        Instr &first = instrs_[i];
+        Reg reg = first.rd;
+        bool predChanged = false;
+        for (int j = i + 1; j < static_cast<int>(instrs_.size()); j++) {
+            if (dead_[j]) {
+                continue;
+            }
+            Instr &next = instrs_[j];
+            if (Reads(next, reg) || next.Def() == reg) {
+                if (IsAddImm(next) && next.rd == reg && next.pred == first.pred
+                        && !(first.pred && predChanged)) {
+                    long total = (first.op == Op::ADDI ? first.imm : -first.imm)
+                        + (next.op == Op::ADDI ? next.imm : -next.imm);
+                    if (std::labs(total) <= MAX_IMM) {
+                        dead_[i] = true;
+                        bool pred = next.pred;
+                        next = ir::Make(total >= 0 ? Op::ADDI : Op::SUBI, {reg, reg},
+                                std::labs(total));
+                        next.pred = pred;
+                        dead_[j] = total == 0;
+                    }
+                }
+                break;
+            }
+            predChanged = predChanged || SetsPredicate(next);
+        }
+    }
+}
+
+int BlockPeephole::Compact()
+{
+    int removed = 0;
+    std::size_t k = 0;
+    std::erase_if(instrs_, [&](const Instr &) {
+        bool dead = dead_[k++];
+        removed += dead;
+        return dead;
+    });
+    dead_.assign(instrs_.size(), false);
+    return removed;
+}
+
+/// constant of a lui with the number of its loads in a program
+struct PoolEntry {
+    std::int32_t imm;
+    bool tf18;
+    int loads;
+};
+
+/// Rewrites the reads of registers loaded with a constant in pool to the
+/// register the constant is pinned in. The loads themselves are left to the
+/// removal of dead code as predicated ones may still be read in other lanes.
+void ReadFromPool(std::vector<Instr> &instrs, const std::map<std::int32_t, Reg> &pool)
+{
+    std::unordered_map<Reg, Fact> facts;
+    int predEpoch = 0;
+    for (int i = 0; i < static_cast<int>(instrs.size()); i++) {
+        Instr &instr = instrs[i];
+        for (Reg *r : {&instr.ra, &instr.rb}) {
+            auto it = facts.find(*r);
+            if (*r != ir::NO_REG && it != facts.end() && Holds(it->second, instr, predEpoch)) {
+                *r = it->second.val;
+            }
+        }
+        if (SetsPredicate(instr)) {
+            predEpoch++;
+        }
+        Reg d = instr.Def();
+        if (d == ir::NO_REG) {
+            continue;
+        }
+        facts.erase(d);
+        auto pinned = pool.find(instr.imm);
+        if (instr.op == Op::LUI && pinned != pool.end()) {
+            facts[d] = {.kind = Fact::Kind::COPY, .val = pinned->second,
+                .predOnly = instr.pred, .predEpoch = predEpoch, .pos = i};
+        }
+    }
+}
+
+} // namespace
+
+void Peephole(ir::Module &mod)
+{
+    for (std::size_t p = 0; p < mod.programs.size(); p++) {
+        ir::Program &prog = mod.programs[p];
+        if (prog.numBlocks == ir::Program::CONTINUATION) {
+            continue;
+        }
+        int before = prog.NumInstrs();
+        for (ir::Block &block : prog.blocks) {
+            BlockPeephole peephole {block.instrs};
+            peephole.PropagateCopies();
+            peephole.Compact();
+            peephole.MergeAddImm();
+            peephole.Compact();
+        }
+        RemoveDeadCode(prog);
+        int removed = before - prog.NumInstrs();
+        if (removed > 0) {
+            LOG(INFO, std::cerr << "peephole: program " << p << ": " << removed
+                    << " of " << before << " instructions removed" << std::endl);
+        }
+    }
+}
+
+void PoolConstants(ir::Module &mod)
+{
+    for (std::size_t p = 0; p < mod.programs.size(); p++) {
+        ir::Program &prog = mod.programs[p];
+        if (prog.numBlocks == ir::Program::CONTINUATION) {
+            continue;
+        }
+        std::vector<bool> busy(ir::NUM_PHYS_REGS, false);
+        std::vector<PoolEntry> consts;
+        for (const ir::Block &block : prog.blocks) {
+            for (const Instr &instr : block.instrs) {
+                for (Reg r : {instr.rd, instr.ra, instr.rb}) {
+                    if (r >= 0 && r < ir::NUM_PHYS_REGS) {
+                        busy[r] = true;
+                    }
+                }
+                if (instr.op != Op::LUI) {
+                    continue;
+                }
+                auto it = std::find_if(consts.begin(), consts.end(),
+                        [&](const PoolEntry &c) { return c.imm == instr.imm; });
+                if (it == consts.end()) {
+                    consts.push_back({.imm = instr.imm, .tf18 = instr.tf18, .loads = 1});
+                } else {
+                    it->loads++;
+                }
+            }
+        }
+        // a constant loaded once gains nothing from being pinned
+        std::erase_if(consts, [](const PoolEntry &c) { return c.loads < 2; });
+        std::stable_sort(consts.begin(), consts.end(),
+                [](const PoolEntry &a, const PoolEntry &b) { return a.loads > b.loads; });
+
+        std::map<std::int32_t, Reg> pool;
+        std::vector<Instr> loads;
+        for (Reg r = ir::FIRST_GP_REG; r < ir::FIRST_GP_REG + ir::NUM_GP_REGS
+                && pool.size() < consts.size(); r++) {
+            if (busy[r]) {
+                continue;
+            }
+            const PoolEntry &c = consts[pool.size()];
+            pool[c.imm] = r;
+            Instr load = ir::Make(Op::LUI, {r}, c.imm);
+            load.tf18 = c.tf18;
+            loads.push_back(load);
+        }
+        if (pool.empty()) {
+            continue;
+        }
+
+        ir::Program original = prog;
+        int before = prog.NumInstrs();
+        for (ir::Block &block : prog.blocks) {
+            ReadFromPool(block.instrs, pool);
+        }
+        std::vector<Instr> &first = prog.blocks.front().instrs;
+        first.insert(first.begin(), loads.begin(), loads.end());
+        RemoveDeadCode(prog);
+        int removed = before - prog.NumInstrs();
+        if (removed <= 0) {
+            prog = std::move(original);
+            continue;
+        }
+        LOG(INFO, std::cerr << "constpool: program " << p << ": " << pool.size()
+                << " constants pinned, " << removed << " of " << before
+                << " instructions removed" << std::endl);
+    }
+}
+
+} // namespace opt
@@ -0,0 +1,483 @@
+#include <algorithm>
+#include <bit>
+#include <cstdlib>
+#include <iostream>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include "constants.hpp"
+#include "ir.hpp"
+#include "log.hpp"
+#include "opt.hpp"
+
+namespace opt {
+
+namespace {
+
+using ir::Instr;
+using ir::Op;
+using ir::Reg;
+
+bool IsVirtual(Reg reg)
+{
+    return reg >= ir::VREG_BASE;
+}
+
+/// Positions of the first and the last instruction of a program referring to
+/// a virtual register. There are no branches so the register is live in
+/// between and nowhere else.
+struct Interval {
+    Reg vreg;
+    int start;
+    int end;
+    /// false for the registers of spill code, which must not be spilled again
+    bool spillable;
+};
+
+/// instructions computing the value of a virtual register from the registers
+/// with a fixed meaning and immediates only, ending with a write to it
+using Recipe = std::vector<Instr>;
+
+/// a spilled register is generated again before every read instead of being
+/// reloaded if its recipe is no longer than a reload
+constexpr std::size_t REMAT_INSTRS = 9;
+/// longest recipe used if there is no scratch memory left
+constexpr std::size_t MAX_RECIPE_INSTRS = MAX_INSTR / 4;
+
+/// Linear scan register allocation of a single program (Poletto and Sarkar).
+///
+/// A scan over the intervals sorted by start assigns each a free register
+/// and, if there is none, spills the interval ending last, preferring values
+/// which are cheap to compute again such as constants and coordinates. Those
+/// are rematerialised before every read. All others are stored to a slot in
+/// the scratch memory after every write and reloaded before every read.
+/// Either way the spilled value is only held in registers which live for a
+/// few instructions. The scan is repeated on the resulting code until nothing
+/// has to be spilled anymore.
+class ProgramAllocator
+{
+public:
+    /// a trial allocation neither logs nor exits on errors but fails
+    ProgramAllocator(ir::Program &prog, std::size_t index, bool trial = false);
+
+    /// returns the number of spilled registers
+    int Run();
+    bool Failed() const { return failed_; }
+private:
+    std::vector<Interval> Intervals() const;
+    /// fills recipes_ for the registers which can be rematerialised
+    void FindRecipes();
+    /// whether a spilled register would be rematerialised
+    bool Rematerialise(Reg reg) const;
+    bool HasSlot() const;
+    /// assigns registers to the intervals in assigned_ and returns the
+    /// virtual registers which were spilled
+    std::vector<Reg> Scan(std::vector<Interval> &intervals);
+    void InsertSpillCode(const std::vector<Reg> &spilled);
+    void Reload(Reg valReg, int slot, std::vector<Instr> &out);
+    void Store(Reg valReg, int slot, std::vector<Instr> &out);
+    /// emits the recipe of reg with fresh registers, returns the one written
+    Reg Remat(Reg reg, std::vector<Instr> &out);
+    /// address of the slot of the current thread in addrReg using tmpReg
+    void SlotAddr(Reg addrReg, Reg tmpReg, int slot, std::vector<Instr> &out);
+    Reg NewTemp();
+    /// replaces the virtual registers and returns the number of moves
+    /// which became redundant and were removed
+    int Assign();
+
+    /// source of the move at position pos if it is one
+    Reg MoveSource(int pos) const;
+
+    ir::Program &prog_;
+    std::size_t index_;
+    Reg nextReg_;
+    std::unordered_set<Reg> temps_;
+    std::unordered_map<Reg, Reg> assigned_;
+    std::unordered_map<Reg, Recipe> recipes_;
+    int slots_ = 0;
+    int numRemat_ = 0;
+    bool trial_;
+    bool failed_ = false;
+};
+
+ProgramAllocator::ProgramAllocator(ir::Program &prog, std::size_t index, bool trial)
+    : prog_ {prog}, index_ {index}, nextReg_ {ir::VREG_BASE}, trial_ {trial}
+{
+    for (const ir::Block &block : prog.blocks) {
+        for (const Instr &instr : block.instrs) {
+            nextReg_ = std::max({nextReg_, instr.rd + 1, instr.ra + 1, instr.rb + 1});
+        }
+    }
+}
+
+Reg ProgramAllocator::NewTemp()
+{
+    temps_.insert(nextReg_);
+    return nextReg_++;
+}
+
+std::vector<Interval> ProgramAllocator::Intervals() const
+{
+    std::unordered_map<Reg, std::size_t> index;
+    std::vector<Interval> intervals;
+    int pos = 0;
+    for (const ir::Block &block : prog_.blocks) {
+        for (const Instr &instr : block.instrs) {
+            // a predicated write keeps the value in the other threads, so it
+            // is a read as well which Def covers
+            for (Reg r : {instr.ra, instr.rb, instr.Def()}) {
+                if (!IsVirtual(r)) {
+                    continue;
+                }
+                auto [it, added] = index.emplace(r, intervals.size());
+                if (added) {
+                    intervals.push_back({.vreg = r, .start = pos, .end = pos,
+                        .spillable = !temps_.contains(r)});
+                } else {
+                    intervals[it->second].end = pos;
+                }
+            }
+            pos++;
+        }
+    }
+    return intervals;
+}
+
+Reg ProgramAllocator::MoveSource(int pos) const
+{
+    for (const ir::Block &block : prog_.blocks) {
+        if (pos < static_cast<int>(block.instrs.size())) {
+            const Instr &instr = block.instrs[pos];
+            return instr.op == Op::ADDI && instr.imm == 0 ? instr.ra : ir::NO_REG;
+        }
+        pos -= block.instrs.size();
+    }
+    return ir::NO_REG;
+}
+
+/// A register can be rematerialised if its writes are neither predicated nor
+/// loads, its value is only read by other instructions after the last write
+/// and these only read it and registers which can be rematerialised in turn.
+void ProgramAllocator::FindRecipes()
+{
+    recipes_.clear();
+    // in order of the writes
+    std::vector<std::pair<Reg, const Instr *>> writes;
+    std::unordered_set<Reg> read;
+    std::unordered_set<Reg> excluded;
+    for (const ir::Block &block : prog_.blocks) {
+        for (const Instr &instr : block.instrs) {
+            Reg d = instr.Def();
+            for (Reg r : {instr.ra, instr.rb}) {
+                if (IsVirtual(r) && r != d) {
+                    read.insert(r);
+                }
+            }
+            if (IsVirtual(d)) {
+                writes.emplace_back(d, &instr);
+                if (instr.pred || instr.op == Op::LW || read.contains(d)) {
+                    excluded.insert(d);
+                }
+            }
+        }
+    }
+
+    for (auto [d, instr] : writes) {
+        if (excluded.contains(d)) {
+            continue;
+        }
+        Recipe recipe = recipes_[d];
+        for (Reg r : {instr->ra, instr->rb}) {
+            if (!IsVirtual(r) || r == d) {
+                continue;
+            }
+            // all writes of r come before this read unless it is excluded
+            auto operand = recipes_.find(r);
+            if (operand == recipes_.end() || excluded.contains(r)) {
+                excluded.insert(d);
+                break;
+            }
+            recipe.insert(recipe.end(), operand->second.begin(), operand->second.end());
+        }
+        recipe.push_back(*instr);
+        if (recipe.size() > MAX_RECIPE_INSTRS) {
+            excluded.insert(d);
+        }
+        if (excluded.contains(d)) {
+            recipes_.erase(d);
+        } else {
+            recipes_[d] = std::move(recipe);
+        }
+    }
+}
+
+bool ProgramAllocator::HasSlot() const
+{
+    return prog_.numBlocks != ir::Program::CONTINUATION
+        && static_cast<long>(slots_ + 1) * 2 * BLOCK_DIM * prog_.numBlocks <= SCRATCH_SIZE;
+}
+
+bool ProgramAllocator::Rematerialise(Reg reg) const
+{
+    auto recipe = recipes_.find(reg);
+    return recipe != recipes_.end()
+        && (recipe->second.size() <= REMAT_INSTRS || !HasSlot());
+}
+
+std::vector<Reg> ProgramAllocator::Scan(std::vector<Interval> &intervals)
+{
+    std::sort(intervals.begin(), intervals.end(), [](const Interval &a, const Interval &b) {
+        return a.start != b.start ? a.start < b.start : a.vreg < b.vreg;
+    });
+    assigned_.clear();
+    // lowest register first
+    std::vector<Reg> free;
+    for (Reg r = ir::FIRST_GP_REG + ir::NUM_GP_REGS - 1; r >= ir::FIRST_GP_REG; r--) {
+        free.push_back(r);
+    }
+    // sorted by end
+    std::vector<const Interval *> active;
+    std::vector<Reg> spilled;
+
+    for (const Interval &cur : intervals) {
+        // a register read for the last time can be written by the same
+        // instruction
+        while (!active.empty() && active.front()->end <= cur.start) {
+            free.push_back(assigned_[active.front()->vreg]);
+            active.erase(active.begin());
+        }
+
+        if (free.empty()) {
+            // cheap to rematerialise first, then ending last
+            auto better = [this](const Interval &a, const Interval &b) {
+                bool rematA = Rematerialise(a.vreg);
+                bool rematB = Rematerialise(b.vreg);
+                return rematA != rematB ? rematA : a.end > b.end;
+            };
+            auto victim = active.end();
+            for (auto it = active.begin(); it != active.end(); ++it) {
+                if ((*it)->spillable && (victim == active.end() || better(**it, **victim))) {
+                    victim = it;
+                }
+            }
+            if (victim == active.end() && !cur.spillable) {
+                if (trial_) {
+                    failed_ = true;
+                    return {};
+                }
+                std::cerr << "register allocation: program " << index_
+                          << " needs more than " << ir::NUM_GP_REGS
+                          << " registers for a single instruction" << std::endl;
+                std::exit(1);
+            }
+            if (victim == active.end() || (cur.spillable && !better(**victim, cur))) {
+                spilled.push_back(cur.vreg);
+                continue;
+            }
+            spilled.push_back((*victim)->vreg);
+            free.push_back(assigned_[(*victim)->vreg]);
+            active.erase(victim);
+        }
+
+        // moves become redundant if both registers are the same
+        Reg source = MoveSource(cur.start);
+        auto hint = free.end();
+        if (IsVirtual(source) && assigned_.contains(source)) {
+            hint = std::find(free.begin(), free.end(), assigned_[source]);
+        }
+        if (hint == free.end()) {
+            hint = free.end() - 1;
+        }
+        assigned_[cur.vreg] = *hint;
+        free.erase(hint);
+        active.insert(std::upper_bound(active.begin(), active.end(), &cur,
+                [](const Interval *a, const Interval *b) { return a->end < b->end; }), &cur);
+    }
+    return spilled;
+}
+
+void ProgramAllocator::SlotAddr(Reg addrReg, Reg tmpReg, int slot, std::vector<Instr> &out)
+{
+    // laid out like arrays with one element per thread, see
+    // CodeGen::IndexIntoReg and CodeGen::StoreReg
+    int stride = 2 * BLOCK_DIM * prog_.numBlocks;
+    out.push_back(ir::Make(Op::LUI, {addrReg}, SCRATCH_ADDR + slot * stride));
+    out.push_back(ir::Make(Op::ADD, {addrReg, addrReg, ir::THREAD_IDX}));
+    out.push_back(ir::Make(Op::SLLI, {tmpReg, ir::BLOCK_IDX},
+                std::bit_width(static_cast<unsigned>(2 * BLOCK_DIM)) - 1));
+    out.push_back(ir::Make(Op::ADD, {addrReg, addrReg, tmpReg}));
+}
+
+void ProgramAllocator::Reload(Reg valReg, int slot, std::vector<Instr> &out)
+{
+    Reg addrReg = NewTemp();
+    SlotAddr(addrReg, valReg, slot, out);
+    out.push_back(ir::Make(Op::LW, {valReg, addrReg}));
+    out.push_back(ir::Make(Op::ADDI, {addrReg, addrReg}, BLOCK_DIM));
+    out.push_back(ir::Make(Op::LW, {addrReg, addrReg}));
+    out.push_back(ir::Make(Op::SLLI, {addrReg, addrReg}, 9));
+    out.push_back(ir::Make(Op::ADD, {valReg, valReg, addrReg}));
+}
+
+void ProgramAllocator::Store(Reg valReg, int slot, std::vector<Instr> &out)
+{
+    Reg addrReg = NewTemp();
+    Reg tmpReg = NewTemp();
+    SlotAddr(addrReg, tmpReg, slot, out);
+    out.push_back(ir::Make(Op::ANDI, {tmpReg, valReg}, (1 << 9) - 1));
+    out.push_back(ir::Make(Op::SW, {tmpReg, addrReg}));
+    out.push_back(ir::Make(Op::SRLI, {tmpReg, valReg}, 9));
+    out.push_back(ir::Make(Op::ADDI, {addrReg, addrReg}, BLOCK_DIM));
+    out.push_back(ir::Make(Op::SW, {tmpReg, addrReg}));
+}
+
+Reg ProgramAllocator::Remat(Reg reg, std::vector<Instr> &out)
+{
+    std::unordered_map<Reg, Reg> renamed;
+    for (Instr instr : recipes_.at(reg)) {
+        for (Reg *r : {&instr.rd, &instr.ra, &instr.rb}) {
+            if (IsVirtual(*r)) {
+                auto [it, added] = renamed.emplace(*r, ir::NO_REG);
+                if (added) {
+                    it->second = NewTemp();
+                }
+                *r = it->second;
+            }
+        }
+        out.push_back(instr);
+    }
+    return renamed.at(reg);
+}
+
+void ProgramAllocator::InsertSpillCode(const std::vector<Reg> &spilled)
+{
+    std::unordered_set<Reg> remat;
+    std::unordered_map<Reg, int> slots;
+    for (Reg r : spilled) {
+        if (Rematerialise(r)) {
+            remat.insert(r);
+            numRemat_++;
+        } else if (HasSlot()) {
+            slots[r] = slots_++;
+        } else if (trial_) {
+            failed_ = true;
+            return;
+        } else {
+            std::cerr << "register allocation: program " << index_ << " needs more than "
+                      << SCRATCH_SIZE << " words of scratch memory for spilled registers"
+                      << std::endl;
+            std::exit(1);
+        }
+    }
+    // spill code runs in all threads, predicated writes of a spilled
+    // register store the reloaded value again in the others
+    for (ir::Block &block : prog_.blocks) {
+        std::vector<Instr> out;
+        for (Instr instr : block.instrs) {
+            // all reads are rematerialised instead
+            if (remat.contains(instr.Def())) {
+                continue;
+            }
+            std::vector<std::pair<Reg, int>> stores;
+            std::unordered_map<Reg, Reg> reloaded;
+            for (Reg *r : {&instr.ra, &instr.rb}) {
+                if (remat.contains(*r) && !reloaded.contains(*r)) {
+                    reloaded[*r] = Remat(*r, out);
+                }
+                auto slot = slots.find(*r);
+                if (slot != slots.end() && !reloaded.contains(*r)) {
+                    reloaded[*r] = NewTemp();
+                    Reload(reloaded[*r], slot->second, out);
+                }
+                if (reloaded.contains(*r)) {
+                    *r = reloaded[*r];
+                }
+            }
+            Reg d = instr.Def();
+            auto slot = slots.find(d);
+            if (slot != slots.end()) {
+                Reg valReg;
+                if (reloaded.contains(d)) {
+                    valReg = reloaded[d];
+                } else {
+                    valReg = NewTemp();
+                    if (instr.pred) {
+                        Reload(valReg, slot->second, out);
+                    }
+                }
+                instr.rd = valReg;
+                stores.emplace_back(valReg, slot->second);
+            }
+            out.push_back(instr);
+            for (auto [valReg, s] : stores) {
+                Store(valReg, s, out);
+            }
+        }
+        block.instrs = std::move(out);
+    }
+}
+
+int ProgramAllocator::Assign()
+{
+    int removed = 0;
+    for (ir::Block &block : prog_.blocks) {
+        for (Instr &instr : block.instrs) {
+            for (Reg *r : {&instr.rd, &instr.ra, &instr.rb}) {
+                if (IsVirtual(*r)) {
+                    *r = assigned_.at(*r);
+                }
+            }
+        }
+        removed += std::erase_if(block.instrs, [](const Instr &instr) {
+            return instr.op == Op::ADDI && instr.imm == 0 && instr.rd == instr.ra;
+        });
+    }
+    return removed;
+}
+
+int ProgramAllocator::Run()
+{
+    int numSpilled = 0;
+    while (!failed_) {
+        FindRecipes();
+        std::vector<Interval> intervals = Intervals();
+        std::vector<Reg> spilled = Scan(intervals);
+        if (spilled.empty()) {
+            break;
+        }
+        numSpilled += spilled.size();
+        InsertSpillCode(spilled);
+    }
+    if (failed_) {
+        return numSpilled;
+    }
+    int removed = Assign();
+    if (!trial_ && (numSpilled > 0 || removed > 0)) {
+        LOG(INFO, std::cerr << "regalloc: program " << index_ << ": " << numSpilled
+                << " registers spilled, " << numRemat_ << " of them rematerialised, "
+                << removed << " moves removed" << std::endl);
+    }
+    return numSpilled;
+}
+
+} // namespace
+
+int AllocateRegisters(ir::Module &mod)
+{
+    int spilled = 0;
+    for (std::size_t p = 0; p < mod.programs.size(); p++) {
+        ProgramAllocator allocator {mod.programs[p], p};
+        spilled += allocator.Run();
+    }
+    return spilled;
+}
+
+bool TryAllocateRegisters(ir::Program &prog)
+{
+    ProgramAllocator allocator {prog, 0, true};
+    allocator.Run();
+    return !allocator.Failed();
+}
+
+} // namespace opt
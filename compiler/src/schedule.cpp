@@ -0,0 +1,397 @@
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <iostream>
+#include <tuple>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include "constants.hpp"
+#include "ir.hpp"
+#include "log.hpp"
+#include "opt.hpp"
+
+namespace opt {
+
+namespace {
+
+using ir::Instr;
+using ir::Op;
+using ir::Reg;
+
+/// functional units of a SIMD lane, see rtl/decode.sv and rtl/simd_lane.sv
+enum class Unit : std::uint8_t {
+    INT,    ///< int_fu, cvtfc_fu and memory reads
+    FADD,   ///< fadd_fu followed by fp_standardise
+    CORDIC, ///< cordic_fu followed by fp_standardise
+    STORE,  ///< queues of the mmu and read-modify-write of the memory banks
+    DISP,
+    NONE,
+};
+
+/// The register file is written 13 cycles after an instruction read its
+/// operands whichever unit computes the result. The pipelines are padded
+/// to the same length (resultRegs in rtl/simd_lane.sv) so that no two
+/// results arrive in the same cycle.
+constexpr int WRITEBACK_CYCLES = 13;
+/// cycles until a write is in its memory bank when no mmu queue is full:
+/// three queue stages and three bank stages
+constexpr int STORE_CYCLES = 7;
+
+struct Timing {
+    Unit unit;
+    /// cycles from reading the operands until the result can be read
+    int latency;
+};
+
+// indexed by Op
+constexpr std::array<Timing, static_cast<int>(Op::NOP) + 1> MACHINE_MODEL {{
+    // add sub mul div rem and or xor sll srl sra slt seq
+    {Unit::INT, WRITEBACK_CYCLES}, {Unit::INT, WRITEBACK_CYCLES},
+    {Unit::INT, WRITEBACK_CYCLES}, {Unit::INT, WRITEBACK_CYCLES},
+    {Unit::INT, WRITEBACK_CYCLES}, {Unit::INT, WRITEBACK_CYCLES},
+    {Unit::INT, WRITEBACK_CYCLES}, {Unit::INT, WRITEBACK_CYCLES},
+    {Unit::INT, WRITEBACK_CYCLES}, {Unit::INT, WRITEBACK_CYCLES},
+    {Unit::INT, WRITEBACK_CYCLES}, {Unit::INT, WRITEBACK_CYCLES},
+    {Unit::INT, WRITEBACK_CYCLES},
+    // addi subi muli divi remi andi ori xori slli srli srai slti seqi
+    {Unit::INT, WRITEBACK_CYCLES}, {Unit::INT, WRITEBACK_CYCLES},
+    {Unit::INT, WRITEBACK_CYCLES}, {Unit::INT, WRITEBACK_CYCLES},
+    {Unit::INT, WRITEBACK_CYCLES}, {Unit::INT, WRITEBACK_CYCLES},
+    {Unit::INT, WRITEBACK_CYCLES}, {Unit::INT, WRITEBACK_CYCLES},
+    {Unit::INT, WRITEBACK_CYCLES}, {Unit::INT, WRITEBACK_CYCLES},
+    {Unit::INT, WRITEBACK_CYCLES}, {Unit::INT, WRITEBACK_CYCLES},
+    {Unit::INT, WRITEBACK_CYCLES},
+    // lui
+    {Unit::INT, WRITEBACK_CYCLES},
+    // fadd fsub fmul fdiv fabs frcp fsqrt frsqrt fsin fcos flog fexp
+    {Unit::FADD, WRITEBACK_CYCLES}, {Unit::FADD, WRITEBACK_CYCLES},
+    {Unit::CORDIC, WRITEBACK_CYCLES}, {Unit::CORDIC, WRITEBACK_CYCLES},
+    {Unit::INT, WRITEBACK_CYCLES}, {Unit::CORDIC, WRITEBACK_CYCLES},
+    {Unit::CORDIC, WRITEBACK_CYCLES}, {Unit::CORDIC, WRITEBACK_CYCLES},
+    {Unit::CORDIC, WRITEBACK_CYCLES}, {Unit::CORDIC, WRITEBACK_CYCLES},
+    {Unit::CORDIC, WRITEBACK_CYCLES}, {Unit::CORDIC, WRITEBACK_CYCLES},
+    // fslt fseq
+    {Unit::FADD, WRITEBACK_CYCLES}, {Unit::FADD, WRITEBACK_CYCLES},
+    // cvtif cvtfi cvtfr cvtfc
+    {Unit::FADD, WRITEBACK_CYCLES}, {Unit::FADD, WRITEBACK_CYCLES},
+    {Unit::CORDIC, WRITEBACK_CYCLES}, {Unit::INT, WRITEBACK_CYCLES},
+    // lw sw spix
+    {Unit::INT, WRITEBACK_CYCLES}, {Unit::STORE, STORE_CYCLES},
+    {Unit::STORE, STORE_CYCLES},
+    // disp exit nop
+    {Unit::DISP, 0}, {Unit::NONE, 0}, {Unit::NONE, 0},
+}};
+
+const Timing &TimingOf(Op op)
+{
+    return MACHINE_MODEL[static_cast<int>(op)];
+}
+
+/// dependences through the predicate, data memory and the display are
+/// tracked like ones through registers with these keys
+constexpr Reg PRED_KEY = -2;
+constexpr Reg MEM_KEY = -3;
+constexpr Reg DISP_KEY = -4;
+
+bool SetsPredicate(const Instr &instr)
+{
+    ir::Form form = ir::Info(instr.op).form;
+    return form == ir::Form::CMP_RR || form == ir::Form::CMP_RI;
+}
+
+bool IsBarrier(const Instr &instr)
+{
+    return instr.op == Op::EXIT || instr.op == Op::NOP;
+}
+
+/// registers and keys read by instr. A predicated write keeps the value in
+/// the other threads, so it reads its destination as well.
+std::vector<Reg> ReadKeys(const Instr &instr)
+{
+    std::vector<Reg> keys;
+    for (Reg r : instr.Uses()) {
+        if (r != ir::NO_REG) {
+            keys.push_back(r);
+        }
+    }
+    if (instr.pred) {
+        keys.push_back(PRED_KEY);
+        if (instr.Def() != ir::NO_REG) {
+            keys.push_back(instr.Def());
+        }
+    }
+    if (instr.op == Op::LW || instr.op == Op::SPIX) {
+        keys.push_back(MEM_KEY);
+    }
+    return keys;
+}
+
+std::vector<Reg> DistinctReadKeys(const Instr &instr)
+{
+    std::vector<Reg> keys = ReadKeys(instr);
+    std::sort(keys.begin(), keys.end());
+    keys.erase(std::unique(keys.begin(), keys.end()), keys.end());
+    return keys;
+}
+
+std::vector<Reg> WriteKeys(const Instr &instr)
+{
+    std::vector<Reg> keys;
+    if (instr.Def() != ir::NO_REG) {
+        keys.push_back(instr.Def());
+    }
+    if (SetsPredicate(instr)) {
+        keys.push_back(PRED_KEY);
+    }
+    if (TimingOf(instr.op).unit == Unit::STORE) {
+        keys.push_back(MEM_KEY);
+    }
+    if (instr.op == Op::DISP) {
+        keys.push_back(DISP_KEY);
+    }
+    return keys;
+}
+
+/// Issue slots one thread takes for instrs. The device issues for each of
+/// its NUM_THREADS threads in turn, so an instruction whose operands are not
+/// written back by the time its thread comes round again waits for further
+/// rounds.
+long IssueSlots(const std::vector<Instr> &instrs)
+{
+    std::unordered_map<Reg, long> ready;
+    long cycle = 0;
+    for (const Instr &instr : instrs) {
+        for (Reg key : ReadKeys(instr)) {
+            auto it = ready.find(key);
+            if (it != ready.end() && it->second > cycle) {
+                long rounds = (it->second - cycle + NUM_THREADS - 1) / NUM_THREADS;
+                cycle += rounds * NUM_THREADS;
+            }
+        }
+        for (Reg key : WriteKeys(instr)) {
+            ready[key] = cycle + TimingOf(instr.op).latency;
+        }
+        cycle += NUM_THREADS;
+    }
+    return cycle / NUM_THREADS;
+}
+
+/// cycles the device takes for prog with its blocks issued NUM_THREADS at
+/// a time, or -1 if its registers cannot be allocated
+long EstimateCycles(ir::Program prog)
+{
+    if (!TryAllocateRegisters(prog)) {
+        return -1;
+    }
+    long slots = 0;
+    for (const ir::Block &block : prog.blocks) {
+        slots += IssueSlots(block.instrs);
+    }
+    long rounds = (prog.numBlocks + NUM_THREADS - 1) / NUM_THREADS;
+    return rounds * NUM_THREADS * slots;
+}
+
+/// List scheduler for the instructions of one basic block. Instructions are
+/// issued as soon as their operands are written back according to the
+/// machine model, in their original order otherwise, except that ones
+/// which would make more values live than there are registers are put off
+/// while there are others.
+class BlockScheduler
+{
+public:
+    explicit BlockScheduler(const std::vector<Instr> &instrs);
+
+    /// returns the positions of the instructions in the order of issue
+    std::vector<int> Run();
+private:
+    void AddEdge(int from, int to, bool data);
+    /// change in the number of live values if instruction i is issued next
+    int PressureDelta(int i) const;
+    void Issue(int i);
+
+    const std::vector<Instr> &instrs_;
+    /// successors of each instruction, with whether they read its result
+    std::vector<std::vector<std::pair<int, bool>>> succs_;
+    std::vector<int> numPreds_;
+    /// earliest cycle each instruction can read its operands
+    std::vector<long> readyCycle_;
+    std::vector<int> ready_;
+    /// unissued instructions reading each virtual register
+    std::unordered_map<Reg, int> readers_;
+    /// virtual registers written by an issued instruction and read by an
+    /// unissued one
+    std::unordered_set<Reg> live_;
+    long cycle_ = 0;
+};
+
+BlockScheduler::BlockScheduler(const std::vector<Instr> &instrs)
+    : instrs_ {instrs}, succs_(instrs.size()), numPreds_(instrs.size(), 0),
+      readyCycle_(instrs.size(), 0)
+{
+    std::unordered_map<Reg, int> lastWrite;
+    std::unordered_map<Reg, std::vector<int>> readsSinceWrite;
+    int barrier = -1;
+    for (int i = 0; i < static_cast<int>(instrs.size()); i++) {
+        const Instr &instr = instrs[i];
+        if (IsBarrier(instr)) {
+            for (int j = barrier + 1; j < i; j++) {
+                AddEdge(j, i, false);
+            }
+            barrier = i;
+            continue;
+        }
+        if (barrier >= 0) {
+            AddEdge(barrier, i, false);
+        }
+        for (Reg key : ReadKeys(instr)) {
+            auto write = lastWrite.find(key);
+            if (write != lastWrite.end()) {
+                AddEdge(write->second, i, true);
+            }
+            readsSinceWrite[key].push_back(i);
+        }
+        for (Reg key : WriteKeys(instr)) {
+            for (int j : readsSinceWrite[key]) {
+                if (j != i) {
+                    AddEdge(j, i, false);
+                }
+            }
+            auto write = lastWrite.find(key);
+            if (write != lastWrite.end()) {
+                AddEdge(write->second, i, false);
+            }
+            lastWrite[key] = i;
+            readsSinceWrite[key].clear();
+        }
+        for (Reg r : DistinctReadKeys(instr)) {
+            if (r >= ir::VREG_BASE) {
+                readers_[r]++;
+            }
+        }
+    }
+}
+
+void BlockScheduler::AddEdge(int from, int to, bool data)
+{
+    succs_[from].emplace_back(to, data);
+    numPreds_[to]++;
+}
+
+int BlockScheduler::PressureDelta(int i) const
+{
+    const Instr &instr = instrs_[i];
+    Reg d = instr.Def();
+    int delta = 0;
+    bool readsD = false;
+    for (Reg r : DistinctReadKeys(instr)) {
+        readsD = readsD || r == d;
+        // the last read ends the value unless it is written again
+        if (r >= ir::VREG_BASE && r != d && readers_.at(r) == 1 && live_.contains(r)) {
+            delta--;
+        }
+    }
+    if (d >= ir::VREG_BASE) {
+        int laterReaders = readers_.contains(d) ? readers_.at(d) - readsD : 0;
+        delta += (laterReaders > 0) - live_.contains(d);
+    }
+    return delta;
+}
+
+void BlockScheduler::Issue(int i)
+{
+    const Instr &instr = instrs_[i];
+    for (Reg r : DistinctReadKeys(instr)) {
+        if (r >= ir::VREG_BASE && --readers_.at(r) == 0) {
+            live_.erase(r);
+        }
+    }
+    Reg d = instr.Def();
+    if (d >= ir::VREG_BASE && readers_.contains(d) && readers_.at(d) > 0) {
+        live_.insert(d);
+    }
+
+    for (auto [succ, data] : succs_[i]) {
+        long ready = cycle_ + (data ? TimingOf(instr.op).latency : 0);
+        readyCycle_[succ] = std::max(readyCycle_[succ], ready);
+        if (--numPreds_[succ] == 0) {
+            ready_.push_back(succ);
+        }
+    }
+    cycle_ += NUM_THREADS;
+}
+
+std::vector<int> BlockScheduler::Run()
+{
+    for (int i = 0; i < static_cast<int>(instrs_.size()); i++) {
+        if (numPreds_[i] == 0) {
+            ready_.push_back(i);
+        }
+    }
+    std::vector<int> order;
+    while (!ready_.empty()) {
+        auto key = [this](int i) {
+            // rounds the thread would wait for the operands
+            long stall = std::max(0L, (readyCycle_[i] - cycle_ + NUM_THREADS - 1) / NUM_THREADS);
+            int delta = PressureDelta(i);
+            bool tooMany = static_cast<int>(live_.size()) + delta > ir::NUM_GP_REGS;
+            return std::make_tuple(stall, tooMany, tooMany ? delta : 0, i);
+        };
+        auto best = std::min_element(ready_.begin(), ready_.end(),
+                [&key](int a, int b) { return key(a) < key(b); });
+        int i = *best;
+        ready_.erase(best);
+        long stall = std::get<0>(key(i));
+        cycle_ += stall * NUM_THREADS;
+        Issue(i);
+        order.push_back(i);
+    }
+    return order;
+}
+
+} // namespace
+
+long Schedule(ir::Module &mod)
+{
+    long saved = 0;
+    for (std::size_t p = 0; p < mod.programs.size(); p++) {
+        ir::Program &prog = mod.programs[p];
+        if (prog.numBlocks == ir::Program::CONTINUATION) {
+            continue;
+        }
+        ir::Program scheduled = prog;
+        bool changed = false;
+        for (ir::Block &block : scheduled.blocks) {
+            std::vector<int> order = BlockScheduler {block.instrs}.Run();
+            std::vector<Instr> instrs;
+            for (int i : order) {
+                changed = changed || i != static_cast<int>(instrs.size());
+                instrs.push_back(block.instrs[i]);
+            }
+            block.instrs = std::move(instrs);
+        }
+        if (!changed) {
+            continue;
+        }
+        long before = EstimateCycles(prog);
+        long after = EstimateCycles(scheduled);
+        if (after < 0 || (before >= 0 && after >= before)) {
+            LOG(DEBUG, std::cerr << "schedule: program " << p << ": reordering dropped, "
+                    << after << " instead of " << before << " estimated cycles" << std::endl);
+            continue;
+        }
+        prog = std::move(scheduled);
+        if (before >= 0) {
+            saved += before - after;
+            LOG(INFO, std::cerr << "schedule: program " << p << ": " << before - after
+                    << " of an estimated " << before << " cycles saved" << std::endl);
+        } else {
+            LOG(INFO, std::cerr << "schedule: program " << p
+                    << ": reordered to fit into the registers" << std::endl);
+        }
+    }
+    return saved;
+}
+
+} // namespace opt
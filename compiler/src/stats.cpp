@@ -0,0 +1,65 @@
+#include <algorithm>
+#include <ostream>
+
+#include "stats.hpp"
+
+void CompileStats::CountPrograms(const ir::Module &mod)
+{
+    for (const ir::Program &prog : mod.programs) {
+        // continues a program that was not part of the module
+        if (prog.numBlocks == ir::Program::CONTINUATION) {
+            continue;
+        }
+        int instrs = prog.NumInstrs();
+        programs++;
+        minProgramInstrs = programs == 1 ? instrs : std::min(minProgramInstrs, instrs);
+        maxProgramInstrs = std::max(maxProgramInstrs, instrs);
+        instructions += instrs;
+    }
+}
+
+static double Millis(std::chrono::nanoseconds t)
+{
+    return std::chrono::duration<double, std::milli>(t).count();
+}
+
+void CompileStats::WriteJSON(std::ostream &stream) const
+{
+    double meanInstrs = programs == 0 ? 0.0
+        : static_cast<double>(instructions) / programs;
+    stream << "{\n"
+           << "  \"time_ms\": {\n"
+           << "    \"lex\": " << Millis(lex) << ",\n"
+           << "    \"parse\": " << Millis(parse) << ",\n"
+           << "    \"codegen\": " << Millis(codegen) << ",\n"
+           << "    \"passes\": " << Millis(passes) << ",\n"
+           << "    \"emit\": " << Millis(emit) << ",\n"
+           << "    \"total\": " << Millis(lex + parse + codegen + passes + emit) << "\n"
+           << "  },\n"
+           << "  \"statements\": " << statements << ",\n"
+           << "  \"programs\": " << programs << ",\n"
+           << "  \"instructions\": {\n"
+           << "    \"total\": " << instructions << ",\n"
+           << "    \"min_per_program\": " << minProgramInstrs << ",\n"
+           << "    \"max_per_program\": " << maxProgramInstrs << ",\n"
+           << "    \"mean_per_program\": " << meanInstrs << "\n"
+           << "  },\n"
+           << "  \"peak_registers\": " << alloc.peakRegs << ",\n"
+           << "  \"peak_data_memory\": " << alloc.peakMem << ",\n"
+           << "  \"peak_free_list_length\": " << alloc.peakFreeList << ",\n"
+           << "  \"spills\": " << alloc.spills << ",\n"
+           << "  \"memory_spills\": " << memorySpills << ",\n"
+           << "  \"fused_programs\": " << alloc.fusedPrograms << ",\n"
+           << "  \"dead_code\": {\n"
+           << "    \"statements\": " << deadStatements << ",\n"
+           << "    \"programs\": " << deadPrograms << ",\n"
+           << "    \"memory_words\": " << deadMemWords << "\n"
+           << "  },\n"
+           << "  \"estimated_cycles_saved\": " << cyclesSaved << ",\n"
+           << "  \"cache\": {\n"
+           << "    \"hits\": " << cacheHits << ",\n"
+           << "    \"misses\": " << cacheMisses << ",\n"
+           << "    \"evictions\": " << cacheEvictions << "\n"
+           << "  }\n"
+           << "}\n";
+}
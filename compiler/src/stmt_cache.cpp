@@ -0,0 +1,148 @@
+#include <algorithm>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <system_error>
+#include <thread>
+#include <vector>
+
+#include <unistd.h>
+
+#include "constants.hpp"
+#include "hash.hpp"
+#include "stmt_cache.hpp"
+
+namespace fs = std::filesystem;
+
+/// bump whenever the layout of entries changes
+constexpr int CACHE_FORMAT_VERSION = 2;
+
+StmtCache::StmtCache(const fs::path &dir, std::uintmax_t maxBytes)
+    : hits {0}, misses {0}, evictions {0},
+      dir_ {dir}, maxBytes_ {maxBytes}, salt_ {0}, enabled_ {true}
+{
+    std::error_code ec;
+    fs::create_directories(dir_, ec);
+    if (ec) {
+        std::cerr << "statement cache: could not create '" << dir_.string()
+                  << "', caching disabled" << std::endl;
+        enabled_ = false;
+    }
+
+    Fnv1a hash;
+    hash.Add(CACHE_FORMAT_VERSION);
+    hash.Add(SCREEN_WIDTH).Add(SCREEN_HEIGHT).Add(PLOT_WIDTH).Add(PLOT_HEIGHT);
+    hash.Add(BLOCK_DIM).Add(MAX_INSTR).Add(NUM_THREADS).Add(MEM_SIZE);
+    hash.Add(EQUALITY_ERROR_MARGIN).Add(X_MIN).Add(X_MAX).Add(Y_MIN).Add(Y_MAX);
+    hash.Add(Z_MIN).Add(Z_MAX).Add(MIN_INFINITY).Add(NaN);
+
+    // a rebuilt compiler may generate different code for the same input
+    fs::path exe = fs::read_symlink("/proc/self/exe", ec);
+    if (!ec) {
+        std::uintmax_t size = fs::file_size(exe, ec);
+        auto mtime = fs::last_write_time(exe, ec).time_since_epoch().count();
+        hash.Add(exe.string()).Add(size).Add(mtime);
+    }
+    salt_ = hash.Value();
+}
+
+std::uint64_t StmtCache::Key(std::uint64_t stateHash) const
+{
+    return Fnv1a().Add(salt_).Add(stateHash).Value();
+}
+
+fs::path StmtCache::EntryPath(std::uint64_t key) const
+{
+    char name[32];
+    std::snprintf(name, sizeof(name), "%016llx.stmt",
+            static_cast<unsigned long long>(key));
+    return dir_ / name;
+}
+
+bool StmtCache::Lookup(std::uint64_t key, std::string &entry)
+{
+    fs::path path = EntryPath(key);
+    std::ifstream in {path, std::ios::binary};
+    if (!enabled_ || !in) {
+        misses++;
+        return false;
+    }
+    std::ostringstream buf;
+    buf << in.rdbuf();
+    entry = buf.str();
+
+    // the modification time doubles as last use time for eviction
+    std::error_code ec;
+    fs::last_write_time(path, fs::file_time_type::clock::now(), ec);
+    hits++;
+    return true;
+}
+
+void StmtCache::Store(std::uint64_t key, const std::string &entry)
+{
+    if (!enabled_) {
+        return;
+    }
+    // write to a private file first so that concurrent compilers never see a
+    // partially written entry
+    fs::path path = EntryPath(key);
+    fs::path tmp = path;
+    tmp += ".";
+    tmp += std::to_string(getpid()) + "-"
+        + std::to_string(std::hash<std::thread::id> {}(std::this_thread::get_id()))
+        + ".tmp";
+    {
+        std::ofstream out {tmp, std::ios::binary};
+        out << entry;
+        if (!out) {
+            return;
+        }
+    }
+    std::error_code ec;
+    fs::rename(tmp, path, ec);
+    if (ec) {
+        fs::remove(tmp, ec);
+    }
+}
+
+void StmtCache::Trim()
+{
+    if (!enabled_) {
+        return;
+    }
+    struct Entry {
+        fs::file_time_type lastUse;
+        std::uintmax_t size;
+        fs::path path;
+    };
+    std::vector<Entry> entries;
+    std::uintmax_t total = 0;
+    std::error_code ec;
+    for (const fs::directory_entry &e : fs::directory_iterator(dir_, ec)) {
+        if (e.path().extension() != ".stmt") {
+            continue;
+        }
+        std::uintmax_t size = e.file_size(ec);
+        fs::file_time_type lastUse = e.last_write_time(ec);
+        if (!ec) {
+            entries.push_back({lastUse, size, e.path()});
+            total += size;
+        }
+    }
+    if (total <= maxBytes_) {
+        return;
+    }
+
+    std::sort(entries.begin(), entries.end(),
+            [](const Entry &a, const Entry &b) { return a.lastUse < b.lastUse; });
+    for (const Entry &e : entries) {
+        if (total <= maxBytes_) {
+            break;
+        }
+        if (fs::remove(e.path, ec)) {
+            total -= e.size;
+            evictions++;
+        }
+    }
+}
@@ -0,0 +1,363 @@
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <iostream>
+#include <unordered_map>
+#include <vector>
+
+#include "codegen.hpp"
+#include "ir.hpp"
+#include "log.hpp"
+#include "opt.hpp"
+
+namespace opt {
+
+namespace {
+
+using ir::Instr;
+using ir::Op;
+using ir::Reg;
+
+/// magnitudes of coefficients well inside the exponent range of TF18
+constexpr double MIN_COEFF = 0x1p-56;
+constexpr double MAX_COEFF = 0x1p56;
+
+/// Constant a register was loaded with. One loaded by a predicated lui is
+/// only known to predicated readers until the predicate is set again.
+struct Const {
+    double val;
+    bool predOnly;
+    /// value of the predicate counter when loaded
+    int predEpoch;
+};
+
+/// x -> a*x + b
+struct Affine {
+    double a = 1.0;
+    double b = 0.0;
+};
+
+/// An instruction computing an affine function of one register operand with
+/// a constant as the other one
+struct Step {
+    /// operand the function is applied to
+    Reg src = ir::NO_REG;
+    Affine f;
+    bool isDiv = false;
+};
+
+/// Affine chain on the value written by the instruction at end, made of the
+/// instructions at members in program order. The first one reads base.
+struct Chain {
+    int end;
+    std::vector<int> members;
+    Reg base;
+    Affine f;
+    bool hasDiv;
+};
+
+bool SetsPredicate(const Instr &instr)
+{
+    ir::Form form = ir::Info(instr.op).form;
+    return form == ir::Form::CMP_RR || form == ir::Form::CMP_RI;
+}
+
+/// whether c is a TF18 value. Coefficients which would have to be rounded
+/// give up more precision than the fewer roundings of the canonical form win,
+/// most of all where the result is truncated to a pixel coordinate.
+bool Exact(double c)
+{
+    return c == 0.0 || (std::fabs(c) >= MIN_COEFF && std::fabs(c) <= MAX_COEFF
+        && CodeGen::RoundTF18(c) == c);
+}
+
+/// g after f
+Affine Compose(const Affine &f, const Affine &g)
+{
+    return {g.a * f.a, g.a * f.b + g.b};
+}
+
+class BlockStrength
+{
+public:
+    BlockStrength(std::vector<Instr> &instrs, Reg &nextReg)
+        : instrs_ {instrs}, nextReg_ {nextReg}
+    {}
+
+    /// Finds the chains and rewrites the ones which get shorter or only turn
+    /// divisions into multiplications. Returns the number of divisions
+    /// by constants which were removed.
+    int Run(int &chains);
+private:
+    void Analyse();
+    bool Collect(int end, Chain &chain) const;
+    bool Profitable(const Chain &chain) const;
+    std::vector<Instr> Canonical(const Chain &chain);
+
+    std::vector<Instr> &instrs_;
+    Reg &nextReg_;
+    std::vector<Step> steps_;
+    /// affine instruction whose value an affine instruction reads, or -1
+    std::vector<int> parent_;
+    /// instructions reading the value an instruction writes
+    std::vector<int> readers_;
+};
+
+void BlockStrength::Analyse()
+{
+    int n = instrs_.size();
+    steps_.assign(n, Step {});
+    parent_.assign(n, -1);
+    readers_.assign(n, 0);
+
+    std::unordered_map<Reg, Const> consts;
+    consts[ir::ZERO] = {.val = 0.0, .predOnly = false, .predEpoch = 0};
+    std::unordered_map<Reg, int> lastDef;
+    int predEpoch = 0;
+    for (int i = 0; i < n; i++) {
+        const Instr &instr = instrs_[i];
+        auto known = [&](Reg r) {
+            auto it = consts.find(r);
+            return it != consts.end()
+                && (!it->second.predOnly || (instr.pred && it->second.predEpoch == predEpoch));
+        };
+        auto val = [&](Reg r) { return consts.at(r).val; };
+
+        Step step;
+        switch (instr.op) {
+        case Op::FADD:
+        case Op::FMUL:
+            if (known(instr.rb) != known(instr.ra)) {
+                Reg c = known(instr.rb) ? instr.rb : instr.ra;
+                step.src = c == instr.rb ? instr.ra : instr.rb;
+                step.f = instr.op == Op::FADD ? Affine {1.0, val(c)} : Affine {val(c), 0.0};
+            }
+            break;
+        case Op::FSUB:
+            if (known(instr.rb) && !known(instr.ra)) {
+                step.src = instr.ra;
+                step.f = {1.0, -val(instr.rb)};
+            } else if (known(instr.ra) && !known(instr.rb)) {
+                step.src = instr.rb;
+                step.f = {-1.0, val(instr.ra)};
+            }
+            break;
+        case Op::FDIV:
+            if (known(instr.rb) && !known(instr.ra) && val(instr.rb) != 0.0) {
+                step.src = instr.ra;
+                step.f = {1.0 / val(instr.rb), 0.0};
+                step.isDiv = true;
+            }
+            break;
+        default:
+            break;
+        }
+        steps_[i] = step;
+
+        // a predicated write keeps the old value in the other lanes
+        std::vector<Reg> reads;
+        for (Reg r : instr.Uses()) {
+            if (r != ir::NO_REG && std::find(reads.begin(), reads.end(), r) == reads.end()) {
+                reads.push_back(r);
+            }
+        }
+        Reg d = instr.Def();
+        if (instr.pred && d != ir::NO_REG
+                && std::find(reads.begin(), reads.end(), d) == reads.end()) {
+            reads.push_back(d);
+        }
+        for (Reg r : reads) {
+            auto def = lastDef.find(r);
+            if (def != lastDef.end()) {
+                readers_[def->second]++;
+            }
+        }
+        if (step.src != ir::NO_REG) {
+            auto def = lastDef.find(step.src);
+            if (def != lastDef.end() && steps_[def->second].src != ir::NO_REG
+                    && instrs_[def->second].pred == instr.pred) {
+                parent_[i] = def->second;
+            }
+        }
+
+        if (SetsPredicate(instr)) {
+            predEpoch++;
+        }
+        if (d == ir::NO_REG) {
+            continue;
+        }
+        lastDef[d] = i;
+        consts.erase(d);
+        if (instr.op == Op::LUI && instr.tf18) {
+            consts[d] = {.val = CodeGen::TF18IntToDouble(instr.imm), .predOnly = instr.pred,
+                .predEpoch = predEpoch};
+        }
+    }
+}
+
+/// Walks back from end over the instructions whose value is only read by the
+/// next one of the chain. Returns false if the base is overwritten or the
+/// predicate changes before end.
+bool BlockStrength::Collect(int end, Chain &chain) const
+{
+    chain.end = end;
+    chain.members = {end};
+    for (int p = parent_[end]; p >= 0 && readers_[p] == 1; p = parent_[p]) {
+        chain.members.push_back(p);
+    }
+    std::reverse(chain.members.begin(), chain.members.end());
+    int first = chain.members.front();
+    chain.base = steps_[first].src;
+    chain.f = {};
+    chain.hasDiv = false;
+    for (int m : chain.members) {
+        chain.f = Compose(chain.f, steps_[m].f);
+        chain.hasDiv = chain.hasDiv || steps_[m].isDiv;
+    }
+
+    bool pred = instrs_[end].pred;
+    for (int k = first; k <= end; k++) {
+        bool member = std::binary_search(chain.members.begin(), chain.members.end(), k);
+        if (k > first && pred && SetsPredicate(instrs_[k])) {
+            return false;
+        }
+        if (!member && instrs_[k].Def() == chain.base) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool BlockStrength::Profitable(const Chain &chain) const
+{
+    const Affine &f = chain.f;
+    if (f.a == 0.0 || !Exact(f.a) || !Exact(f.b)) {
+        return false;
+    }
+    int ops = std::max(1, (f.a != 1.0) + (f.b != 0.0));
+    if (ops < static_cast<int>(chain.members.size())) {
+        return true;
+    }
+    // as many instructions as before: a division by a power of two becomes a
+    // multiplication, which rounds the same
+    return chain.members.size() == 1 && chain.hasDiv;
+}
+
+/// a*base + b written to the destination of the last instruction of chain
+std::vector<Instr> BlockStrength::Canonical(const Chain &chain)
+{
+    const Instr &last = instrs_[chain.end];
+    Reg rd = last.rd;
+    std::vector<Instr> out;
+    auto constant = [&](double val) {
+        Reg r = nextReg_++;
+        Instr load = ir::Make(Op::LUI, {r}, CodeGen::DoubleToTF18Int(val));
+        load.tf18 = true;
+        out.push_back(load);
+        return r;
+    };
+
+    Reg src = chain.base;
+    if (chain.f.a != 1.0) {
+        Reg a = constant(chain.f.a);
+        out.push_back(ir::Make(Op::FMUL, {rd, src, a}));
+        src = rd;
+    }
+    if (chain.f.b != 0.0) {
+        Reg b = constant(chain.f.b);
+        out.push_back(ir::Make(Op::FADD, {rd, src, b}));
+        src = rd;
+    }
+    if (src != rd) {
+        out.push_back(ir::Make(Op::ADDI, {rd, src}, 0));
+    }
+    for (Instr &instr : out) {
+        instr.pred = instr.op != Op::LUI && last.pred;
+    }
+    return out;
+}
+
+int BlockStrength::Run(int &chains)
+{
+    Analyse();
+    int n = instrs_.size();
+    // instructions whose value is read by the next one of a chain are only
+    // looked at as part of the chain ending after them
+    std::vector<bool> inner(n, false);
+    for (int i = 0; i < n; i++) {
+        if (parent_[i] >= 0 && readers_[parent_[i]] == 1) {
+            inner[parent_[i]] = true;
+        }
+    }
+
+    int divs = 0;
+    std::vector<bool> dead(n, false);
+    std::unordered_map<int, std::vector<Instr>> replaced;
+    for (int i = 0; i < n; i++) {
+        Chain chain;
+        if (steps_[i].src == ir::NO_REG || inner[i] || !Collect(i, chain)
+                || !Profitable(chain)) {
+            continue;
+        }
+        for (int m : chain.members) {
+            dead[m] = true;
+            divs += steps_[m].isDiv;
+        }
+        replaced[i] = Canonical(chain);
+        chains += chain.members.size() > 1;
+    }
+    if (replaced.empty()) {
+        return 0;
+    }
+
+    std::vector<Instr> out;
+    for (int i = 0; i < n; i++) {
+        auto it = replaced.find(i);
+        if (it != replaced.end()) {
+            out.insert(out.end(), it->second.begin(), it->second.end());
+        } else if (!dead[i]) {
+            out.push_back(instrs_[i]);
+        }
+    }
+    instrs_ = std::move(out);
+    return divs;
+}
+
+} // namespace
+
+void ReduceStrength(ir::Module &mod)
+{
+    for (std::size_t p = 0; p < mod.programs.size(); p++) {
+        ir::Program &prog = mod.programs[p];
+        // its registers are shared with the program it continues
+        if (prog.numBlocks == ir::Program::CONTINUATION) {
+            continue;
+        }
+        Reg nextReg = ir::VREG_BASE;
+        for (const ir::Block &block : prog.blocks) {
+            for (const Instr &instr : block.instrs) {
+                for (Reg r : {instr.rd, instr.ra, instr.rb}) {
+                    nextReg = std::max(nextReg, r + 1);
+                }
+            }
+        }
+
+        int before = prog.NumInstrs();
+        int divs = 0;
+        int chains = 0;
+        for (ir::Block &block : prog.blocks) {
+            BlockStrength strength {block.instrs, nextReg};
+            divs += strength.Run(chains);
+        }
+        if (divs == 0 && chains == 0) {
+            continue;
+        }
+        RemoveDeadCode(prog);
+        LOG(INFO, std::cerr << "strength: program " << p << ": " << divs
+                << " divisions by constants and " << chains
+                << " affine chains rewritten, " << before - prog.NumInstrs()
+                << " of " << before << " instructions removed" << std::endl);
+    }
+}
+
+} // namespace opt
@@ -32,7 +32,7 @@ for dir in $test_dirs; do
         while read -r line; do
             echo "$line" >> $(printf "${basename}%03d.asm" $file_no)
             [[ "$line" == "exit" ]] && file_no=$((file_no + 1))
-        done <<< $(./compiler/bin/conv "$src_file" 2>"$out_dir"/ast_printed.txt)
+        done <<< $(./compiler/bin/conv --log-level info "$src_file" 2>"$out_dir"/ast_printed.txt)
         chown 1000:1000 "${src_file%.m}"*.asm
     fi
     echo -e "\tGenerate testbench and test script..."
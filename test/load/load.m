@@ -0,0 +1,11 @@
+.load $npy "test/load/weights.npy"
+.load $fortran "test/load/weights_fortran.npy"
+.load $raw "test/load/weights.bin"
+$check = |3,10|[
+0.00, 0.25, 0.50, 0.75, 1.00, 1.25, 1.50, 1.75, 2.00, 2.25,
+2.50, 2.75, 3.00, 3.25, 3.50, 3.75, 4.00, 4.25, 4.50, 4.75,
+5.00, 5.25, 5.50, 5.75, 6.00, 6.25, 6.50, 6.75, 7.00, 7.25]
+.plot $npy 0.0 8.0
+.plot $fortran 0.0 8.0
+.plot $raw 0.0 8.0
+.plot $check 0.0 8.0